@@ -0,0 +1,99 @@
+/* -*- mode:C; c-file-style: "bsd" -*- */
+/*
+ * Copyright (c) 2017 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Throughput of the CRC16 implementations, against yubikey_crc16() of
+ * libyubikey. Needs no key and is not run by "make check".
+ *
+ * Each implementation checksums a configuration block (as
+ * yk_write_command() does for every write, and an offline configuration
+ * generator for every block it makes) and a 4 KiB buffer, and the time
+ * per call is printed in nanoseconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <yubikey.h>
+
+#include <ykcore.h>
+#include <ykdef.h>
+#include <yktime.h>
+
+#define DEFAULT_ROUNDS	1000000
+#define BIG_SIZE	4096
+
+static const char *names[] = { "libyubikey", "bitwise", "slice8", "pclmul" };
+
+static volatile uint16_t sink;
+
+static void _run(int impl, const uint8_t *buf, size_t len, long rounds)
+{
+	uint64_t start;
+	long i;
+
+	if (impl && !yk_crc16_set_impl(impl)) {
+		printf("%-10s %5lu bytes: not available\n", names[impl],
+		       (unsigned long)len);
+		return;
+	}
+	start = yk__now_us();
+	if (impl) {
+		for (i = 0; i < rounds; i++)
+			sink = yk_crc16(buf, len);
+	} else {
+		for (i = 0; i < rounds; i++)
+			sink = yubikey_crc16(buf, len);
+	}
+	printf("%-10s %5lu bytes: %8.1f ns/call\n", names[impl],
+	       (unsigned long)len,
+	       (yk__now_us() - start) * 1000.0 / rounds);
+}
+
+int main(int argc, char **argv)
+{
+	long rounds = argc > 1 ? atol(argv[1]) : DEFAULT_ROUNDS;
+	uint8_t *buf;
+	int impl;
+	size_t i;
+
+	if (rounds <= 0 || !(buf = malloc(BIG_SIZE)))
+		return 1;
+	for (i = 0; i < BIG_SIZE; i++)
+		buf[i] = rand() & 0xff;
+
+	for (impl = 0; impl <= YK_CRC16_PCLMUL; impl++)
+		_run(impl, buf, sizeof(struct config_st), rounds);
+	for (impl = 0; impl <= YK_CRC16_PCLMUL; impl++)
+		_run(impl, buf, BIG_SIZE, rounds / 64);
+
+	free(buf);
+	return 0;
+}
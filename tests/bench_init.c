@@ -0,0 +1,134 @@
+/* -*- mode:C; c-file-style: "bsd" -*- */
+/*
+ * Copyright (c) 2017 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Per-thread cost of setting up the library, for short-lived worker
+ * threads that call yk_init() and yk_release() around every job the way
+ * tests/test_threaded_calls.c does. Needs no key and is not run by
+ * "make check".
+ *
+ * "context" pairs yk_context_new() and yk_context_free(), which start and
+ * stop the USB backend every time, as yk_init() and yk_release() used to.
+ * "init" pairs yk_init() and yk_release() on the shared default context.
+ * Each round runs one thread, and min/median/99th percentile/max of the
+ * time spent in the pair are printed in microseconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#define THREAD_T			HANDLE
+#define THREAD_RETURN			DWORD WINAPI
+#define spawn_thread(t, fn, arg)	((t = CreateThread(NULL, 0, fn, arg, 0, NULL)) == NULL)
+#define join_thread(t)			(WaitForSingleObject(t, INFINITE), CloseHandle(t))
+#else
+#include <pthread.h>
+#define THREAD_T			pthread_t
+#define THREAD_RETURN			void *
+#define spawn_thread(t, fn, arg)	pthread_create(&t, NULL, fn, arg)
+#define join_thread(t)			pthread_join(t, NULL)
+#endif
+
+#include <ykpers.h>
+#include <ykcore.h>
+#include <yktime.h>
+
+#define DEFAULT_ROUNDS	200
+
+struct job_st {
+	int shared;
+	int ok;
+	uint64_t elapsed;
+};
+
+static THREAD_RETURN _job(void *arg)
+{
+	struct job_st *job = arg;
+	uint64_t start = yk__now_us();
+
+	if (job->shared) {
+		job->ok = yk_init() && yk_release();
+	} else {
+		YK_CONTEXT *ctx = yk_context_new();
+
+		job->ok = ctx && yk_context_free(ctx);
+	}
+	job->elapsed = yk__now_us() - start;
+	return 0;
+}
+
+static int _cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int _run(const char *what, int shared, uint64_t *t, int n)
+{
+	struct job_st job;
+	THREAD_T thread;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		job.shared = shared;
+		job.ok = 0;
+		if (spawn_thread(thread, _job, &job))
+			return 0;
+		join_thread(thread);
+		if (!job.ok) {
+			fprintf(stderr, "%s: %s\n", what, yk_strerror(yk_errno));
+			return 0;
+		}
+		t[i] = job.elapsed;
+	}
+	qsort(t, n, sizeof(uint64_t), _cmp);
+	printf("%-12s min %7lu  p50 %7lu  p99 %7lu  max %7lu us\n", what,
+	       (unsigned long)t[0], (unsigned long)t[n / 2],
+	       (unsigned long)t[n * 99 / 100], (unsigned long)t[n - 1]);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : DEFAULT_ROUNDS;
+	uint64_t *t;
+	int rc;
+
+	if (rounds <= 0 || !(t = malloc(rounds * sizeof(uint64_t))))
+		return 1;
+
+	rc = _run("context", 0, t, rounds) && _run("init", 1, t, rounds);
+
+	free(t);
+	return rc ? 0 : 1;
+}
@@ -0,0 +1,118 @@
+/* -*- mode:C; c-file-style: "bsd" -*- */
+/*
+ * Copyright (c) 2017 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Latency of the USB backend, for comparing backends against each other.
+ * Needs a key plugged in and is not run by "make check"; build the tree
+ * with each --with-backend and run tests/bench_key_latency on the same key.
+ *
+ * Measures opening and closing the key, a status read and a serial read,
+ * and prints min/median/99th percentile/max in microseconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ykpers.h>
+#include <ykcore.h>
+#include <yktime.h>
+
+#define DEFAULT_ROUNDS	200
+
+static int _cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void _report(const char *what, uint64_t *t, int n)
+{
+	qsort(t, n, sizeof(uint64_t), _cmp);
+	printf("%-12s min %7lu  p50 %7lu  p99 %7lu  max %7lu us\n", what,
+	       (unsigned long)t[0], (unsigned long)t[n / 2],
+	       (unsigned long)t[n * 99 / 100], (unsigned long)t[n - 1]);
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : DEFAULT_ROUNDS;
+	uint64_t *t, start;
+	unsigned int serial;
+	YK_STATUS *st;
+	YK_KEY *yk;
+	int i;
+
+	if (rounds <= 0 || !(t = malloc(rounds * sizeof(uint64_t))))
+		return 1;
+	if (!yk_init())
+		return 1;
+
+	for (i = 0; i < rounds; i++) {
+		start = yk__now_us();
+		if (!(yk = yk_open_key(0))) {
+			fprintf(stderr, "no key: %s\n", yk_strerror(yk_errno));
+			return 1;
+		}
+		yk_close_key(yk);
+		t[i] = yk__now_us() - start;
+	}
+	_report("open+close", t, rounds);
+
+	yk = yk_open_key(0);
+	st = ykds_alloc();
+	if (!yk || !st)
+		return 1;
+	for (i = 0; i < rounds; i++) {
+		start = yk__now_us();
+		if (!yk_get_status(yk, st))
+			return 1;
+		t[i] = yk__now_us() - start;
+	}
+	_report("status", t, rounds);
+
+	for (i = 0; i < rounds; i++) {
+		start = yk__now_us();
+		if (!yk_get_serial(yk, 0, 0, &serial))
+			break;
+		t[i] = yk__now_us() - start;
+	}
+	if (i == rounds)
+		_report("serial", t, rounds);
+	else
+		printf("serial       not readable from this key\n");
+
+	ykds_free(st);
+	yk_close_key(yk);
+	yk_release();
+	free(t);
+	return 0;
+}
@@ -0,0 +1,152 @@
+/* -*- mode:C; c-file-style: "bsd" -*- */
+/*
+ * Copyright (c) 2017 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Open keys by serial number through the cache of yk_open_key_by_serial(),
+ * on more emulated keys than the cache holds. Only built with
+ * --with-backend=emulator.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include <ykcore.h>
+
+#define NKEYS	70
+#define SERIAL	7000
+
+static char cache[1024];
+
+static void _write_cache(const char *content)
+{
+	FILE *f = fopen(cache, "w");
+
+	assert(f);
+	assert(fputs(content, f) >= 0);
+	assert(fclose(f) == 0);
+}
+
+/* Number of entries in the cache, and whether 'serial' is at 'index' */
+static int _cache_lines(unsigned int serial, int index, int *found)
+{
+	char path[256];
+	unsigned int s;
+	int vid, pid, n = 0;
+	FILE *f = fopen(cache, "r");
+
+	*found = 0;
+	if (!f)
+		return 0;
+	while (fscanf(f, "%u %255s %x %x", &s, path, &vid, &pid) == 4) {
+		char expect[32];
+
+		snprintf(expect, sizeof(expect), "emulator:%d", index);
+		if (s == serial && strcmp(path, expect) == 0)
+			*found = 1;
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+static void _open_check(unsigned int serial)
+{
+	unsigned int s;
+	YK_KEY *yk;
+
+	assert((yk = yk_open_key_by_serial(serial)));
+	assert(yk_get_serial(yk, 0, 0, &s));
+	assert(s == serial);
+	assert(yk_close_key(yk));
+}
+
+static void _test_scan(void)
+{
+	int found;
+
+	/* The scan stops at the key looked for */
+	remove(cache);
+	_open_check(SERIAL + 2);
+	assert(_cache_lines(SERIAL + 2, 2, &found) == 3 && found);
+
+	/* A key past what the cache holds is still found, and remembered */
+	_open_check(SERIAL + NKEYS - 1);
+	assert(_cache_lines(SERIAL + NKEYS - 1, NKEYS - 1, &found) == 64);
+	assert(found);
+
+	assert(!yk_open_key_by_serial(SERIAL + NKEYS));
+	assert(yk_errno == YK_ENOKEY);
+}
+
+static void _test_hit(void)
+{
+	int found;
+
+	/* A cached location is used as it is, without rewriting the cache */
+	_write_cache("7005 emulator:5 1050 410\n");
+	_open_check(SERIAL + 5);
+	assert(_cache_lines(SERIAL + 5, 5, &found) == 1 && found);
+}
+
+static void _test_stale(void)
+{
+	int found;
+
+	/* The key isn't where the cache says, it is looked for and the
+	   entries for the keys not looked at are kept */
+	_write_cache("7004 emulator:6 1050 410\n7050 emulator:50 1050 410\n");
+	_open_check(SERIAL + 4);
+	assert(_cache_lines(SERIAL + 4, 4, &found) == 6 && found);
+	assert(_cache_lines(SERIAL + 50, 50, &found) == 6 && found);
+}
+
+int main(void)
+{
+	char dir[] = "/tmp/test_cache.XXXXXX";
+
+	assert(mkdtemp(dir));
+	snprintf(cache, sizeof(cache), "%s/ykpers-serials", dir);
+	setenv("XDG_RUNTIME_DIR", dir, 1);
+	setenv("YK_EMULATOR_KEYS", "70", 1);
+	setenv("YK_EMULATOR_SERIAL", "7000", 1);
+	assert(yk_init());
+
+	_test_scan();
+	_test_hit();
+	_test_stale();
+
+	assert(yk_release());
+	remove(cache);
+	rmdir(dir);
+	return 0;
+}
@@ -0,0 +1,112 @@
+/* -*- mode:C; c-file-style: "bsd" -*- */
+/*
+ * Copyright (c) 2017 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Check every CRC16 implementation the CPU allows against yubikey_crc16()
+ * of libyubikey, over all short lengths, odd alignments and buffers fed
+ * in pieces.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <yubikey.h>
+
+#include <ykcore.h>
+#include <ykdef.h>
+
+#define BUF_SIZE	600
+
+static const char *names[] = { "auto", "bitwise", "slice8", "pclmul" };
+
+static void _test_impl(int impl, const uint8_t *buf)
+{
+	size_t len, off, split;
+
+	if (!yk_crc16_set_impl(impl)) {
+		assert(impl == YK_CRC16_PCLMUL);
+		assert(yk_errno == YK_ENOTYETIMPL);
+		printf("%s: not available\n", names[impl]);
+		return;
+	}
+	printf("%s\n", names[impl]);
+
+	for (off = 0; off < 16; off++) {
+		for (len = 0; len + off <= BUF_SIZE / 2; len++)
+			assert(yk_crc16(buf + off, len) ==
+			       yubikey_crc16(buf + off, len));
+	}
+	for (len = BUF_SIZE / 2; len <= BUF_SIZE; len += 7)
+		assert(yk_crc16(buf, len) == yubikey_crc16(buf, len));
+
+	/* Pieces, cut at every point */
+	for (split = 0; split <= 200; split++) {
+		uint16_t crc = yk_crc16_update(0xffff, buf, split);
+
+		crc = yk_crc16_update(crc, buf + split, 200 - split);
+		assert(crc == yubikey_crc16(buf, 200));
+	}
+}
+
+static void _test_residual(const uint8_t *buf)
+{
+	struct config_st cfg;
+
+	memcpy(&cfg, buf, sizeof(cfg));
+	cfg.crc = ~yk_crc16((const uint8_t *)&cfg,
+			    sizeof(cfg) - sizeof(cfg.crc));
+	cfg.crc = yk_endian_swap_16(cfg.crc);
+	assert(yk_crc16((const uint8_t *)&cfg, sizeof(cfg)) ==
+	       YK_CRC_OK_RESIDUAL);
+}
+
+int main(void)
+{
+	uint8_t buf[BUF_SIZE];
+	size_t i;
+
+	srand(4711);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = rand() & 0xff;
+
+	assert(!yk_crc16_set_impl(17) && yk_errno == YK_EINVAL);
+
+	_test_impl(YK_CRC16_BITWISE, buf);
+	_test_impl(YK_CRC16_SLICE8, buf);
+	_test_impl(YK_CRC16_PCLMUL, buf);
+	_test_impl(YK_CRC16_AUTO, buf);
+	assert(yk_crc16_get_impl() != YK_CRC16_AUTO);
+
+	_test_residual(buf);
+
+	return 0;
+}
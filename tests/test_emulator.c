@@ -0,0 +1,975 @@
+/* -*- mode:C; c-file-style: "bsd" -*- */
+/*
+ * Copyright (c) 2017 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Program and use a key on the emulator backend. Only built with
+ * --with-backend=emulator.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <ykpers.h>
+#include <ykdef.h>
+#include "sha.h"
+
+static const char hmac_key[KEY_SIZE_OATH] =
+	"\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a"
+	"\x0b\x0c\x0d\x0e\x0f\x10\x11\x12\x13\x14";
+
+static int _pgm_seq(YK_KEY *yk)
+{
+	YK_STATUS *st = ykds_alloc();
+	int seq;
+
+	assert(yk_get_status(yk, st));
+	seq = ykds_pgm_seq(st);
+	ykds_free(st);
+	return seq;
+}
+
+static YKP_CONFIG *_hmac_config(YK_KEY *yk, unsigned char *new_acc)
+{
+	YK_STATUS *st = ykds_alloc();
+	YKP_CONFIG *cfg = ykp_alloc();
+
+	assert(yk_get_status(yk, st));
+	ykp_configure_version(cfg, st);
+	assert(ykp_configure_command(cfg, SLOT_CONFIG2));
+	assert(ykp_set_tktflag_CHAL_RESP(cfg, true));
+	assert(ykp_set_cfgflag_CHAL_HMAC(cfg, true));
+	assert(ykp_set_cfgflag_HMAC_LT64(cfg, true));
+	assert(ykp_HMAC_key_from_raw(cfg, hmac_key) == 0);
+	if (new_acc)
+		assert(ykp_set_access_code(cfg, new_acc, ACC_CODE_SIZE));
+	ykds_free(st);
+	return cfg;
+}
+
+static int _write_hmac(YK_KEY *yk, unsigned char *new_acc,
+		       unsigned char *cur_acc)
+{
+	YKP_CONFIG *cfg = _hmac_config(yk, new_acc);
+	int rc;
+
+	rc = yk_write_command(yk, ykp_core_config(cfg), ykp_command(cfg),
+			      cur_acc);
+	ykp_free_config(cfg);
+	return rc;
+}
+
+static void _test_serial(YK_KEY *yk)
+{
+	unsigned int serial = 0;
+
+	assert(yk_get_serial(yk, 0, 0, &serial));
+	assert(serial == 4242);
+}
+
+static void _test_hmac(YK_KEY *yk)
+{
+	const unsigned char challenge[] = "emulated challenge";
+	unsigned char response[SHA1_MAX_BLOCK_SIZE];
+	uint8_t expect[USHAMaxHashSize];
+	int seq = _pgm_seq(yk);
+
+	assert(_write_hmac(yk, NULL, NULL));
+	assert(_pgm_seq(yk) == seq + 1);
+
+	assert(yk_challenge_response(yk, SLOT_CHAL_HMAC2, 1,
+				     sizeof(challenge) - 1, challenge,
+				     sizeof(response), response));
+	hmac(SHA1, challenge, sizeof(challenge) - 1,
+	     (const unsigned char *)hmac_key, sizeof(hmac_key), expect);
+	assert(memcmp(response, expect, SHA1_DIGEST_SIZE) == 0);
+
+	/* Slot 1 is not set up for challenge-response */
+	assert(!yk_challenge_response(yk, SLOT_CHAL_HMAC1, 1,
+				      sizeof(challenge) - 1, challenge,
+				      sizeof(response), response));
+}
+
+static void _test_batch(YK_KEY *yk)
+{
+	const unsigned char *challenges[3] = {
+		(const unsigned char *)"0: a challenge",
+		(const unsigned char *)"1: a challenge",
+		(const unsigned char *)"2: a challenge",
+	};
+	unsigned char buf[3][SHA1_MAX_BLOCK_SIZE];
+	unsigned char *responses[3] = { buf[0], buf[1], buf[2] };
+	uint8_t expect[USHAMaxHashSize];
+	int status[3];
+	YK_BATCH_STATS stats;
+	YK_TIMEOUTS t, saved;
+	unsigned int i, len = 14;
+
+	assert(yk_challenge_response_batch(yk, SLOT_CHAL_HMAC2, 1, 3, len,
+					   challenges, SHA1_MAX_BLOCK_SIZE,
+					   responses, status, &stats));
+	assert(stats.done == 3);
+	for (i = 0; i < 3; i++) {
+		assert(status[i] == 0);
+		hmac(SHA1, challenges[i], len,
+		     (const unsigned char *)hmac_key, sizeof(hmac_key), expect);
+		assert(memcmp(responses[i], expect, SHA1_DIGEST_SIZE) == 0);
+	}
+
+	/* The start of the first challenge never reaches the key, so it gets
+	   no answer: the batch fails with its error though the rest succeed */
+	assert(yk_get_timeouts(yk, &saved));
+	t = saved;
+	t.response_ms = 50;
+	assert(yk_set_timeouts(yk, &t));
+	setenv("YK_EMULATOR_FAULTS", "ok,drop", 1);
+	assert(!yk_challenge_response_batch(yk, SLOT_CHAL_HMAC2, 1, 3, len,
+					    challenges, SHA1_MAX_BLOCK_SIZE,
+					    responses, status, &stats));
+	assert(yk_errno == YK_ETIMEOUT);
+	assert(status[0] == YK_ETIMEOUT);
+	assert(status[1] == 0 && status[2] == 0);
+	assert(stats.done == 2);
+	unsetenv("YK_EMULATOR_FAULTS");
+	assert(yk_set_timeouts(yk, &saved));
+}
+
+/* Without a session every report claims the key and releases it, with
+   one the key is claimed once */
+static void _test_sessions(YK_KEY *yk)
+{
+	const unsigned char *challenges[2] = {
+		(const unsigned char *)"0: in a session",
+		(const unsigned char *)"1: in a session",
+	};
+	unsigned char buf[2][SHA1_MAX_BLOCK_SIZE];
+	unsigned char *responses[2] = { buf[0], buf[1] };
+	unsigned long claims, releases, c, r;
+	unsigned int last_op;
+	int status[2];
+
+	assert(yk_get_claim_counts(yk, &c, &r));
+	_test_serial(yk);
+	assert(yk_get_transfer_counts(yk, &last_op, NULL));
+	assert(yk_get_claim_counts(yk, &claims, &releases));
+	assert(claims - c == last_op && releases - r == last_op);
+
+	c = claims;
+	r = releases;
+	assert(yk_begin_session(yk));
+	_test_serial(yk);
+	_test_serial(yk);
+	assert(yk_end_session(yk));
+	assert(!yk_end_session(yk));
+	assert(yk_get_claim_counts(yk, &claims, &releases));
+	assert(claims - c == 1 && releases - r == 1);
+
+	/* A batch holds a session of its own */
+	c = claims;
+	r = releases;
+	assert(yk_challenge_response_batch(yk, SLOT_CHAL_HMAC2, 1, 2, 15,
+					   challenges, SHA1_MAX_BLOCK_SIZE,
+					   responses, status, NULL));
+	assert(yk_get_claim_counts(yk, &claims, &releases));
+	assert(claims - c == 1 && releases - r == 1);
+}
+
+static void _test_access_code(YK_KEY *yk)
+{
+	unsigned char acc[ACC_CODE_SIZE] = { 1, 2, 3, 4, 5, 6 };
+	int seq;
+
+	assert(_write_hmac(yk, acc, NULL));
+	seq = _pgm_seq(yk);
+
+	/* Wrong access code, the key is left as it was */
+	assert(!_write_hmac(yk, NULL, NULL));
+	assert(_pgm_seq(yk) == seq);
+
+	/* Erasing the only programmed slot resets pgmSeq */
+	assert(yk_write_command(yk, NULL, SLOT_CONFIG2, acc));
+	assert(_pgm_seq(yk) == 0);
+}
+
+static void _test_frame_plan(YK_KEY *yk)
+{
+	const unsigned char challenge[] = "planned challenge";
+	unsigned char saved[YK_FRAME_PLAN_MAX_SIZE];
+	unsigned char response[SHA1_MAX_BLOCK_SIZE];
+	uint8_t expect[USHAMaxHashSize];
+	YKP_CONFIG *cfg = _hmac_config(yk, NULL);
+	YK_FRAME_PLAN *plan;
+	size_t len;
+	int seq = _pgm_seq(yk);
+
+	/* Encode, save and load again, as a provisioning station would */
+	assert((plan = yk_frame_plan_config(ykp_core_config(cfg),
+					    ykp_command(cfg), NULL)));
+	ykp_free_config(cfg);
+	assert(yk_frame_plan_save(plan, NULL, 0, &len));
+	assert(len <= sizeof(saved));
+	assert(!yk_frame_plan_save(plan, saved, len - 1, &len));
+	assert(yk_errno == YK_EWRONGSIZ);
+	assert(yk_frame_plan_save(plan, saved, sizeof(saved), &len));
+	yk_frame_plan_free(plan);
+
+	/* The all-zero reports of the frame are left out */
+	assert(len < YK_FRAME_PLAN_MAX_SIZE);
+
+	assert(!yk_frame_plan_load(saved, len - 1) && yk_errno == YK_EINVAL);
+	saved[5] ^= 1;
+	assert(!yk_frame_plan_load(saved, len) && yk_errno == YK_ECHECKSUM);
+	saved[5] ^= 1;
+	assert((plan = yk_frame_plan_load(saved, len)));
+
+	assert(yk_write_plan(yk, plan));
+	yk_frame_plan_free(plan);
+	assert(_pgm_seq(yk) == seq + 1);
+
+	assert(yk_challenge_response(yk, SLOT_CHAL_HMAC2, 1,
+				     sizeof(challenge) - 1, challenge,
+				     sizeof(response), response));
+	hmac(SHA1, challenge, sizeof(challenge) - 1,
+	     (const unsigned char *)hmac_key, sizeof(hmac_key), expect);
+	assert(memcmp(response, expect, SHA1_DIGEST_SIZE) == 0);
+}
+
+static void _test_read_response(YK_KEY *yk)
+{
+	const unsigned char challenge[] = "exact challenge";
+	unsigned char capa[15], serial[SERIAL_NUMBER_SIZE];
+	unsigned char response[SHA1_DIGEST_SIZE];
+	uint8_t expect[USHAMaxHashSize];
+	unsigned int len;
+
+	/* Buffers the exact size of the response are enough */
+	assert(yk_write_to_key(yk, SLOT_DEVICE_SERIAL, serial, 0));
+	assert(yk_read_response(yk, 0, 0, serial, sizeof(serial),
+				SERIAL_NUMBER_SIZE, &len));
+	assert(len == SERIAL_NUMBER_SIZE);
+	assert(serial[2] == (4242 >> 8) && serial[3] == (4242 & 0xff));
+
+	len = sizeof(capa);
+	assert(yk_get_capabilities(yk, 0, 0, capa, &len));
+	assert(len == sizeof(capa) && capa[0] == sizeof(capa) - 1);
+	assert(memcmp(capa + len - 4, serial, 4) == 0);
+
+	len = sizeof(capa) - 1;
+	assert(!yk_get_capabilities(yk, 0, 0, capa, &len));
+	assert(yk_errno == YK_EWRONGSIZ);
+
+	assert(yk_challenge_response(yk, SLOT_CHAL_HMAC2, 1,
+				     sizeof(challenge) - 1, challenge,
+				     sizeof(response), response));
+	hmac(SHA1, challenge, sizeof(challenge) - 1,
+	     (const unsigned char *)hmac_key, sizeof(hmac_key), expect);
+	assert(memcmp(response, expect, SHA1_DIGEST_SIZE) == 0);
+	assert(!yk_challenge_response(yk, SLOT_CHAL_HMAC2, 1,
+				      sizeof(challenge) - 1, challenge,
+				      sizeof(response) - 1, response));
+	assert(yk_errno == YK_EWRONGSIZ);
+}
+
+static void _test_timing(YK_KEY *yk)
+{
+	char path[] = "/tmp/yktimingXXXXXX";
+	unsigned long expect_us, samples, loaded_us;
+	unsigned int last_wait;
+	int fd, i;
+
+	assert(yk_timing_reset());
+	assert(yk_set_poll_policy(yk, YK_POLL_ADAPTIVE, 1000, 50000));
+	assert(!yk_timing_lookup(4, 3, 4, SLOT_DEVICE_SERIAL,
+				 YK_TIMING_RESPONSE, NULL, NULL));
+	assert(yk_errno == YK_ENODATA);
+
+	for (i = 0; i < 4; i++)
+		_test_serial(yk);
+	assert(yk_timing_lookup(4, 3, 4, SLOT_DEVICE_SERIAL,
+				YK_TIMING_RESPONSE, &expect_us, &samples));
+	assert(samples == 4);
+	/* The last read was placed by the profile, and the key was done */
+	assert(yk_get_poll_counts(yk, &last_wait, NULL));
+	assert(last_wait == 1);
+
+	/* Configuration writes learn how long the command takes */
+	assert(_write_hmac(yk, NULL, NULL));
+	assert(yk_timing_lookup(4, 3, 4, SLOT_CONFIG2, YK_TIMING_WRITE,
+				NULL, &samples));
+	assert(samples == 1);
+
+	assert((fd = mkstemp(path)) >= 0);
+	close(fd);
+	assert(yk_timing_save(path));
+	assert(yk_timing_reset());
+	assert(!yk_timing_lookup(4, 3, 4, SLOT_DEVICE_SERIAL,
+				 YK_TIMING_RESPONSE, NULL, NULL));
+	assert(yk_timing_load(path));
+	assert(yk_timing_lookup(4, 3, 4, SLOT_DEVICE_SERIAL,
+				YK_TIMING_RESPONSE, &loaded_us, &samples));
+	assert(loaded_us == expect_us && samples == 4);
+	remove(path);
+
+	assert(yk_set_poll_policy(yk, YK_POLL_LEGACY, 0, 0));
+}
+
+static void _touch_cb(YK_KEY *yk, void *userdata)
+{
+	(*(int *)userdata)++;
+}
+
+static int touch_began;
+
+static void _touch_began_cb(YK_KEY *yk, void *userdata)
+{
+	__atomic_store_n(&touch_began, 1, __ATOMIC_RELEASE);
+}
+
+/* Cancel from another thread once the key waits for the touch */
+static void *_touch_cancel_worker(void *arg)
+{
+	static uint64_t canceled_us;
+
+	while (!__atomic_load_n(&touch_began, __ATOMIC_ACQUIRE))
+		usleep(1000);
+	canceled_us = yk_now_us();
+	assert(yk_cancel(arg));
+	return &canceled_us;
+}
+
+static void _test_touch(YK_KEY *yk)
+{
+	const unsigned char challenge[] = "touched challenge";
+	unsigned char response[SHA1_DIGEST_SIZE];
+	YKP_CONFIG *cfg = _hmac_config(yk, NULL);
+	YK_CANCEL *cancel;
+	pthread_t thread;
+	void *canceled_us;
+	uint64_t done_us;
+	YK_STATS st;
+	int prompts = 0;
+
+	assert(ykp_set_cfgflag_CHAL_BTN_TRIG(cfg, true));
+	assert(yk_write_command(yk, ykp_core_config(cfg), ykp_command(cfg),
+				NULL));
+	ykp_free_config(cfg);
+
+	assert(yk_set_touch_callback(yk, _touch_cb, &prompts));
+	assert(yk_set_touch_polling(yk, 20000));
+	assert(yk_reset_stats(yk));
+
+	/* Not allowed to wait */
+	assert(!yk_challenge_response(yk, SLOT_CHAL_HMAC2, 0,
+				      sizeof(challenge) - 1, challenge,
+				      sizeof(response), response));
+	assert(yk_errno == YK_EWOULDBLOCK);
+	assert(prompts == 0);
+
+	/* The emulated touch comes 100 ms after the challenge */
+	assert(yk_challenge_response(yk, SLOT_CHAL_HMAC2, 1,
+				     sizeof(challenge) - 1, challenge,
+				     sizeof(response), response));
+	assert(prompts == 1);
+	assert(yk_get_stats(yk, &st));
+	assert(st.touch_waits.count == 1 && st.touch_latency.count == 1);
+	assert(st.touch_waits.max_us >= 50000);
+	/* the touch went unnoticed for part of the wait at most */
+	assert(st.touch_latency.max_us <= st.touch_waits.max_us);
+
+	/* Canceled by another thread while waiting: given up at the next
+	   poll (allowing for a slow scheduler), long before the touch */
+	assert((cancel = yk_cancel_new()));
+	assert(yk_set_cancel(yk, cancel));
+	assert(yk_set_touch_callback(yk, _touch_began_cb, NULL));
+	assert(pthread_create(&thread, NULL, _touch_cancel_worker,
+			      cancel) == 0);
+	assert(!yk_challenge_response(yk, SLOT_CHAL_HMAC2, 1,
+				      sizeof(challenge) - 1, challenge,
+				      sizeof(response), response));
+	assert(yk_errno == YK_ECANCELED);
+	done_us = yk_now_us();
+	assert(pthread_join(thread, &canceled_us) == 0);
+	assert(done_us - *(uint64_t *)canceled_us < 2 * 20000);
+	/* and the key answers the next one */
+	assert(yk_cancel_reset(cancel));
+	assert(yk_challenge_response(yk, SLOT_CHAL_HMAC2, 1,
+				     sizeof(challenge) - 1, challenge,
+				     sizeof(response), response));
+	assert(yk_set_cancel(yk, NULL));
+	yk_cancel_free(cancel);
+
+	assert(yk_set_touch_callback(yk, NULL, NULL));
+	assert(yk_set_touch_polling(yk, 0));
+	assert(_write_hmac(yk, NULL, NULL));
+}
+
+static void _test_recovery(YK_KEY *yk)
+{
+	const unsigned char challenge[] = "noisy challenge";
+	unsigned char response[SHA1_MAX_BLOCK_SIZE];
+	uint8_t expect[USHAMaxHashSize];
+	YK_RECOVERY rec = { 3, 1000, 8000, 1 };
+	YK_STATUS *st = ykds_alloc();
+	YK_STATS stats;
+	unsigned int serial;
+	int seq;
+
+	/* Off by default */
+	setenv("YK_EMULATOR_FAULTS", "pipe", 1);
+	assert(!yk_get_status(yk, st));
+	assert(yk_errno == YK_EUSBERR);
+	unsetenv("YK_EMULATOR_FAULTS");
+
+	assert(yk_set_recovery(yk, &rec));
+	assert(yk_reset_stats(yk));
+
+	setenv("YK_EMULATOR_FAULTS", "busy,pipe", 1);
+	assert(yk_get_serial(yk, 0, 0, &serial) && serial == 4242);
+	assert(yk_get_stats(yk, &stats));
+	assert(stats.retries == 2 && stats.recovered == 1);
+	assert(stats.resyncs == 0 && stats.reopens == 0);
+
+	/* A report of the frame written again */
+	seq = _pgm_seq(yk);
+	setenv("YK_EMULATOR_FAULTS", "ok,ok,ok,ok,io", 1);
+	assert(_write_hmac(yk, NULL, NULL));
+	assert(_pgm_seq(yk) == seq + 1);
+	assert(yk_get_stats(yk, &stats));
+	assert(stats.resyncs == 1);
+
+	/* The key re-enumerates in the middle of a challenge */
+	setenv("YK_EMULATOR_FAULTS", "ok,ok,ok,gone", 1);
+	assert(yk_challenge_response(yk, SLOT_CHAL_HMAC2, 1,
+				     sizeof(challenge) - 1, challenge,
+				     sizeof(response), response));
+	hmac(SHA1, challenge, sizeof(challenge) - 1,
+	     (const unsigned char *)hmac_key, sizeof(hmac_key), expect);
+	assert(memcmp(response, expect, SHA1_DIGEST_SIZE) == 0);
+	assert(yk_get_stats(yk, &stats));
+	assert(stats.reopens == 1 && stats.resyncs == 2);
+
+	/* Out of retries */
+	setenv("YK_EMULATOR_FAULTS", "pipe,pipe,pipe,pipe", 1);
+	assert(!yk_get_status(yk, st));
+	assert(yk_errno == YK_EUSBERR);
+	unsetenv("YK_EMULATOR_FAULTS");
+	assert(yk_get_status(yk, st));
+
+	rec.retries = 0;
+	assert(yk_set_recovery(yk, &rec));
+	rec.max_backoff_us = 10;
+	assert(!yk_set_recovery(yk, &rec) && yk_errno == YK_EINVAL);
+	ykds_free(st);
+}
+
+static void *_no_error_worker(void *arg)
+{
+	YK_ERROR_INFO info;
+
+	assert(yk_errno == 0);
+	assert(!yk_get_error_info(&info));
+	return NULL;
+}
+
+static void _test_timeouts(YK_KEY *yk)
+{
+	const unsigned char challenge[] = "no answer";
+	unsigned char response[SHA1_MAX_BLOCK_SIZE];
+	YK_TIMEOUTS t, saved;
+	YK_STATUS *st = ykds_alloc();
+	YK_ERROR_INFO info;
+	pthread_t thread;
+	uint64_t start;
+
+	assert(yk_get_timeouts(yk, &saved));
+	t = saved;
+	t.transfer_ms = 0;
+	assert(!yk_set_timeouts(yk, &t) && yk_errno == YK_EINVAL);
+
+	/* An unconfigured slot never answers, give up quickly */
+	t = saved;
+	t.response_ms = 50;
+	assert(yk_set_timeouts(yk, &t));
+	start = yk_now_us();
+	assert(!yk_challenge_response(yk, SLOT_CHAL_HMAC1, 0,
+				      sizeof(challenge) - 1, challenge,
+				      sizeof(response), response));
+	assert(yk_errno == YK_ETIMEOUT);
+	assert(yk_now_us() - start < 500 * 1000);
+	assert(yk_set_timeouts(yk, &saved));
+
+	/* The details stay with this thread */
+	assert(yk_get_error_info(&info));
+	assert(info.error == YK_ETIMEOUT);
+	assert(strcmp(info.op, "challenge-response") == 0);
+	assert(info.elapsed_us >= 50 * 1000);
+	assert(pthread_create(&thread, NULL, _no_error_worker, NULL) == 0);
+	assert(pthread_join(thread, NULL) == 0);
+
+	/* Nothing is done past the deadline */
+	assert(yk_set_deadline(yk, yk_now_us() - 1));
+	assert(!yk_get_status(yk, st) && yk_errno == YK_ETIMEOUT);
+	assert(yk_set_deadline(yk, 0));
+	assert(yk_get_status(yk, st));
+
+	ykds_free(st);
+}
+
+static void _test_cancel(YK_KEY *yk)
+{
+	const unsigned char challenge[] = "canceled";
+	unsigned char response[SHA1_MAX_BLOCK_SIZE];
+	YK_CANCEL *cancel = yk_cancel_new();
+	const unsigned char *challenges[2] = { challenge, challenge };
+	unsigned char *responses[2] = { response, response };
+	int status[2];
+
+	assert(cancel);
+	assert(_write_hmac(yk, NULL, NULL));
+	assert(yk_set_cancel(yk, cancel));
+
+	assert(yk_cancel(cancel));
+	assert(yk_cancel_requested(cancel));
+	assert(!yk_challenge_response(yk, SLOT_CHAL_HMAC2, 1,
+				      sizeof(challenge) - 1, challenge,
+				      sizeof(response), response));
+	assert(yk_errno == YK_ECANCELED);
+
+	/* The rest of a batch is given up */
+	assert(!yk_challenge_response_batch(yk, SLOT_CHAL_HMAC2, 1, 2,
+					    sizeof(challenge) - 1, challenges,
+					    sizeof(response), responses,
+					    status, NULL));
+	assert(status[0] == YK_ECANCELED && status[1] == YK_ECANCELED);
+
+	/* The key was reset and works again */
+	assert(yk_cancel_reset(cancel));
+	assert(yk_challenge_response(yk, SLOT_CHAL_HMAC2, 1,
+				     sizeof(challenge) - 1, challenge,
+				     sizeof(response), response));
+
+	assert(yk_set_cancel(yk, NULL));
+	yk_cancel_free(cancel);
+}
+
+#define SHARED_THREADS	4
+#define SHARED_ROUNDS	25
+
+static void *_shared_worker(void *arg)
+{
+	YK_KEY *yk = arg;
+	unsigned char challenge[8];
+	unsigned char response[SHA1_MAX_BLOCK_SIZE];
+	uint8_t expect[USHAMaxHashSize];
+	int i;
+
+	for (i = 0; i < SHARED_ROUNDS; i++) {
+		snprintf((char *)challenge, sizeof(challenge), "%lx%02d",
+			 (unsigned long)pthread_self() & 0xfff, i);
+		if (!yk_challenge_response(yk, SLOT_CHAL_HMAC2, 1,
+					   strlen((char *)challenge), challenge,
+					   sizeof(response), response))
+			return NULL;
+		hmac(SHA1, challenge, strlen((char *)challenge),
+		     (const unsigned char *)hmac_key, sizeof(hmac_key), expect);
+		if (memcmp(response, expect, SHA1_DIGEST_SIZE) != 0)
+			return NULL;
+	}
+	return yk;
+}
+
+static void _test_shared(YK_KEY *yk)
+{
+	pthread_t threads[SHARED_THREADS];
+	YK_STATS st;
+	int i;
+
+	assert(_write_hmac(yk, NULL, NULL));
+	assert(yk_set_locking(yk, 1));
+	assert(yk_reset_stats(yk));
+
+	for (i = 0; i < SHARED_THREADS; i++)
+		assert(pthread_create(&threads[i], NULL, _shared_worker, yk) == 0);
+	for (i = 0; i < SHARED_THREADS; i++) {
+		void *rc;
+
+		assert(pthread_join(threads[i], &rc) == 0);
+		assert(rc == yk);
+	}
+
+	assert(yk_get_stats(yk, &st));
+	assert(st.lock_acquired == SHARED_THREADS * SHARED_ROUNDS);
+	assert(st.lock_waits.count == st.lock_contended);
+
+	/* Several calls under one lock */
+	assert(yk_lock_key(yk));
+	_test_serial(yk);
+	_test_serial(yk);
+	assert(yk_unlock_key(yk));
+	assert(!yk_unlock_key(yk) && yk_errno == YK_EINVAL);
+
+	assert(yk_set_locking(yk, 0));
+}
+
+static void _test_stats(YK_KEY *yk)
+{
+	YK_STATS st;
+	unsigned long ops;
+
+	assert(yk_reset_stats(yk));
+	_test_serial(yk);
+	assert(yk_get_stats(yk, &st));
+	assert(st.ops.count == 1);
+	assert(st.writes.count > 0 && st.reads.count > 0);
+	/* The serial command has an empty payload */
+	assert(st.skipped_reports > 0);
+	assert(st.read_errors == 0 && st.write_errors == 0);
+	ops = st.ops.count;
+
+	assert(yk_get_stats(yk, &st));
+	assert(st.ops.count == ops);
+}
+
+/* A configuration write reads the status once, writes the frame and
+   polls until the key is done, and nothing else */
+static void _test_transfer_counts(YK_KEY *yk)
+{
+	unsigned int last_op;
+	unsigned long total, before;
+	YK_STATS st;
+
+	assert(yk_get_transfer_counts(yk, NULL, &before));
+	assert(yk_reset_stats(yk));
+	assert(_write_hmac(yk, NULL, NULL));
+	assert(yk_get_stats(yk, &st));
+	assert(yk_get_transfer_counts(yk, &last_op, &total));
+	assert(st.polls > 0);
+	/* _write_hmac() reads the status for the configuration first */
+	assert(st.reads.count == 1 + 1 + st.polls);
+	assert(last_op == st.writes.count + st.polls + 1);
+	assert(total == before + 1 + last_op);
+}
+
+/* Drive an operation from the event loop until it is over */
+static int _run_op(YK_OP *op)
+{
+	int state;
+
+	while ((state = yk_op_step(op)) == YK_OP_PENDING)
+		assert(yk_wait_events(100000));
+	return state;
+}
+
+/* The non-blocking operations, on the emulator's asynchronous transfers */
+static void _test_ops(YK_KEY *yk)
+{
+	const unsigned char challenge[] = "non-blocking";
+	unsigned char response[SHA1_MAX_BLOCK_SIZE];
+	uint8_t expect[USHAMaxHashSize];
+	unsigned long samples, before;
+	unsigned int len, serial;
+	YK_CANCEL *cancel;
+	YK_POLLFD fds[4];
+	struct pollfd pfd;
+	unsigned int nfds;
+	long timeout_us;
+	int woken = 0;
+	YKP_CONFIG *cfg;
+	YK_STATS st;
+	YK_OP *op;
+	int seq;
+
+	hmac(SHA1, challenge, sizeof(challenge) - 1,
+	     (const unsigned char *)hmac_key, sizeof(hmac_key), expect);
+
+	/* Challenge-response, the descriptor saying when to handle events */
+	assert((op = yk_op_challenge_response(yk, SLOT_CHAL_HMAC2, 1,
+					      sizeof(challenge) - 1,
+					      challenge)));
+	assert(yk_get_pollfds(fds, 4, &nfds) && nfds == 1);
+	pfd.fd = fds[0].fd;
+	pfd.events = fds[0].events;
+	while (yk_op_step(op) == YK_OP_PENDING) {
+		assert(yk_get_next_timeout(&timeout_us));
+		if (poll(&pfd, 1, timeout_us < 0 ? -1 :
+			 (int)((timeout_us + 999) / 1000)) == 1)
+			woken++;
+		assert(yk_handle_events());
+	}
+	assert(yk_op_state(op) == YK_OP_DONE);
+	assert(woken > 0);
+	assert(yk_op_get_response(op, response, sizeof(response), &len));
+	assert(len == SHA1_DIGEST_SIZE);
+	assert(memcmp(response, expect, SHA1_DIGEST_SIZE) == 0);
+	yk_op_free(op);
+	assert(poll(&pfd, 1, 0) == 0);
+
+	/* A configuration write */
+	seq = _pgm_seq(yk);
+	cfg = _hmac_config(yk, NULL);
+	assert((op = yk_op_write_command(yk, ykp_core_config(cfg),
+					 ykp_command(cfg), NULL)));
+	ykp_free_config(cfg);
+	assert(_run_op(op) == YK_OP_DONE);
+	yk_op_free(op);
+	assert(_pgm_seq(yk) == seq + 1);
+
+	/* The adaptive policy learns from operations too */
+	assert(yk_set_poll_policy(yk, YK_POLL_ADAPTIVE, 1000, 50000));
+	if (!yk_timing_lookup(4, 3, 4, SLOT_DEVICE_SERIAL,
+			      YK_TIMING_RESPONSE, NULL, &before))
+		before = 0;
+	assert((op = yk_op_get_serial(yk, 0, 0)));
+	assert(_run_op(op) == YK_OP_DONE);
+	assert(yk_op_get_serial_result(op, &serial) && serial == 4242);
+	yk_op_free(op);
+	assert(yk_timing_lookup(4, 3, 4, SLOT_DEVICE_SERIAL,
+				YK_TIMING_RESPONSE, NULL, &samples));
+	assert(samples == before + 1);
+	assert(yk_set_poll_policy(yk, YK_POLL_LEGACY, 0, 0));
+
+	/* Canceled, the key is reset and works again */
+	assert((cancel = yk_cancel_new()));
+	assert(yk_set_cancel(yk, cancel));
+	assert((op = yk_op_challenge_response(yk, SLOT_CHAL_HMAC2, 1,
+					      sizeof(challenge) - 1,
+					      challenge)));
+	assert(yk_op_step(op) == YK_OP_PENDING);
+	assert(yk_cancel(cancel));
+	assert(_run_op(op) == YK_OP_FAILED);
+	assert(yk_errno == YK_ECANCELED);
+	yk_op_free(op);
+	assert(yk_set_cancel(yk, NULL));
+	yk_cancel_free(cancel);
+	assert(yk_challenge_response(yk, SLOT_CHAL_HMAC2, 1,
+				     sizeof(challenge) - 1, challenge,
+				     sizeof(response), response));
+	assert(memcmp(response, expect, SHA1_DIGEST_SIZE) == 0);
+
+	/* Freed with a transfer in flight (a write starts with reading the
+	   status), the next operation gets the key once it is reset */
+	seq = _pgm_seq(yk);
+	cfg = _hmac_config(yk, NULL);
+	assert((op = yk_op_write_command(yk, ykp_core_config(cfg),
+					 ykp_command(cfg), NULL)));
+	ykp_free_config(cfg);
+	assert(yk_op_step(op) == YK_OP_PENDING);
+	yk_op_free(op);
+	assert((op = yk_op_get_serial(yk, 0, 0)));
+	assert(_run_op(op) == YK_OP_DONE);
+	assert(yk_op_get_serial_result(op, &serial) && serial == 4242);
+	yk_op_free(op);
+	assert(_pgm_seq(yk) == seq);
+
+	/* With locking on, an operation waits for the thread holding the
+	   key, and holds it itself until it is done */
+	assert(yk_set_locking(yk, 1));
+	assert(yk_reset_stats(yk));
+	assert(yk_lock_key(yk));
+	assert((op = yk_op_get_serial(yk, 0, 0)));
+	assert(yk_op_step(op) == YK_OP_PENDING);
+	assert(yk_wait_events(10000));
+	assert(yk_op_state(op) == YK_OP_PENDING);
+	assert(yk_unlock_key(yk));
+	assert(_run_op(op) == YK_OP_DONE);
+	yk_op_free(op);
+	assert(yk_get_stats(yk, &st));
+	assert(st.lock_acquired == 2 && st.lock_contended == 1);
+	assert(!yk_unlock_key(yk) && yk_errno == YK_EINVAL);
+	_test_serial(yk);
+	assert(yk_set_locking(yk, 0));
+}
+
+/* A key opened by index whose serial couldn't be read is opened again
+   where it was */
+static void _test_reopen_path(void)
+{
+	const unsigned char challenge[] = "where it was";
+	unsigned char response[SHA1_MAX_BLOCK_SIZE];
+	uint8_t expect[USHAMaxHashSize];
+	YK_RECOVERY rec = { 3, 1000, 8000, 1 };
+	YK_STATS stats;
+	YK_KEY *yk;
+
+	assert((yk = yk_open_key(0)));
+	setenv("YK_EMULATOR_FAULTS", "pipe,pipe,pipe,pipe", 1);
+	assert(yk_set_recovery(yk, &rec));
+	setenv("YK_EMULATOR_FAULTS", "ok,ok,ok,gone", 1);
+	assert(yk_challenge_response(yk, SLOT_CHAL_HMAC2, 1,
+				     sizeof(challenge) - 1, challenge,
+				     sizeof(response), response));
+	unsetenv("YK_EMULATOR_FAULTS");
+	hmac(SHA1, challenge, sizeof(challenge) - 1,
+	     (const unsigned char *)hmac_key, sizeof(hmac_key), expect);
+	assert(memcmp(response, expect, SHA1_DIGEST_SIZE) == 0);
+	assert(yk_get_stats(yk, &stats));
+	assert(stats.reopens == 1);
+	assert(yk_close_key(yk));
+}
+
+static volatile int pool_got;
+
+static void *_pool_worker(void *arg)
+{
+	YK_KEY *yk;
+
+	(void)arg;
+	assert((yk = yk_pool_get_key_by_serial(4242)));
+	pool_got = 1;
+	assert(yk_pool_put_key(yk));
+	return yk;
+}
+
+/* Keys put back stay open and are handed out again */
+static void _test_pool(void)
+{
+	unsigned int serial;
+	YK_KEY *yk, *again;
+	pthread_t thread;
+	void *rc;
+
+	assert((yk = yk_pool_get_key(0)));
+	assert(yk_pool_put_key(yk));
+	assert(!yk_pool_put_key(yk));
+	assert((again = yk_pool_get_key(0)));
+	assert(again == yk);
+	assert(yk_get_serial(again, 0, 0, &serial));
+	assert(serial == 4242);
+	assert(yk_pool_put_key(again));
+	assert(!yk_open_key(0));
+	assert(yk_pool_flush());
+
+	assert((yk = yk_pool_get_key_by_serial(4242)));
+	assert(!yk_pool_get_key(1));
+	assert(yk_pool_put_key(yk));
+	assert(yk_pool_flush());
+
+	/* Asked for by index and by serial, it is the same key */
+	assert((yk = yk_pool_get_key(0)));
+	assert(yk_pool_put_key(yk));
+	assert((again = yk_pool_get_key_by_serial(4242)));
+	assert(again == yk);
+	assert(yk_pool_put_key(again));
+	assert(yk_pool_flush());
+	assert((yk = yk_pool_get_key_by_serial(4242)));
+	assert(yk_pool_put_key(yk));
+	assert((again = yk_pool_get_key(0)));
+	assert(again == yk);
+	assert(yk_pool_put_key(again));
+
+	/* and only one caller has it at a time */
+	assert((yk = yk_pool_get_key(0)));
+	assert(pthread_create(&thread, NULL, _pool_worker, NULL) == 0);
+	usleep(50000);
+	assert(!pool_got);
+	assert(yk_pool_put_key(yk));
+	assert(pthread_join(thread, &rc) == 0);
+	assert(pool_got && rc == yk);
+	assert(yk_pool_flush());
+}
+
+/* yk_init() and yk_release() nest, the default context stays usable until
+   the last release */
+static void _test_init_nesting(void)
+{
+	YK_KEY *yk;
+
+	assert(yk_init());
+	assert(yk_init());
+	assert(yk_release());
+	assert((yk = yk_open_key(0)));
+	assert(yk_close_key(yk));
+	assert(yk_release());
+}
+
+/* A context of its own sees the same keys, once nobody else has them open */
+static void _test_context(void)
+{
+	YK_CONTEXT *ctx = yk_context_new();
+	YK_DEVICE_INFO *list;
+	unsigned int serial;
+	size_t count;
+	YK_KEY *yk;
+
+	assert(ctx);
+	assert(yk_context_enumerate(ctx, &list, &count, YK_ENUM_DETAILS));
+	assert(count >= 1);
+	assert(list[0].serial == 4242);
+	assert((yk = yk_context_open_device(ctx, &list[0])));
+	yk_free_device_list(list);
+
+	assert(yk_get_serial(yk, 0, 0, &serial));
+	assert(serial == 4242);
+	assert(yk_close_key(yk));
+
+	assert((yk = yk_context_open_key(ctx, 0)));
+	assert(!yk_open_key(0));
+	assert(yk_close_key(yk));
+	assert(yk_context_free(ctx));
+}
+
+int main(void)
+{
+	YK_KEY *yk;
+
+	setenv("YK_EMULATOR_SERIAL", "4242", 1);
+	assert(yk_init());
+	assert((yk = yk_open_first_key()));
+
+	_test_serial(yk);
+	_test_hmac(yk);
+	_test_batch(yk);
+	_test_sessions(yk);
+	_test_access_code(yk);
+	_test_frame_plan(yk);
+	_test_read_response(yk);
+	_test_timing(yk);
+	_test_touch(yk);
+	_test_recovery(yk);
+	_test_timeouts(yk);
+	_test_cancel(yk);
+	_test_shared(yk);
+	_test_stats(yk);
+	_test_transfer_counts(yk);
+	_test_ops(yk);
+
+	assert(yk_close_key(yk));
+	_test_reopen_path();
+	_test_context();
+	_test_pool();
+	_test_init_nesting();
+	assert(yk_release());
+	assert(!yk_release());
+	return 0;
+}
@@ -0,0 +1,109 @@
+/* -*- mode:C; c-file-style: "bsd" -*- */
+/*
+ * Copyright (c) 2017 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Program several keys at once with ykp_provision(), on three emulated
+ * keys. Only built with --with-backend=emulator.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <ykpers.h>
+#include <ykdef.h>
+
+static int _generate(int index, unsigned int serial, YK_STATUS *st,
+		     YKP_CONFIG *cfg, unsigned char *acc_code, void *userdata)
+{
+	const unsigned int *fail_serial = userdata;
+
+	if (fail_serial && serial == *fail_serial)
+		return 0;
+	assert(ykp_configure_command(cfg, SLOT_CONFIG2));
+	assert(ykp_set_tktflag_APPEND_CR(cfg, true));
+	return 1;
+}
+
+static void _test_all_keys(void)
+{
+	YKP_PROVISION_RESULT results[8];
+	size_t n, i;
+
+	/* The run stops at the first index without a key */
+	assert(ykp_provision(NULL, 8, 2, _generate, NULL, results, &n));
+	assert(n == 3);
+	for (i = 0; i < n; i++) {
+		assert(results[i].rc == 1);
+		assert(results[i].index == (int)i);
+		assert(results[i].serial == 5000 + i);
+	}
+}
+
+static void _test_indexes(void)
+{
+	const int indexes[] = { 2, 5, 0 };
+	YKP_PROVISION_RESULT results[3];
+	size_t n;
+
+	assert(!ykp_provision(indexes, 3, 3, _generate, NULL, results, &n));
+	assert(n == 3);
+	assert(results[0].rc == 1 && results[0].serial == 5002);
+	assert(results[1].rc == 0 && results[1].core_error == YK_ENOKEY);
+	assert(results[2].rc == 1 && results[2].serial == 5000);
+}
+
+static void _test_generate_fails(void)
+{
+	YKP_PROVISION_RESULT results[3];
+	unsigned int fail_serial = 5001;
+	size_t n;
+
+	assert(!ykp_provision(NULL, 3, 1, _generate, &fail_serial,
+			      results, &n));
+	assert(n == 3);
+	assert(results[0].rc == 1 && results[2].rc == 1);
+	assert(results[1].rc == 0 && results[1].serial == 5001);
+}
+
+int main(void)
+{
+	setenv("YK_EMULATOR_KEYS", "3", 1);
+	setenv("YK_EMULATOR_SERIAL", "5000", 1);
+	assert(yk_init());
+
+	_test_all_keys();
+	_test_indexes();
+	_test_generate_fails();
+
+	assert(yk_release());
+	return 0;
+}
@@ -0,0 +1,268 @@
+/* -*- mode:C; c-file-style: "bsd" -*- */
+/*
+ * Copyright (c) 2017 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Open a key by serial number.
+ *
+ * Where each key was last seen is remembered in a small file under
+ * $XDG_RUNTIME_DIR, one "serial path vendor_id product_id" line per key.
+ * A cached location is checked with a single serial read; only when that
+ * fails are the keys opened, up to the one looked for, and the file
+ * rewritten. Without $XDG_RUNTIME_DIR every lookup scans.
+ */
+
+#include "ykcore_lcl.h"
+#include "ykcore_backend.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#define YK_CACHE_FILE		"ykpers-serials"
+#define YK_CACHE_MAX		64
+
+struct yk_cache_entry_st {
+	unsigned int serial;
+	char path[YK_DEVICE_PATH_SIZE];
+	int vendor_id;
+	int product_id;
+};
+
+static int _yk_cache_name(char *buf, size_t len)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	int n;
+
+	if (!dir || !*dir)
+		return 0;
+	n = snprintf(buf, len, "%s/%s", dir, YK_CACHE_FILE);
+	return n > 0 && (size_t)n < len;
+}
+
+static int _yk_cache_lookup(unsigned int serial, struct yk_cache_entry_st *e)
+{
+	char name[1024];
+	FILE *f;
+	int found = 0;
+
+	if (!_yk_cache_name(name, sizeof(name)) || !(f = fopen(name, "r")))
+		return 0;
+	/* path is YK_DEVICE_PATH_SIZE - 1 long at most */
+	while (fscanf(f, "%u %255s %x %x", &e->serial, e->path,
+		      &e->vendor_id, &e->product_id) == 4) {
+		if (e->serial == serial) {
+			found = 1;
+			break;
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+/* Create a temporary file for writing 'path' anew and renaming it into
+   place, named in tmp. Every caller gets a file of its own, threads of the
+   same process too. */
+FILE *_yk_temp_file(const char *path, char *tmp, size_t len)
+{
+#ifdef _WIN32
+	int n = snprintf(tmp, len, "%s.%lu.%lu", path,
+			 (unsigned long)_getpid(),
+			 (unsigned long)GetCurrentThreadId());
+
+	if (n < 0 || (size_t)n >= len)
+		return NULL;
+	return fopen(tmp, "w");
+#else
+	int n = snprintf(tmp, len, "%s.XXXXXX", path);
+	FILE *f;
+	int fd;
+
+	if (n < 0 || (size_t)n >= len || (fd = mkstemp(tmp)) < 0)
+		return NULL;
+	if (!(f = fdopen(fd, "w"))) {
+		close(fd);
+		remove(tmp);
+	}
+	return f;
+#endif
+}
+
+/* Replace the cache with what a scan found, through a temporary file so
+   that concurrent readers never see half of it. A scan that stopped at
+   the key it was looking for keeps the entries of the keys it didn't get
+   to. */
+static void _yk_cache_store(const struct yk_cache_entry_st *entries,
+			    size_t count, int complete)
+{
+	char name[1024], tmp[1040];
+	struct yk_cache_entry_st e;
+	FILE *f, *old;
+	size_t i, n = count;
+
+	if (!_yk_cache_name(name, sizeof(name)))
+		return;
+	if (!(f = _yk_temp_file(name, tmp, sizeof(tmp))))
+		return;
+	for (i = 0; i < count; i++)
+		fprintf(f, "%u %s %x %x\n", entries[i].serial, entries[i].path,
+			entries[i].vendor_id, entries[i].product_id);
+	if (!complete && (old = fopen(name, "r"))) {
+		while (n < YK_CACHE_MAX &&
+		       fscanf(old, "%u %255s %x %x", &e.serial, e.path,
+			      &e.vendor_id, &e.product_id) == 4) {
+			for (i = 0; i < count; i++)
+				if (entries[i].serial == e.serial ||
+				    strcmp(entries[i].path, e.path) == 0)
+					break;
+			if (i < count)
+				continue;
+			fprintf(f, "%u %s %x %x\n", e.serial, e.path,
+				e.vendor_id, e.product_id);
+			n++;
+		}
+		fclose(old);
+	}
+	if (fclose(f) != 0 || rename(tmp, name) != 0)
+		remove(tmp);
+}
+
+static YK_KEY *_yk_open_if_serial(YK_CONTEXT *ctx, void *dev,
+				  unsigned int serial)
+{
+	unsigned int s;
+	YK_KEY *yk;
+
+	if (!dev || !(yk = _yk_new_key(ctx, dev)))
+		return NULL;
+	if (yk_get_serial(yk, 0, 0, &s) && s == serial)
+		return yk;
+	yk_close_key(yk);
+	return NULL;
+}
+
+struct yk_scan_st {
+	YK_CONTEXT *ctx;
+	unsigned int serial;
+	YK_KEY *yk;
+	struct yk_cache_entry_st entries[YK_CACHE_MAX];
+	size_t count;
+};
+
+static int _yk_scan_cb(void *userdata, void *entry, const char *path,
+		       int vendor_id, int product_id)
+{
+	struct yk_scan_st *scan = userdata;
+	struct yk_cache_entry_st *e;
+	void *dev = _ykusb_open_entry(scan->ctx->usb, entry);
+	unsigned int serial;
+	YK_KEY *yk;
+
+	if (!dev || !(yk = _yk_new_key(scan->ctx, dev)))
+		return 1;
+	if (!yk_get_serial(yk, 0, 0, &serial)) {
+		yk_close_key(yk);
+		return 1;
+	}
+
+	/* The key looked for is remembered even with the cache full */
+	if (scan->count < YK_CACHE_MAX)
+		e = &scan->entries[scan->count++];
+	else if (serial == scan->serial)
+		e = &scan->entries[YK_CACHE_MAX - 1];
+	else
+		e = NULL;
+	if (e) {
+		e->serial = serial;
+		snprintf(e->path, sizeof(e->path), "%s", path);
+		e->vendor_id = vendor_id;
+		e->product_id = product_id;
+	}
+
+	/* No need to look any further once it is found */
+	if (serial == scan->serial) {
+		scan->yk = yk;
+		return 0;
+	}
+	yk_close_key(yk);
+	return 1;
+}
+
+YK_KEY *yk_open_key_by_serial(unsigned int serial)
+{
+	return yk_context_open_key_by_serial(_yk_default_context(), serial);
+}
+
+YK_KEY *yk_context_open_key_by_serial(YK_CONTEXT *ctx, unsigned int serial)
+{
+	struct yk_cache_entry_st e;
+	struct yk_scan_st *scan;
+	int pids[YK_NPRODUCTS];
+	YK_KEY *yk = NULL;
+
+	if (!ctx) {
+		yk_errno = YK_EINVAL;
+		return NULL;
+	}
+	_yk_product_ids(pids);
+
+	if (_yk_cache_lookup(serial, &e)) {
+		yk = _yk_open_if_serial(ctx, _ykusb_open_path(ctx->usb,
+							      YUBICO_VID, pids,
+							      YK_NPRODUCTS,
+							      e.path),
+					serial);
+		if (yk) {
+			yk_errno = 0;
+			return yk;
+		}
+	}
+
+	/* Cache miss or stale entry, look at all keys and remember them */
+	scan = calloc(1, sizeof(*scan));
+	if (!scan) {
+		yk_errno = YK_ENOMEM;
+		return NULL;
+	}
+	scan->ctx = ctx;
+	scan->serial = serial;
+	if (_ykusb_enumerate(ctx->usb, YUBICO_VID, pids, YK_NPRODUCTS,
+			     _yk_scan_cb, scan)) {
+		_yk_cache_store(scan->entries, scan->count, !scan->yk);
+		yk = scan->yk;
+		yk_errno = yk ? 0 : YK_ENOKEY;
+	}
+	free(scan);
+	return yk;
+}
@@ -31,15 +31,10 @@
 #include "ykcore_lcl.h"
 #include "ykcore_backend.h"
 #include "yktsd.h"
-
-/* To get modhex and crc16 */
-#include <yubikey.h>
+#include "yktime.h"
 
 #include <stdio.h>
-#ifndef _WIN32
-#include <unistd.h>
-#define Sleep(x) usleep((x)*1000)
-#endif
+#include <string.h>
 
 #ifdef YK_DEBUG
 #define _yk_hexdump(buffer, size) \
@@ -54,24 +49,360 @@
 	} while(0)
 #endif
 
-/*
- * Yubikey low-level interface section 2.4 (Report arbitration polling) specifies
- * a 600 ms timeout for a Yubikey to process something written to it.
- * Where can that document be found?
- * It has been discovered that for swap 600 is not enough, swapping can worst
- * case take 920 ms, which we then add 25% to for safety margin, arriving at
- * 1150 ms.
+static int _yk_write_reports(YK_KEY *yk, uint8_t slot, unsigned int flags,
+			     const unsigned char reports[][FEATURE_RPT_SIZE],
+			     int n, const unsigned char *status);
+
+void _yk_stats_add(YK_HISTOGRAM *h, uint64_t us)
+{
+	unsigned int i = 0;
+
+	while (i < YK_STATS_BUCKETS - 1 && us >= ((uint64_t)1 << i))
+		i++;
+	h->buckets[i]++;
+	h->count++;
+	h->total_us += us;
+	if (us > h->max_us)
+		h->max_us = us;
+}
+
+uint64_t _yk_time_left(YK_KEY *yk, uint64_t us)
+{
+	uint64_t now;
+
+	if (!yk->deadline_us)
+		return us;
+	now = yk__now_us();
+	if (now >= yk->deadline_us)
+		return 0;
+	return yk->deadline_us - now < us ? yk->deadline_us - now : us;
+}
+
+unsigned int _yk_transfer_timeout(YK_KEY *yk)
+{
+	uint64_t left = _yk_time_left(yk, (uint64_t)yk->timeouts.transfer_ms * 1000);
+
+	return (unsigned int)((left + 999) / 1000);
+}
+
+/* Somewhere between half of 'us' and all of it, so that keys failing
+   together on a busy hub don't all try again at the same time */
+static uint64_t _yk_jitter(YK_KEY *yk, uint64_t us)
+{
+	uint32_t x = yk->jitter;
+
+	if (x == 0)
+		x = (uint32_t)yk__now_us() | 1;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	yk->jitter = x;
+	return us / 2 + x % (us - us / 2 + 1);
+}
+
+static int _yk_get_serial(YK_KEY *yk, uint8_t slot, unsigned int flags,
+			  unsigned int *serial);
+
+/* Find a key that went away by its serial number. */
+static void *_yk_open_serial(YK_KEY *yk, int *pids)
+{
+	YK_DEVICE_INFO *list;
+	size_t count, i;
+	void *dev = NULL;
+
+	if (!yk_context_enumerate(yk->ctx, &list, &count, YK_ENUM_DETAILS))
+		return NULL;
+	for (i = 0; i < count && !dev; i++) {
+		if (list[i].serial != yk->serial)
+			continue;
+		dev = _ykusb_open_path(yk->ctx->usb, YUBICO_VID, pids,
+				       YK_NPRODUCTS, list[i].path);
+	}
+	yk_free_device_list(list);
+	return dev;
+}
+
+/* Open a key that went away and came back, and put the new device in
+   place of the old one. Where the serial number is known, a key at the
+   old location must have the same serial to be taken; it is read as part
+   of the operation being recovered, not as one of its own. */
+static int _yk_reopen(YK_KEY *yk)
+{
+	int pids[YK_NPRODUCTS];
+	void *old = yk->dev;
+	void *dev = NULL;
+	unsigned int serial = 0;
+	unsigned int i;
+
+	_yk_product_ids(pids);
+	if (yk->path[0])
+		dev = _ykusb_open_path(yk->ctx->usb, YUBICO_VID, pids,
+				       YK_NPRODUCTS, yk->path);
+	if (dev && yk->serial) {
+		/* What the operation being recovered learns about the timing
+		   of the key stays its own */
+		uint8_t last_cmd = yk->last_cmd;
+		unsigned int last_polls = yk->last_polls;
+
+		yk->dev = dev;
+		if (!_yk_get_serial(yk, 0, 0, &serial) ||
+		    serial != yk->serial) {
+			_ykusb_close_device(dev);
+			dev = NULL;
+		}
+		yk->dev = old;
+		yk->last_cmd = last_cmd;
+		yk->last_polls = last_polls;
+	}
+	if (!dev && yk->serial)
+		dev = _yk_open_serial(yk, pids);
+	if (!dev)
+		return 0;
+
+	for (i = 0; i < yk->session_depth; i++)
+		_ykusb_begin_session(dev);
+	yk->dev = dev;
+	if (!_ykusb_get_path(dev, yk->path, sizeof(yk->path)))
+		yk->path[0] = '\0';
+	_ykusb_close_device(old);
+	yk->stats.reopens++;
+	yk->disturbed++;
+	return 1;
+}
+
+/* A transfer on the key failed, with the backend error of class 'kind'.
+   With recovery on (see yk_set_recovery()), wait a while and tell whether
+   to try it again, after opening the key again if it went away. The error
+   of the transfer is kept for when it isn't tried again. */
+static int _yk_recover(YK_KEY *yk, unsigned int attempt, int kind)
+{
+	int err = yk_errno;
+	uint64_t wait;
+
+	if (attempt >= yk->recovery.retries || yk->recovering ||
+	    _yk_canceled(yk))
+		return 0;
+	if (kind == YKUSB_ERROR_OTHER ||
+	    (kind == YKUSB_ERROR_GONE && !yk->recovery.reopen))
+		return 0;
+
+	wait = (uint64_t)yk->recovery.backoff_us << (attempt < 16 ? attempt : 16);
+	if (wait > yk->recovery.max_backoff_us)
+		wait = yk->recovery.max_backoff_us;
+	wait = _yk_jitter(yk, wait);
+	/* Don't bother if the deadline comes first */
+	if (_yk_time_left(yk, wait + 1) <= wait)
+		return 0;
+	if (wait > 0) {
+		uint64_t before = yk__now_us();
+		yk__usleep(wait);
+		yk->stats.slept_us += yk__now_us() - before;
+	}
+	yk->stats.retries++;
+
+	if (kind == YKUSB_ERROR_GONE) {
+		/* If it isn't back yet, the next try will fail the same way
+		   and look for it again */
+		yk->recovering = 1;
+		_yk_reopen(yk);
+		yk->recovering = 0;
+	}
+	yk_errno = err;
+	return 1;
+}
+
+/* After a write was tried again or the key opened again during an
+   exchange, send it again from the start with the key reset, as long as
+   recovery allows. */
+static int _yk_resend(YK_KEY *yk, unsigned int *resends)
+{
+	if (yk->recovering || (*resends)++ >= yk->recovery.retries)
+		return 0;
+	yk->stats.resyncs++;
+	return yk_force_key_update(yk);
+}
+
+/* All feature report transfers of ykcore go through these, to count and
+   time them, and to recover from transient errors */
+static int _yk_usb_read(YK_KEY *yk, int report_number, char *buffer, int size)
+{
+	unsigned int attempt = 0;
+	int rc, kind;
+
+	for (;;) {
+		unsigned int timeout_ms = _yk_transfer_timeout(yk);
+		uint64_t start = yk__now_us();
+
+		if (!timeout_ms) {
+			yk->stats.timeouts++;
+			yk_errno = YK_ETIMEOUT;
+			return 0;
+		}
+		yk->transfers++;
+		rc = _ykusb_read(yk->dev, REPORT_TYPE_FEATURE, report_number,
+				 buffer, size, timeout_ms);
+		/* before anything else can change the backend error */
+		kind = rc ? 0 : _ykusb_error_class(yk->ctx->usb);
+		_yk_stats_add(&yk->stats.reads, yk__now_us() - start);
+		if (rc)
+			break;
+		yk->stats.read_errors++;
+		if (!_yk_recover(yk, attempt++, kind))
+			return 0;
+	}
+	if (attempt > 0)
+		yk->stats.recovered++;
+	return rc;
+}
+
+static int _yk_usb_write(YK_KEY *yk, int report_number, char *buffer, int size)
+{
+	unsigned int attempt = 0;
+	int rc, kind;
+
+	for (;;) {
+		unsigned int timeout_ms = _yk_transfer_timeout(yk);
+		uint64_t start = yk__now_us();
+
+		if (!timeout_ms) {
+			yk->stats.timeouts++;
+			yk_errno = YK_ETIMEOUT;
+			return 0;
+		}
+		yk->transfers++;
+		rc = _ykusb_write(yk->dev, REPORT_TYPE_FEATURE, report_number,
+				  buffer, size, timeout_ms);
+		kind = rc ? 0 : _ykusb_error_class(yk->ctx->usb);
+		_yk_stats_add(&yk->stats.writes, yk__now_us() - start);
+		if (rc)
+			break;
+		yk->stats.write_errors++;
+		if (!_yk_recover(yk, attempt++, kind))
+			return 0;
+	}
+	/* The key may or may not have got the failed write */
+	if (attempt > 0) {
+		yk->stats.recovered++;
+		yk->disturbed++;
+	}
+	return rc;
+}
+
+/* Bracket an operation on a key, such as a status read or a configuration
+ * write. Operations may nest, only the outermost one is accounted for.
+ * _yk_call_end() passes the result of the operation through.
  */
-#define WAIT_FOR_WRITE_FLAG	1150
+void _yk_call_begin(YK_KEY *yk, const char *op)
+{
+	if (yk->locking)
+		yk_lock_key(yk);
+	if (yk->call_depth++ == 0) {
+		yk->call_op = op;
+		yk->call_start = yk->transfers;
+		yk->call_start_us = yk__now_us();
+	}
+}
+
+int _yk_call_end(YK_KEY *yk, int rc)
+{
+	if (--yk->call_depth == 0) {
+		uint64_t elapsed = yk__now_us() - yk->call_start_us;
+
+		yk->last_transfers = yk->transfers - yk->call_start;
+		_yk_stats_add(&yk->stats.ops, elapsed);
+		if (!rc)
+			_yk_error_record(yk->ctx, yk->call_op, elapsed);
+	}
+	if (yk->locking)
+		yk_unlock_key(yk);
+	return rc;
+}
+
+/* The context of the functions without a context argument. The first
+   yk_init() starts its backend, which then stays up for the rest of the
+   process: yk_init() and yk_release() only count users, so that threads
+   calling them around every job don't pay for starting the backend each
+   time. Before the first yk_init() the backend works without a context. */
+static YK_CONTEXT yk_default_ctx;
+static int yk_default_started;
+static unsigned long yk_default_users;
+static yk__STATIC_MUTEX_T yk_default_lock = yk__STATIC_MUTEX_INITIALIZER;
+
+YK_CONTEXT *_yk_default_context(void)
+{
+	return &yk_default_ctx;
+}
 
 int yk_init(void)
 {
-	return _ykusb_start();
+	int rc;
+
+	yk__static_mutex_lock(yk_default_lock);
+	if (!yk_default_started)
+		yk_default_started = _ykusb_start(&yk_default_ctx.usb);
+	if (yk_default_started)
+		yk_default_users++;
+	rc = yk_default_started;
+	yk__static_mutex_unlock(yk_default_lock);
+	return rc;
 }
 
 int yk_release(void)
 {
-	return _ykusb_stop();
+	int rc = 1;
+
+	yk__static_mutex_lock(yk_default_lock);
+	if (yk_default_users == 0) {
+		yk_errno = YK_EUSBERR;
+		rc = 0;
+	} else if (--yk_default_users == 0 && yk_default_ctx.hotplug) {
+		/* Nobody is left to handle the events */
+		yk_context_hotplug_deregister(&yk_default_ctx);
+	}
+	yk__static_mutex_unlock(yk_default_lock);
+	return rc;
+}
+
+#ifdef __GNUC__
+/* Stop the backend of the default context when the library is unloaded */
+static void __attribute__((destructor)) _yk_default_stop(void)
+{
+	if (yk_default_started) {
+		_ykusb_stop(yk_default_ctx.usb);
+		yk_default_ctx.usb = NULL;
+		yk_default_started = 0;
+	}
+}
+#endif
+
+YK_CONTEXT *yk_context_new(void)
+{
+	YK_CONTEXT *ctx = calloc(1, sizeof(YK_CONTEXT));
+
+	if (!ctx) {
+		yk_errno = YK_ENOMEM;
+		return NULL;
+	}
+	if (!_ykusb_start(&ctx->usb)) {
+		free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+int yk_context_free(YK_CONTEXT *ctx)
+{
+	int rc;
+
+	if (!ctx) {
+		yk_errno = YK_EINVAL;
+		return 0;
+	}
+	if (ctx->hotplug)
+		yk_context_hotplug_deregister(ctx);
+	rc = _ykusb_stop(ctx->usb);
+	free(ctx);
+	return rc;
 }
 
 YK_KEY *yk_open_first_key(void)
@@ -79,19 +410,78 @@ YK_KEY *yk_open_first_key(void)
 	return yk_open_key(0);
 }
 
-YK_KEY *yk_open_key(int index)
+/* Keys we know how to talk to, in the order yk_open_key() has always
+   searched for them. */
+static const struct {
+	int pid;
+	const char *family;
+} yk_products[YK_NPRODUCTS] = {
+	{YUBIKEY_PID,		"YubiKey"},
+	{NEO_OTP_PID,		"YubiKey NEO"},
+	{NEO_OTP_CCID_PID,	"YubiKey NEO"},
+	{NEO_OTP_U2F_PID,	"YubiKey NEO"},
+	{NEO_OTP_U2F_CCID_PID,	"YubiKey NEO"},
+	{YK4_OTP_PID,		"YubiKey 4"},
+	{YK4_OTP_U2F_PID,	"YubiKey 4"},
+	{YK4_OTP_CCID_PID,	"YubiKey 4"},
+	{YK4_OTP_U2F_CCID_PID,	"YubiKey 4"},
+	{PLUS_U2F_OTP_PID,	"YubiKey Plus"},
+};
+
+void _yk_product_ids(int pids[YK_NPRODUCTS])
+{
+	size_t i;
+
+	for (i = 0; i < YK_NPRODUCTS; i++)
+		pids[i] = yk_products[i].pid;
+}
+
+const char *_yk_product_family(int pid)
+{
+	size_t i;
+
+	for (i = 0; i < YK_NPRODUCTS; i++)
+		if (yk_products[i].pid == pid)
+			return yk_products[i].family;
+	return NULL;
+}
+
+/* Wrap a device opened by the backend. On failure the device is closed. */
+YK_KEY *_yk_new_key(YK_CONTEXT *ctx, void *dev)
 {
-	int pids[] = {YUBIKEY_PID, NEO_OTP_PID, NEO_OTP_CCID_PID,
-		NEO_OTP_U2F_PID, NEO_OTP_U2F_CCID_PID, YK4_OTP_PID,
-		YK4_OTP_U2F_PID, YK4_OTP_CCID_PID, YK4_OTP_U2F_CCID_PID,
-		PLUS_U2F_OTP_PID};
+	YK_KEY *yk = calloc(1, sizeof(YK_KEY));
+
+	if (!yk) {
+		_ykusb_close_device(dev);
+		yk_errno = YK_ENOMEM;
+		return NULL;
+	}
+	yk->dev = dev;
+	yk->ctx = ctx;
+	/* for yk_set_recovery() */
+	if (!_ykusb_get_path(dev, yk->path, sizeof(yk->path)))
+		yk->path[0] = '\0';
+	yk->poll_policy = YK_POLL_LEGACY;
+	yk->timeouts.transfer_ms = YK_TRANSFER_TIMEOUT;
+	yk->timeouts.write_ms = WAIT_FOR_WRITE_FLAG;
+	yk->timeouts.response_ms = WAIT_FOR_RESPONSE;
+	yk->timeouts.touch_ms = WAIT_FOR_TOUCH;
+	return yk;
+}
 
-	YK_KEY *yk = _ykusb_open_device(YUBICO_VID, pids, sizeof(pids) / sizeof(int), index);
+/* Finish opening a key: check that it answers to a status read. */
+static YK_KEY *_yk_open_checked(YK_CONTEXT *ctx, void *dev, uint64_t start)
+{
+	YK_KEY *yk = NULL;
 	int rc = yk_errno;
 
-	if (yk) {
+	if (dev) {
 		YK_STATUS st;
 
+		yk = _yk_new_key(ctx, dev);
+		if (!yk)
+			return NULL;
+
 		if (!yk_get_status(yk, &st)) {
 			rc = yk_errno;
 			yk_close_key(yk);
@@ -99,12 +489,179 @@ YK_KEY *yk_open_key(int index)
 		}
 	}
 	yk_errno = rc;
+	if (!yk)
+		_yk_error_record(ctx, "open", yk__now_us() - start);
 	return yk;
 }
 
+YK_KEY *yk_open_key(int index)
+{
+	return yk_context_open_key(&yk_default_ctx, index);
+}
+
+YK_KEY *yk_context_open_key(YK_CONTEXT *ctx, int index)
+{
+	uint64_t start = yk__now_us();
+	int pids[YK_NPRODUCTS];
+
+	if (!ctx) {
+		yk_errno = YK_EINVAL;
+		return NULL;
+	}
+	_yk_product_ids(pids);
+	return _yk_open_checked(ctx, _ykusb_open_device(ctx->usb, YUBICO_VID,
+							pids, YK_NPRODUCTS,
+							index), start);
+}
+
+YK_KEY *yk_open_device(const YK_DEVICE_INFO *info)
+{
+	return yk_context_open_device(&yk_default_ctx, info);
+}
+
+YK_KEY *yk_context_open_device(YK_CONTEXT *ctx, const YK_DEVICE_INFO *info)
+{
+	uint64_t start = yk__now_us();
+	int pids[YK_NPRODUCTS];
+
+	if (!ctx || !info) {
+		yk_errno = YK_EINVAL;
+		return NULL;
+	}
+	_yk_product_ids(pids);
+	return _yk_open_checked(ctx, _ykusb_open_path(ctx->usb, YUBICO_VID,
+						      pids, YK_NPRODUCTS,
+						      info->path), start);
+}
+
+struct yk_enum_st {
+	YK_CONTEXT *ctx;
+	YK_DEVICE_INFO *list;
+	size_t count;
+	size_t size;
+	unsigned int flags;
+	int error;
+};
+
+void _yk_device_details(YK_CONTEXT *ctx, YK_DEVICE_INFO *info, void *entry)
+{
+	void *dev = _ykusb_open_entry(ctx->usb, entry);
+	YK_STATUS st;
+	YK_KEY *yk;
+
+	if (!dev || !(yk = _yk_new_key(ctx, dev)))
+		return;
+	if (yk_get_status(yk, &st)) {
+		info->version_major = st.versionMajor;
+		info->version_minor = st.versionMinor;
+		info->version_build = st.versionBuild;
+		if (!yk_get_serial(yk, 0, 0, &info->serial))
+			info->serial = 0;
+	}
+	yk_close_key(yk);
+}
+
+static int _yk_enum_cb(void *userdata, void *entry, const char *path,
+		       int vendor_id, int product_id)
+{
+	struct yk_enum_st *e = userdata;
+	YK_DEVICE_INFO *info;
+
+	if (e->count == e->size) {
+		size_t size = e->size ? e->size * 2 : 8;
+		YK_DEVICE_INFO *list = realloc(e->list, size * sizeof(*list));
+
+		if (!list) {
+			e->error = YK_ENOMEM;
+			return 0;
+		}
+		e->list = list;
+		e->size = size;
+	}
+	info = &e->list[e->count];
+	memset(info, 0, sizeof(*info));
+	info->index = e->count;
+	strncpy(info->path, path, sizeof(info->path) - 1);
+	info->vendor_id = vendor_id;
+	info->product_id = product_id;
+	info->family = _yk_product_family(product_id);
+	if (e->flags & YK_ENUM_DETAILS)
+		_yk_device_details(e->ctx, info, entry);
+	e->count++;
+	return 1;
+}
+
+int yk_enumerate(YK_DEVICE_INFO **list, size_t *count, unsigned int flags)
+{
+	return yk_context_enumerate(&yk_default_ctx, list, count, flags);
+}
+
+int yk_context_enumerate(YK_CONTEXT *ctx, YK_DEVICE_INFO **list,
+			 size_t *count, unsigned int flags)
+{
+	struct yk_enum_st e;
+	int pids[YK_NPRODUCTS];
+
+	if (!ctx || !list || !count) {
+		yk_errno = YK_EINVAL;
+		return 0;
+	}
+	memset(&e, 0, sizeof(e));
+	e.ctx = ctx;
+	e.flags = flags;
+	_yk_product_ids(pids);
+
+	if (!_ykusb_enumerate(ctx->usb, YUBICO_VID, pids, YK_NPRODUCTS,
+			      _yk_enum_cb, &e) || e.error) {
+		if (e.error)
+			yk_errno = e.error;
+		free(e.list);
+		return 0;
+	}
+	/* errors reading details of single keys are not reported */
+	yk_errno = 0;
+	*list = e.list;
+	*count = e.count;
+	return 1;
+}
+
+void yk_free_device_list(YK_DEVICE_INFO *list)
+{
+	free(list);
+}
+
 int yk_close_key(YK_KEY *yk)
 {
-	return _ykusb_close_device(yk);
+	int rc = _ykusb_close_device(yk->dev);
+
+	yk_set_locking(yk, 0);
+	free(yk);
+	return rc;
+}
+
+/* Claim the key once and keep the claim for all reports until the matching
+ * yk_end_session(). Without a session, each feature report claims and
+ * releases the device on its own. Sessions nest.
+ */
+int yk_begin_session(YK_KEY *yk)
+{
+	if (!_ykusb_begin_session(yk->dev))
+		return 0;
+	yk->session_depth++;
+	return 1;
+}
+
+int yk_end_session(YK_KEY *yk)
+{
+	if (!_ykusb_end_session(yk->dev))
+		return 0;
+	yk->session_depth--;
+	return 1;
+}
+
+int yk_get_claim_counts(YK_KEY *yk, unsigned long *claims, unsigned long *releases)
+{
+	return _ykusb_get_claim_counts(yk->dev, claims, releases);
 }
 
 int yk_check_firmware_version(YK_KEY *k)
@@ -146,7 +703,7 @@ int yk_check_firmware_version2(YK_STATUS *st)
 	return 0;
 }
 
-int yk_get_status(YK_KEY *k, YK_STATUS *status)
+static int _yk_get_status(YK_KEY *k, YK_STATUS *status)
 {
 	unsigned int status_count = 0;
 
@@ -159,10 +716,18 @@ int yk_get_status(YK_KEY *k, YK_STATUS *status)
 	}
 
 	status->touchLevel = yk_endian_swap_16(status->touchLevel);
+	k->version = status->versionMajor << 16 | status->versionMinor << 8 |
+		status->versionBuild;
 
 	return 1;
 }
 
+int yk_get_status(YK_KEY *k, YK_STATUS *status)
+{
+	_yk_call_begin(k, "status read");
+	return _yk_call_end(k, _yk_get_status(k, status));
+}
+
 /* Read the factory programmed serial number from a YubiKey.
  * The possibility to retreive the serial number might be disabled
  * using configuration, so it should not be considered a fatal error
@@ -174,24 +739,25 @@ int yk_get_status(YK_KEY *k, YK_STATUS *status)
  *
  * The slot parameter is here for future purposes only.
  */
-int yk_get_serial(YK_KEY *yk, uint8_t slot, unsigned int flags, unsigned int *serial)
+static int _yk_get_serial(YK_KEY *yk, uint8_t slot, unsigned int flags,
+			  unsigned int *serial)
 {
-	unsigned char buf[FEATURE_RPT_SIZE * 2];
+	unsigned char buf[SERIAL_NUMBER_SIZE];
 	unsigned int response_len = 0;
-	unsigned int expect_bytes = 0;
-
-	memset(buf, 0, sizeof(buf));
+	unsigned int resends = 0;
+	unsigned long disturbed;
 
-	if (!yk_write_to_key(yk, SLOT_DEVICE_SERIAL, &buf, 0))
+ again:
+	disturbed = yk->disturbed;
+	if (!yk_write_to_key(yk, SLOT_DEVICE_SERIAL, buf, 0))
 		return 0;
 
-	expect_bytes = 4;
-
-	if (! yk_read_response_from_key(yk, slot, flags,
-					&buf, sizeof(buf),
-					expect_bytes,
-					&response_len))
+	if (! yk_read_response(yk, slot, flags, buf, sizeof(buf),
+			       SERIAL_NUMBER_SIZE, &response_len)) {
+		if (yk->disturbed != disturbed && _yk_resend(yk, &resends))
+			goto again;
 		return 0;
+	}
 
 	/* Serial number is stored in big endian byte order, despite
 	 * everything else in the YubiKey being little endian - for
@@ -206,41 +772,73 @@ int yk_get_serial(YK_KEY *yk, uint8_t slot, unsigned int flags, unsigned int *se
 	return 1;
 }
 
-int yk_get_capabilities(YK_KEY *yk, uint8_t slot, unsigned int flags,
-		unsigned char *capabilities, unsigned int *len)
+int yk_get_serial(YK_KEY *yk, uint8_t slot, unsigned int flags, unsigned int *serial)
+{
+	_yk_call_begin(yk, "serial read");
+	return _yk_call_end(yk, _yk_get_serial(yk, slot, flags, serial));
+}
+
+static int _yk_get_capabilities(YK_KEY *yk, uint8_t slot, unsigned int flags,
+				unsigned char *capabilities, unsigned int *len)
 {
 	unsigned int response_len = 0;
+	unsigned int resends = 0;
+	unsigned long disturbed;
 
+ again:
+	disturbed = yk->disturbed;
 	if (!yk_write_to_key(yk, SLOT_YK4_CAPABILITIES, capabilities, 0))
 		return 0;
 
-	if (! yk_read_response_from_key(yk, slot, flags,
-					capabilities, *len, 0, /* we have no idea how much data we'll get */
-					&response_len))
-		return 0;
-
 	/* the first data of the capabilities string is the length */
-	response_len = capabilities[0];
-	response_len++;
+	if (! yk_read_response(yk, slot, flags, capabilities, *len, 0,
+			       &response_len)) {
+		if (yk->disturbed != disturbed && _yk_resend(yk, &resends))
+			goto again;
+		return 0;
+	}
 
 	*len = response_len;
 	return 1;
 }
 
-static int _yk_write(YK_KEY *yk, uint8_t yk_cmd, unsigned char *buf, size_t len)
+int yk_get_capabilities(YK_KEY *yk, uint8_t slot, unsigned int flags,
+		unsigned char *capabilities, unsigned int *len)
+{
+	_yk_call_begin(yk, "capabilities read");
+	return _yk_call_end(yk, _yk_get_capabilities(yk, slot, flags,
+						     capabilities, len));
+}
+
+/* Write a configuration with as few transfers as possible. The status
+ * report read first gives the programming sequence and tells whether the
+ * key is ready for the first part of the frame, and the status report that
+ * ends the wait for the write to be processed has the new programming
+ * sequence, so no separate status reads are needed for either.
+ */
+static int _yk_write_config_reports(YK_KEY *yk, uint8_t yk_cmd,
+				    const unsigned char reports[][FEATURE_RPT_SIZE],
+				    int n)
 {
+	unsigned char data[FEATURE_RPT_SIZE];
 	YK_STATUS stat;
 	int seq;
 
 	/* Get current sequence # from status block */
 
-	if (!yk_get_status(yk, &stat /*, 0*/))
+	memset(data, 0, sizeof(data));
+	if (!_yk_usb_read(yk, 0, (char *)data, FEATURE_RPT_SIZE))
 		return 0;
-
+	memcpy(&stat, data + 1, sizeof(stat));
 	seq = stat.pgmSeq;
+	yk->version = stat.versionMajor << 16 | stat.versionMinor << 8 |
+		stat.versionBuild;
 
+#ifdef YK_DEBUG
+	fprintf(stderr, "YK_DEBUG: Write %i reports to YubiKey :\n", n);
+#endif
 	/* Write to Yubikey */
-	if (!yk_write_to_key(yk, yk_cmd, buf, len))
+	if (!_yk_write_reports(yk, yk_cmd, 0, reports, n, data))
 		return 0;
 
 	/* When the Yubikey clears the SLOT_WRITE_FLAG, it has processed the last write.
@@ -248,13 +846,13 @@ static int _yk_write(YK_KEY *yk, uint8_t yk_cmd, unsigned char *buf, size_t len)
 	 * want to get the bytes in the status message, but when writing configuration
 	 * we don't expect any data back.
 	 */
-	if(!yk_wait_for_key_status(yk, yk_cmd, 0, WAIT_FOR_WRITE_FLAG, false, SLOT_WRITE_FLAG, NULL))
+	if(!yk_wait_for_key_status(yk, yk_cmd, YK_FLAG_TIMED, yk->timeouts.write_ms, false, SLOT_WRITE_FLAG, data))
 		return 0;
 
 	/* Verify update */
 
-	if (!yk_get_status(yk, &stat /*, 0*/))
-		return 0;
+	memcpy(&stat, data + 1, sizeof(stat));
+	stat.touchLevel = yk_endian_swap_16(stat.touchLevel);
 
 	yk_errno = YK_EWRITEERR;
 
@@ -267,27 +865,41 @@ static int _yk_write(YK_KEY *yk, uint8_t yk_cmd, unsigned char *buf, size_t len)
 	return stat.pgmSeq != seq;
 }
 
-int yk_write_command(YK_KEY *yk, YK_CONFIG *cfg, uint8_t command,
-		    unsigned char *acc_code)
+static int _yk_write_config(YK_KEY *yk, uint8_t yk_cmd, unsigned char *buf,
+			    size_t len)
 {
-	unsigned char buf[sizeof(YK_CONFIG) + ACC_CODE_SIZE];
+	unsigned char reports[YK_FRAME_REPORTS][FEATURE_RPT_SIZE];
+	int n;
 
-	/* Update checksum and insert config block in buffer if present */
-
-	memset(buf, 0, sizeof(buf));
+	n = _yk_frame_reports(yk_cmd, buf, len, reports);
+	if (n == 0)
+		return 0;
+	return _yk_write_config_reports(yk, yk_cmd, reports, n);
+}
 
-	if (cfg) {
-		cfg->crc = ~yubikey_crc16 ((unsigned char *) cfg,
-					   sizeof(YK_CONFIG) - sizeof(cfg->crc));
-		cfg->crc = yk_endian_swap_16(cfg->crc);
-		memcpy(buf, cfg, sizeof(YK_CONFIG));
-	}
+static int _yk_write(YK_KEY *yk, uint8_t yk_cmd, unsigned char *buf, size_t len)
+{
+	_yk_call_begin(yk, "configuration write");
+	return _yk_call_end(yk, _yk_write_config(yk, yk_cmd, buf, len));
+}
 
-	/* Append current access code if present */
+/* Write a frame plan made ahead of time (see ykframe.c), the same way as
+ * the configuration writes above but with the reports ready to go.
+ */
+int yk_write_plan(YK_KEY *yk, const YK_FRAME_PLAN *plan)
+{
+	_yk_call_begin(yk, "configuration write");
+	return _yk_call_end(yk, _yk_write_config_reports(yk, plan->command,
+							 plan->reports,
+							 plan->nreports));
+}
 
-	if (acc_code)
-		memcpy(buf + sizeof(YK_CONFIG), acc_code, ACC_CODE_SIZE);
+int yk_write_command(YK_KEY *yk, YK_CONFIG *cfg, uint8_t command,
+		    unsigned char *acc_code)
+{
+	unsigned char buf[sizeof(YK_CONFIG) + ACC_CODE_SIZE];
 
+	_yk_config_payload(cfg, acc_code, buf);
 	return _yk_write(yk, command, buf, sizeof(buf));
 
 }
@@ -362,13 +974,17 @@ int yk_write_scan_map(YK_KEY *yk, unsigned char *scan_map)
 /*
  * This function is for doing HMAC-SHA1 or Yubico challenge-response with a key.
  */
-int yk_challenge_response(YK_KEY *yk, uint8_t yk_cmd, int may_block,
+static int _yk_challenge_response_flags(YK_KEY *yk, uint8_t yk_cmd,
+		unsigned int flags,
 		unsigned int challenge_len, const unsigned char *challenge,
 		unsigned int response_len, unsigned char *response)
 {
-	unsigned int flags = 0;
+	unsigned char reports[YK_FRAME_REPORTS][FEATURE_RPT_SIZE];
 	unsigned int bytes_read = 0;
 	unsigned int expect_bytes = 0;
+	unsigned int resends = 0;
+	unsigned long disturbed;
+	int n;
 
 	switch(yk_cmd) {
 	case SLOT_CHAL_HMAC1:
@@ -384,49 +1000,199 @@ int yk_challenge_response(YK_KEY *yk, uint8_t yk_cmd, int may_block,
 		return 0;
 	}
 
-	if (may_block)
-		flags |= YK_FLAG_MAYBLOCK;
-
-	if (! yk_write_to_key(yk, yk_cmd, challenge, challenge_len)) {
+	n = _yk_frame_reports(yk_cmd, challenge, challenge_len, reports);
+	if (n == 0)
+		return 0;
+ again:
+	disturbed = yk->disturbed;
+	if (!_yk_write_reports(yk, yk_cmd, flags & YK_FLAG_POLL_FIRST,
+			       reports, n, NULL))
 		return 0;
-	}
 
-	if (! yk_read_response_from_key(yk, yk_cmd, flags,
-				response, response_len,
-				expect_bytes,
-				&bytes_read)) {
+	if (! yk_read_response(yk, yk_cmd, flags, response, response_len,
+			       expect_bytes, &bytes_read)) {
+		/* The key lost the challenge, ask again */
+		if (yk->disturbed != disturbed && _yk_resend(yk, &resends))
+			goto again;
 		return 0;
 	}
 	return 1;
 }
 
-int * _yk_errno_location(void)
+int yk_challenge_response(YK_KEY *yk, uint8_t yk_cmd, int may_block,
+		unsigned int challenge_len, const unsigned char *challenge,
+		unsigned int response_len, unsigned char *response)
 {
-	static int tsd_init = 0;
-	static int nothread_errno = 0;
-	YK_DEFINE_TSD_METADATA(errno_key);
-	int rc = 0;
+	_yk_call_begin(yk, "challenge-response");
+	return _yk_call_end(yk, _yk_challenge_response_flags(yk, yk_cmd,
+					may_block ? YK_FLAG_MAYBLOCK : 0,
+					challenge_len, challenge,
+					response_len, response));
+}
 
-	if (tsd_init == 0) {
-		if ((rc = YK_TSD_INIT(errno_key, free)) == 0) {
-			tsd_init = 1;
-		} else {
-			tsd_init = -1;
-		}
+/* Run challenge-response for a number of challenges of the same length,
+ * keeping the interface claimed for all of them. Responses are checked
+ * as for yk_challenge_response(), and the key is polled right after the
+ * last part of a challenge is written instead of after the first backoff
+ * sleep. Every responses[i] must have room for response_len bytes, as for
+ * yk_challenge_response().
+ *
+ * If status is not NULL, status[i] is set to 0 for a successful item or the
+ * yk_errno it failed with. If stats is not NULL it gets the number of
+ * successful items, the elapsed time and the resulting rate.
+ *
+ * Returns 1 if all items succeeded, otherwise 0 with yk_errno set to the
+ * error of the first failed item. A failed item doesn't stop the batch,
+ * unless it leaves the key unusable (a USB error).
+ */
+int yk_challenge_response_batch(YK_KEY *yk, uint8_t yk_cmd, int may_block,
+				unsigned int n, unsigned int challenge_len,
+				const unsigned char *const challenges[],
+				unsigned int response_len,
+				unsigned char *const responses[],
+				int *status, YK_BATCH_STATS *stats)
+{
+	unsigned int flags = YK_FLAG_POLL_FIRST;
+	unsigned int i, ok = 0;
+	uint64_t start;
+	int session, first_err = 0;
+
+	if (n > 0 && (!challenges || !responses)) {
+		yk_errno = YK_EINVAL;
+		return 0;
 	}
+	if (may_block)
+		flags |= YK_FLAG_MAYBLOCK;
 
-	if(YK_TSD_GET(int *, errno_key) == NULL) {
-		void *p = calloc(1, sizeof(int));
-		if (!p) {
-			tsd_init = -1;
-		} else {
-			YK_TSD_SET(errno_key, p);
+	if (yk->locking)
+		yk_lock_key(yk);
+	start = yk__now_us();
+	session = yk_begin_session(yk);
+
+	for (i = 0; i < n; i++) {
+		int rc;
+
+		yk_errno = 0;
+		_yk_call_begin(yk, "challenge-response");
+		rc = _yk_call_end(yk, _yk_challenge_response_flags(yk, yk_cmd,
+								   flags,
+								   challenge_len,
+								   challenges[i],
+								   response_len,
+								   responses[i]));
+		if (rc)
+			ok++;
+		if (!rc && !first_err)
+			first_err = yk_errno ? yk_errno : YK_EUSBERR;
+		if (status)
+			status[i] = rc ? 0 : yk_errno;
+		if (!rc && (yk_errno == YK_EUSBERR ||
+			    yk_errno == YK_ECANCELED)) {
+			int err = yk_errno;
+
+			/* mark the rest as not done */
+			for (i++; status && i < n; i++)
+				status[i] = err;
+			break;
 		}
 	}
-	if (tsd_init == 1) {
-		return YK_TSD_GET(int *, errno_key);
-	}
-	return &nothread_errno;
+
+	if (session)
+		yk_end_session(yk);
+	if (yk->locking)
+		yk_unlock_key(yk);
+
+	if (stats) {
+		stats->done = ok;
+		stats->elapsed_us = (unsigned long)(yk__now_us() - start);
+		stats->ops_per_sec = stats->elapsed_us ?
+			ok * 1000000.0 / stats->elapsed_us : 0;
+	}
+	if (ok != n) {
+		/* that of the first failed item, not of the last one */
+		yk_errno = first_err;
+		return 0;
+	}
+	return 1;
+}
+
+/* Error state of a thread: yk_errno and the details of the last failed
+   operation, see yk_get_error_info(). Where the compiler has thread-local
+   variables that is all there is to it, elsewhere it is allocated on the
+   first error of each thread. */
+struct yk_errstate_st {
+	int err;
+	int backend_err;	/* see _yk_backend_errno_location() */
+	int have_info;
+	YK_ERROR_INFO info;
+};
+
+#ifdef HAVE_TLS
+static __thread struct yk_errstate_st yk_errstate;
+
+static struct yk_errstate_st *_yk_errstate(void)
+{
+	return &yk_errstate;
+}
+#else
+static struct yk_errstate_st yk_nothread_errstate;
+static yk__ONCE_T yk_errstate_once = yk__ONCE_INITIALIZER;
+static int yk_errstate_tsd;
+YK_DEFINE_TSD_METADATA(errstate_key);
+
+static void _yk_errstate_init(void)
+{
+	yk_errstate_tsd = YK_TSD_INIT(errstate_key, free) == 0;
+}
+
+static struct yk_errstate_st *_yk_errstate(void)
+{
+	struct yk_errstate_st *p;
+
+	yk__once(yk_errstate_once, _yk_errstate_init);
+	if (!yk_errstate_tsd)
+		return &yk_nothread_errstate;
+	p = YK_TSD_GET(struct yk_errstate_st *, errstate_key);
+	if (p == NULL) {
+		p = calloc(1, sizeof(*p));
+		if (!p || YK_TSD_SET(errstate_key, p)) {
+			free(p);
+			return &yk_nothread_errstate;
+		}
+	}
+	return p;
+}
+#endif
+
+int * _yk_errno_location(void)
+{
+	return &_yk_errstate()->err;
+}
+
+int * _yk_backend_errno_location(void)
+{
+	return &_yk_errstate()->backend_err;
+}
+
+void _yk_error_record(YK_CONTEXT *ctx, const char *op, uint64_t elapsed_us)
+{
+	struct yk_errstate_st *s = _yk_errstate();
+
+	s->have_info = 1;
+	s->info.error = s->err;
+	s->info.op = op;
+	s->info.usb_error = s->err == YK_EUSBERR ?
+		_ykusb_get_error(ctx ? ctx->usb : NULL) : 0;
+	s->info.elapsed_us = (unsigned long)elapsed_us;
+}
+
+int yk_get_error_info(YK_ERROR_INFO *info)
+{
+	struct yk_errstate_st *s = _yk_errstate();
+
+	if (info)
+		*info = s->info;
+	return s->have_info;
 }
 
 static const char *errtext[] = {
@@ -445,6 +1211,8 @@ static const char *errtext[] = {
 	"invalid command for operation",
 	"expected only one YubiKey but several present",
 	"no data returned from device",
+	"invalid argument",
+	"operation canceled",
 };
 const char *yk_strerror(int errnum)
 {
@@ -454,7 +1222,12 @@ const char *yk_strerror(int errnum)
 }
 const char *yk_usb_strerror(void)
 {
-	return _ykusb_strerror();
+	return _ykusb_strerror(yk_default_ctx.usb);
+}
+
+const char *yk_context_usb_strerror(YK_CONTEXT *ctx)
+{
+	return _ykusb_strerror(ctx ? ctx->usb : NULL);
 }
 
 /* This function would've been better named 'yk_read_status_from_key'. Because
@@ -478,7 +1251,7 @@ int yk_read_from_key(YK_KEY *yk, uint8_t slot,
 
 	memset(data, 0, sizeof(data));
 
-	if (!_ykusb_read(yk, REPORT_TYPE_FEATURE, 0, (char *)data, FEATURE_RPT_SIZE))
+	if (!_yk_usb_read(yk, 0, (char *)data, FEATURE_RPT_SIZE))
 		return 0;
 
 	/* This makes it apparent that there's some mysterious value in
@@ -494,16 +1267,24 @@ int yk_read_from_key(YK_KEY *yk, uint8_t slot,
  *
  * The slot parameter is here for future purposes only.
  */
-int yk_wait_for_key_status(YK_KEY *yk, uint8_t slot, unsigned int flags,
-			   unsigned int max_time_ms,
-			   bool logic_and, unsigned char mask,
-			   unsigned char *last_data)
+static int _yk_wait_for_key_status(YK_KEY *yk, uint8_t slot, unsigned int flags,
+				   unsigned int max_time_ms,
+				   bool logic_and, unsigned char mask,
+				   unsigned char *last_data)
 {
 	unsigned char data[FEATURE_RPT_SIZE];
 
-	unsigned int sleepval = 1;
-	unsigned int slept_time = 0;
+	uint64_t max_time = (uint64_t)max_time_ms * 1000;
+	uint64_t waited = 0;
+	uint64_t start = yk__now_us();
+	uint64_t wakeup = start;
+	unsigned int sleepval;
+	unsigned int max_sleepval;
 	int blocking = 0;
+	int done;
+	int kind = logic_and ? YK_TIMING_RESPONSE : YK_TIMING_WRITE;
+	int timed = (flags & YK_FLAG_TIMED) && yk->version;
+	uint64_t first = 0, missed = 0;
 
 	/* Non-zero slot breaks on Windows (libusb-1.0.8-win32), while working fine
 	 * on Linux (and probably MacOS X).
@@ -513,17 +1294,69 @@ int yk_wait_for_key_status(YK_KEY *yk, uint8_t slot, unsigned int flags,
 	 */
 	slot = 0;
 
-	while (slept_time < max_time_ms) {
-		Sleep(sleepval);
-		slept_time += sleepval;
-		/* exponential backoff, up to 500 ms */
-		sleepval *= 2;
-		if (sleepval > 500)
-			sleepval = 500;
+	if (yk->poll_policy == YK_POLL_LEGACY) {
+		sleepval = 1000;
+		max_sleepval = 500 * 1000;
+	} else {
+		sleepval = yk->poll_interval_us;
+		max_sleepval = yk->poll_max_interval_us;
+	}
+	/* Read first just after the key usually gets done */
+	if (timed && yk->poll_policy == YK_POLL_ADAPTIVE) {
+		first = _yk_timing_expect(yk->version, yk->last_cmd, kind);
+		first += first / 8;
+	}
+	yk->last_polls = 0;
+
+	while (waited < max_time) {
+		if ((flags & YK_FLAG_POLL_FIRST) && yk->last_polls == 0 && !first) {
+			/* read status at once */
+		} else if (yk->poll_policy == YK_POLL_DEADLINE ||
+			   yk->poll_policy == YK_POLL_ADAPTIVE) {
+			uint64_t before = yk__now_us();
+			wakeup += yk->last_polls == 0 && first ? first : sleepval;
+			/* Don't sleep past the deadline of the key */
+			if (yk->deadline_us && wakeup > yk->deadline_us)
+				yk__sleep_until(yk->deadline_us);
+			else
+				yk__sleep_until(wakeup);
+			yk->stats.slept_us += yk__now_us() - before;
+		} else if (sleepval > 0) {
+			uint64_t before = yk__now_us();
+			yk__usleep(_yk_time_left(yk, sleepval));
+			yk->stats.slept_us += yk__now_us() - before;
+		}
+		if (yk->deadline_us && !_yk_time_left(yk, 1))
+			break;
+		if (_yk_canceled(yk)) {
+			/* Reset read mode of Yubikey before giving up */
+			yk_force_key_update(yk);
+			yk_errno = YK_ECANCELED;
+			return 0;
+		}
+
+		/* The legacy policy counts the time it asked to sleep, the
+		 * others go by the clock. */
+		if (yk->poll_policy == YK_POLL_LEGACY)
+			waited += sleepval;
+		else
+			waited = yk__now_us() - start;
+
+		/* exponential backoff, up to max_sleepval, from after the
+		 * read placed by the timing profile */
+		if (yk->poll_policy != YK_POLL_FIXED &&
+		    (yk->last_polls > 0 || !first)) {
+			sleepval *= 2;
+			if (sleepval > max_sleepval)
+				sleepval = max_sleepval;
+		}
 
 		/* Read a status report from the key */
 		memset(data, 0, sizeof(data));
-		if (!_ykusb_read(yk, REPORT_TYPE_FEATURE, slot, (char *) &data, FEATURE_RPT_SIZE))
+		yk->last_polls++;
+		yk->total_polls++;
+		yk->stats.polls++;
+		if (!_yk_usb_read(yk, slot, (char *) &data, FEATURE_RPT_SIZE))
 			return 0;
 #ifdef YK_DEBUG
 		_yk_hexdump(data, FEATURE_RPT_SIZE);
@@ -535,15 +1368,22 @@ int yk_wait_for_key_status(YK_KEY *yk, uint8_t slot, unsigned int flags,
 		/* The status byte from the key is now in last byte of data */
 		if (logic_and) {
 			/* Check if Yubikey has SET the bit(s) in mask */
-			if ((data[FEATURE_RPT_SIZE - 1] & mask) == mask) {
-				return 1;
-			}
+			done = (data[FEATURE_RPT_SIZE - 1] & mask) == mask;
 		} else {
 			/* Check if Yubikey has CLEARED the bit(s) in mask */
-			if (! (data[FEATURE_RPT_SIZE - 1] & mask)) {
-				return 1;
-			}
+			done = ! (data[FEATURE_RPT_SIZE - 1] & mask);
+		}
+		if (done) {
+			/* Waits for a touch say nothing about the key */
+			if (blocking)
+				_yk_touch_done(yk);
+			else if (timed)
+				_yk_timing_learn(yk->version, yk->last_cmd, kind,
+						 missed, yk__now_us() - start,
+						 first && yk->last_polls == 1);
+			return 1;
 		}
+		missed = yk__now_us() - start;
 
 		/* Check if Yubikey says it will wait for user interaction */
 		if ((data[FEATURE_RPT_SIZE - 1] & RESP_TIMEOUT_WAIT_FLAG) == RESP_TIMEOUT_WAIT_FLAG) {
@@ -551,8 +1391,15 @@ int yk_wait_for_key_status(YK_KEY *yk, uint8_t slot, unsigned int flags,
 				if (! blocking) {
 					/* Extend timeout first time we see RESP_TIMEOUT_WAIT_FLAG. */
 					blocking = 1;
-					max_time_ms += 256 * 1000;
+					max_time += (uint64_t)yk->timeouts.touch_ms * 1000;
+					/* and poll at the touch pace from now on */
+					if (yk->touch_interval_us) {
+						sleepval = max_sleepval = yk->touch_interval_us;
+						wakeup = yk__now_us();
+					}
+					_yk_touch_begin(yk);
 				}
+				yk->touch_seen_us = yk__now_us();
 			} else {
 				/* Reset read mode of Yubikey before aborting. */
 				yk_force_key_update(yk);
@@ -571,6 +1418,382 @@ int yk_wait_for_key_status(YK_KEY *yk, uint8_t slot, unsigned int flags,
 	return 0;
 }
 
+int yk_wait_for_key_status(YK_KEY *yk, uint8_t slot, unsigned int flags,
+			   unsigned int max_time_ms,
+			   bool logic_and, unsigned char mask,
+			   unsigned char *last_data)
+{
+	uint64_t start = yk__now_us();
+	int rc;
+
+	rc = _yk_wait_for_key_status(yk, slot, flags, max_time_ms,
+				     logic_and, mask, last_data);
+	_yk_stats_add(&yk->stats.waits, yk__now_us() - start);
+	if (!rc && yk_errno == YK_ETIMEOUT)
+		yk->stats.timeouts++;
+	return rc;
+}
+
+void _yk_touch_begin(YK_KEY *yk)
+{
+	yk->touch_start_us = yk__now_us();
+	if (yk->touch_cb)
+		yk->touch_cb(yk, yk->touch_userdata);
+}
+
+void _yk_touch_done(YK_KEY *yk)
+{
+	uint64_t now = yk__now_us();
+
+	_yk_stats_add(&yk->stats.touch_waits, now - yk->touch_start_us);
+	_yk_stats_add(&yk->stats.touch_latency, now - yk->touch_seen_us);
+}
+
+/* Call cb when the key starts waiting for a touch, see ykcore.h. NULL
+ * turns it off.
+ */
+int yk_set_touch_callback(YK_KEY *yk, yk_touch_cb cb, void *userdata)
+{
+	yk->touch_cb = cb;
+	yk->touch_userdata = userdata;
+	return 1;
+}
+
+/* Read the status every interval_us while the key waits for a touch,
+ * instead of going on with the poll policy's backoff, which with
+ * YK_POLL_LEGACY reaches 500 ms between reads and so notices a touch up
+ * to half a second late.
+ */
+int yk_set_touch_polling(YK_KEY *yk, unsigned int interval_us)
+{
+	yk->touch_interval_us = interval_us;
+	return 1;
+}
+
+/* Select how yk_wait_for_key_status() paces its status reads on this key.
+ *
+ * YK_POLL_LEGACY sleeps 1 ms before the first read and doubles that up to
+ * 500 ms; the intervals are ignored. YK_POLL_FIXED sleeps interval_us before
+ * every read, 0 meaning spin. YK_POLL_BACKOFF starts at interval_us and
+ * doubles up to max_interval_us. YK_POLL_DEADLINE uses the same schedule as
+ * YK_POLL_BACKOFF but sleeps to absolute wakeup times, so oversleeping in one
+ * round doesn't delay the following ones. YK_POLL_ADAPTIVE places the first
+ * read of a wait for a command a little after the time keys with the same
+ * firmware took for it before (see yktiming.c), and goes on as
+ * YK_POLL_DEADLINE if the key isn't done by then.
+ */
+int yk_set_poll_policy(YK_KEY *yk, int policy,
+		       unsigned int interval_us, unsigned int max_interval_us)
+{
+	switch (policy) {
+	case YK_POLL_LEGACY:
+	case YK_POLL_FIXED:
+		break;
+	case YK_POLL_BACKOFF:
+	case YK_POLL_DEADLINE:
+	case YK_POLL_ADAPTIVE:
+		if (max_interval_us < interval_us) {
+			yk_errno = YK_EINVAL;
+			return 0;
+		}
+		break;
+	default:
+		yk_errno = YK_EINVAL;
+		return 0;
+	}
+
+	yk->poll_policy = policy;
+	yk->poll_interval_us = interval_us;
+	yk->poll_max_interval_us = max_interval_us;
+	return 1;
+}
+
+/* Set how long operations on the key may take, see YK_TIMEOUTS. The
+ * defaults are what ykcore has always used: 1000 ms for a USB transfer,
+ * 1150 ms for the key to take the next report of a frame, 1000 ms for a
+ * response to start and 256 s more once the key waits for a touch. Callers
+ * that would rather fail over to another key than wait can lower them.
+ */
+int yk_set_timeouts(YK_KEY *yk, const YK_TIMEOUTS *timeouts)
+{
+	/* A transfer timeout of 0 means no timeout to libusb */
+	if (!timeouts || timeouts->transfer_ms == 0) {
+		yk_errno = YK_EINVAL;
+		return 0;
+	}
+	yk->timeouts = *timeouts;
+	return 1;
+}
+
+int yk_get_timeouts(YK_KEY *yk, YK_TIMEOUTS *timeouts)
+{
+	if (!timeouts) {
+		yk_errno = YK_EINVAL;
+		return 0;
+	}
+	*timeouts = yk->timeouts;
+	return 1;
+}
+
+/* Turn recovery from transient errors on or off, see ykcore.h. To find
+ * the key again by serial number once it went away, reopening reads the
+ * serial of the key here, when it can.
+ */
+int yk_set_recovery(YK_KEY *yk, const YK_RECOVERY *recovery)
+{
+	if (!recovery || recovery->max_backoff_us < recovery->backoff_us) {
+		yk_errno = YK_EINVAL;
+		return 0;
+	}
+	yk->recovery = *recovery;
+	if (recovery->reopen && !yk->serial) {
+		int err = yk_errno;
+
+		if (!yk_get_serial(yk, 0, 0, &yk->serial))
+			yk->serial = 0;
+		yk_errno = err;
+	}
+	return 1;
+}
+
+int yk_get_recovery(YK_KEY *yk, YK_RECOVERY *recovery)
+{
+	if (!recovery) {
+		yk_errno = YK_EINVAL;
+		return 0;
+	}
+	*recovery = yk->recovery;
+	return 1;
+}
+
+/* Set an absolute deadline, on the clock of yk_now_us(), for everything
+ * done on the key from now on. Status waits and transfers are cut short so
+ * that no operation runs past it, and fail with YK_ETIMEOUT once it has
+ * passed. A deadline of 0 removes it.
+ */
+int yk_set_deadline(YK_KEY *yk, uint64_t deadline_us)
+{
+	yk->deadline_us = deadline_us;
+	return 1;
+}
+
+/* Monotonic time in microseconds, for computing deadlines */
+uint64_t yk_now_us(void)
+{
+	return yk__now_us();
+}
+
+/* A cancellation handle lets a thread stop operations that another thread
+ * is blocked in, e.g. a challenge-response waiting minutes for a touch. It
+ * can be attached to any number of keys, and outlive them. The waiting
+ * thread notices the cancellation after at most one poll interval, resets
+ * the read mode of the key and fails with YK_ECANCELED.
+ */
+YK_CANCEL *yk_cancel_new(void)
+{
+	YK_CANCEL *cancel = calloc(1, sizeof(YK_CANCEL));
+
+	if (!cancel)
+		yk_errno = YK_ENOMEM;
+	return cancel;
+}
+
+void yk_cancel_free(YK_CANCEL *cancel)
+{
+	free(cancel);
+}
+
+/* May be called from any thread, and from signal handlers */
+int yk_cancel(YK_CANCEL *cancel)
+{
+	yk__atomic_store(&cancel->canceled, 1);
+	return 1;
+}
+
+int yk_cancel_reset(YK_CANCEL *cancel)
+{
+	yk__atomic_store(&cancel->canceled, 0);
+	return 1;
+}
+
+int yk_cancel_requested(const YK_CANCEL *cancel)
+{
+	return yk__atomic_load(&cancel->canceled);
+}
+
+/* Attach a cancellation handle to the key, NULL to detach it */
+int yk_set_cancel(YK_KEY *yk, YK_CANCEL *cancel)
+{
+	yk->cancel = cancel;
+	return 1;
+}
+
+/* Turn the operation lock of the key on or off. It must not be changed
+ * while other threads use the key. With the lock on, each operation --
+ * a status read, a configuration write, a challenge-response, a whole
+ * batch -- runs alone on the key. Threads waiting for it are let in first
+ * come, first served; how often and how long they wait shows up in
+ * yk_get_stats(). The non-blocking operations of ykop.c take it as well,
+ * without waiting: they stay queued while another thread has the key.
+ */
+int yk_set_locking(YK_KEY *yk, int enable)
+{
+	if (enable && !yk->locking) {
+		yk__mutex_init(yk->lock_mutex);
+		yk__cond_init(yk->lock_cond);
+		yk->lock_next = 0;
+		yk->lock_serving = 0;
+		yk->lock_depth = 0;
+		yk->lock_by_op = 0;
+		yk->locking = 1;
+	} else if (!enable && yk->locking) {
+		yk->locking = 0;
+		yk__cond_destroy(yk->lock_cond);
+		yk__mutex_destroy(yk->lock_mutex);
+	}
+	return 1;
+}
+
+/* Hold the operation lock across several calls. The lock is recursive,
+ * the operations made meanwhile by the same thread go ahead.
+ */
+int yk_lock_key(YK_KEY *yk)
+{
+	unsigned long ticket;
+
+	if (!yk->locking) {
+		yk_errno = YK_EINVAL;
+		return 0;
+	}
+
+	yk__mutex_lock(yk->lock_mutex);
+	if (yk->lock_depth > 0 && !yk->lock_by_op &&
+	    yk__thread_equal(yk->lock_owner, yk__thread_self())) {
+		yk->lock_depth++;
+		yk__mutex_unlock(yk->lock_mutex);
+		return 1;
+	}
+
+	ticket = yk->lock_next++;
+	if (ticket != yk->lock_serving) {
+		uint64_t start = yk__now_us();
+
+		yk->stats.lock_contended++;
+		while (ticket != yk->lock_serving)
+			yk__cond_wait(yk->lock_cond, yk->lock_mutex);
+		_yk_stats_add(&yk->stats.lock_waits, yk__now_us() - start);
+	}
+	yk->stats.lock_acquired++;
+	yk->lock_owner = yk__thread_self();
+	yk->lock_depth = 1;
+	yk__mutex_unlock(yk->lock_mutex);
+	return 1;
+}
+
+int yk_unlock_key(YK_KEY *yk)
+{
+	if (!yk->locking) {
+		yk_errno = YK_EINVAL;
+		return 0;
+	}
+
+	yk__mutex_lock(yk->lock_mutex);
+	if (yk->lock_depth == 0 || yk->lock_by_op) {
+		yk__mutex_unlock(yk->lock_mutex);
+		yk_errno = YK_EINVAL;
+		return 0;
+	}
+	if (--yk->lock_depth == 0) {
+		yk->lock_serving++;
+		yk__cond_broadcast(yk->lock_cond);
+	}
+	yk__mutex_unlock(yk->lock_mutex);
+	return 1;
+}
+
+/* Only taken when nobody has the lock or waits for it, so threads
+   already waiting go first. */
+int _yk_op_trylock_key(YK_KEY *yk)
+{
+	int rc = 0;
+
+	if (!yk->locking)
+		return 1;
+
+	yk__mutex_lock(yk->lock_mutex);
+	if (yk->lock_depth == 0 && yk->lock_next == yk->lock_serving) {
+		yk->lock_next++;
+		yk->lock_depth = 1;
+		yk->lock_by_op = 1;
+		yk->stats.lock_acquired++;
+		rc = 1;
+	}
+	yk__mutex_unlock(yk->lock_mutex);
+	return rc;
+}
+
+void _yk_op_unlock_key(YK_KEY *yk)
+{
+	if (!yk->locking)
+		return;
+
+	yk__mutex_lock(yk->lock_mutex);
+	yk->lock_by_op = 0;
+	yk->lock_depth = 0;
+	yk->lock_serving++;
+	yk__cond_broadcast(yk->lock_cond);
+	yk__mutex_unlock(yk->lock_mutex);
+}
+
+/* Get the number of feature report transfers done by the last operation on
+ * the key (yk_get_status(), yk_get_serial(), yk_get_capabilities(),
+ * yk_challenge_response() or one of the configuration writes), and in total
+ * since it was opened.
+ */
+int yk_get_transfer_counts(YK_KEY *yk, unsigned int *last_op,
+			   unsigned long *total)
+{
+	if (last_op)
+		*last_op = yk->last_transfers;
+	if (total)
+		*total = yk->transfers;
+	return 1;
+}
+
+/* Get the transport statistics of the key: latency histograms of report
+ * transfers, status waits and whole operations, and counters for status
+ * polls, time slept between them, all-zero reports left out of frames,
+ * transfer errors and timeouts. They are always kept; taking a clock
+ * reading around each transfer costs little next to the transfer itself.
+ */
+int yk_get_stats(YK_KEY *yk, YK_STATS *stats)
+{
+	if (!stats) {
+		yk_errno = YK_EINVAL;
+		return 0;
+	}
+	*stats = yk->stats;
+	return 1;
+}
+
+int yk_reset_stats(YK_KEY *yk)
+{
+	memset(&yk->stats, 0, sizeof(yk->stats));
+	return 1;
+}
+
+/* Get the number of status reads done by the last yk_wait_for_key_status()
+ * call on this key, and in total since it was opened.
+ */
+int yk_get_poll_counts(YK_KEY *yk, unsigned int *last_wait, unsigned long *total)
+{
+	if (last_wait)
+		*last_wait = yk->last_polls;
+	if (total)
+		*total = yk->total_polls;
+	return 1;
+}
+
 /* Read one or more feature reports from a Yubikey and put them together.
  *
  * Bufsize must be able to hold at least 2 more bytes than you are expecting
@@ -601,7 +1824,7 @@ int yk_read_response_from_key(YK_KEY *yk, uint8_t slot, unsigned int flags,
 	fprintf(stderr, "YK_DEBUG: Read %i bytes from YubiKey :\n", expect_bytes);
 #endif
 	/* Wait for the key to turn on RESP_PENDING_FLAG */
-	if (! yk_wait_for_key_status(yk, slot, flags, 1000, true, RESP_PENDING_FLAG, (unsigned char *) &data))
+	if (! yk_wait_for_key_status(yk, slot, flags | YK_FLAG_TIMED, yk->timeouts.response_ms, true, RESP_PENDING_FLAG, (unsigned char *) &data))
 		return 0;
 
 	/* The first part of the response was read by yk_wait_for_key_status(). We need
@@ -613,7 +1836,7 @@ int yk_read_response_from_key(YK_KEY *yk, uint8_t slot, unsigned int flags,
 	while (*bytes_read + FEATURE_RPT_SIZE <= bufsize) {
 		memset(data, 0, sizeof(data));
 
-		if (!_ykusb_read(yk, REPORT_TYPE_FEATURE, 0, (char *)data, FEATURE_RPT_SIZE))
+		if (!_yk_usb_read(yk, 0, (char *)data, FEATURE_RPT_SIZE))
 			return 0;
 #ifdef YK_DEBUG
 		_yk_hexdump(data, FEATURE_RPT_SIZE);
@@ -625,7 +1848,7 @@ int yk_read_response_from_key(YK_KEY *yk, uint8_t slot, unsigned int flags,
 			if ((data[FEATURE_RPT_SIZE - 1] & 31) == 0) {
 				if (expect_bytes > 0) {
 					/* Size of response is known. Verify CRC. */
-					int crc = yubikey_crc16(buf, expect_bytes + 2);
+					int crc = yk_crc16(buf, expect_bytes + 2);
 					if (crc != YK_CRC_OK_RESIDUAL) {
 						yk_errno = YK_ECHECKSUM;
 						return 0;
@@ -655,91 +1878,161 @@ int yk_read_response_from_key(YK_KEY *yk, uint8_t slot, unsigned int flags,
 	return 0;
 }
 
-/*
- * Send something to the YubiKey. The command, as well as the slot, is
- * given in the 'slot' parameter (e.g. SLOT_CHAL_HMAC2 to send a HMAC-SHA1
- * challenge to slot 2).
+/* Read a response straight into buf, which only has to hold the response
+ * itself. Each report is taken up to the end of the response and its CRC,
+ * the CRC is updated as the reports come in, and reading stops when the
+ * CRC is complete, without waiting for the key to end the response.
+ *
+ * With expect_bytes 0 the first byte of the response gives the number of
+ * bytes that follow it, as in the capabilities response.
  */
-int yk_write_to_key(YK_KEY *yk, uint8_t slot, const void *buf, int bufcount)
+int yk_read_response(YK_KEY *yk, uint8_t slot, unsigned int flags,
+		     void *buf, unsigned int bufsize, unsigned int expect_bytes,
+		     unsigned int *bytes_read)
 {
-	YK_FRAME frame;
-	unsigned char repbuf[FEATURE_RPT_SIZE];
-	int i, seq;
-	unsigned char *ptr, *end;
-
-	if (bufcount > sizeof(frame.payload)) {
-		yk_errno = YK_EWRONGSIZ;
-		return 0;
-	}
-
-	/* Insert data and set slot # */
-
-	memset(&frame, 0, sizeof(frame));
-	memcpy(frame.payload, buf, bufcount);
-	frame.slot = slot;
+	unsigned char data[FEATURE_RPT_SIZE];
+	unsigned int got = 0, want = expect_bytes, n;
+	uint16_t crc = 0xffff;
 
-	/* Append slot checksum */
+	*bytes_read = 0;
+	memset(data, 0, sizeof(data));
 
-	i = yubikey_crc16 (frame.payload, sizeof(frame.payload));
-	frame.crc = yk_endian_swap_16(i);
+#ifdef YK_DEBUG
+	fprintf(stderr, "YK_DEBUG: Read %i bytes from YubiKey :\n", expect_bytes);
+#endif
+	/* Wait for the key to turn on RESP_PENDING_FLAG, the report that
+	 * does is the first part of the response */
+	if (! yk_wait_for_key_status(yk, slot, flags | YK_FLAG_TIMED, yk->timeouts.response_ms, true, RESP_PENDING_FLAG, data))
+		return 0;
 
-	/* Chop up the data into parts that fits into the payload of a
-	   feature report. Set the sequence number | 0x80 in the end
-	   of the feature report. When the Yubikey has processed it,
-	   it will clear this byte, signaling that the next part can be
-	   sent */
+	if (want == 0)
+		want = data[0] + 1;
+	if (want > bufsize) {
+		yk_errno = YK_EWRONGSIZ;
+		goto out;
+	}
 
-	ptr = (unsigned char *) &frame;
-	end = (unsigned char *) &frame + sizeof(frame);
+	for (;;) {
+		n = want + 2 - got;
+		if (n > FEATURE_RPT_SIZE - 1)
+			n = FEATURE_RPT_SIZE - 1;
+		crc = yk_crc16_update(crc, data, n);
+		if (got < want)
+			memcpy((unsigned char *)buf + got, data,
+			       n < want - got ? n : want - got);
+		got += n;
+		if (got == want + 2)
+			break;
 
+		memset(data, 0, sizeof(data));
+		if (!_yk_usb_read(yk, 0, (char *)data, FEATURE_RPT_SIZE))
+			goto out;
 #ifdef YK_DEBUG
-	fprintf(stderr, "YK_DEBUG: Write %i bytes to YubiKey :\n", bufcount);
+		_yk_hexdump(data, FEATURE_RPT_SIZE);
 #endif
-	for (seq = 0; ptr < end; seq++) {
-		int all_zeros = 1;
-		/* Ignore parts that are all zeroes except first and last
-		   to speed up the transfer */
-
-		for (i = 0; i < (FEATURE_RPT_SIZE - 1); i++) {
-			if ((repbuf[i] = *ptr++)) all_zeros = 0;
+		/* The key ended the response, or dropped it, early */
+		if (!(data[FEATURE_RPT_SIZE - 1] & RESP_PENDING_FLAG) ||
+		    (data[FEATURE_RPT_SIZE - 1] & 31) == 0) {
+			yk_errno = YK_ENODATA;
+			goto out;
 		}
-		if (all_zeros && (seq > 0) && (ptr < end))
-			continue;
+	}
 
-		/* sequence number goes into lower bits of last byte */
-		repbuf[i] = seq | SLOT_WRITE_FLAG;
+	if (crc != YK_CRC_OK_RESIDUAL) {
+		yk_errno = YK_ECHECKSUM;
+		goto out;
+	}
 
+	/* Reset read mode of Yubikey before returning. */
+	yk_force_key_update(yk);
+	*bytes_read = want;
+	return 1;
+
+ out:
+	yk_force_key_update(yk);
+	return 0;
+}
+
+/*
+ * Write the reports of a frame, waiting for the key to be ready for each.
+ * If 'status' holds a status report read just before, the first wait is
+ * skipped when it already shows the key ready. Flags are passed on to
+ * yk_wait_for_key_status().
+ */
+static int _yk_write_reports(YK_KEY *yk, uint8_t slot, unsigned int flags,
+			     const unsigned char reports[][FEATURE_RPT_SIZE],
+			     int n, const unsigned char *status)
+{
+	unsigned int resends = 0;
+	unsigned long disturbed;
+	int i;
+
+	yk->stats.skipped_reports += YK_FRAME_REPORTS - n;
+ again:
+	yk->last_cmd = slot;
+	disturbed = yk->disturbed;
+	for (i = 0; i < n; i++) {
 		/* When the Yubikey clears the SLOT_WRITE_FLAG, the
 		 * next part can be sent.
 		 */
-		if (! yk_wait_for_key_status(yk, slot, 0, WAIT_FOR_WRITE_FLAG,
-					     false, SLOT_WRITE_FLAG, NULL))
+		if (i == 0 && status &&
+		    !(status[FEATURE_RPT_SIZE - 1] & SLOT_WRITE_FLAG)) {
+			/* ready already */
+		} else if (! yk_wait_for_key_status(yk, slot, flags,
+						    yk->timeouts.write_ms, false,
+						    SLOT_WRITE_FLAG, NULL)) {
 			return 0;
+		}
 #ifdef YK_DEBUG
-		_yk_hexdump(repbuf, FEATURE_RPT_SIZE);
+		_yk_hexdump(reports[i], FEATURE_RPT_SIZE);
 #endif
-		if (!_ykusb_write(yk, REPORT_TYPE_FEATURE, 0,
-				  (char *)repbuf, FEATURE_RPT_SIZE))
+		if (!_yk_usb_write(yk, 0, (char *)reports[i], FEATURE_RPT_SIZE))
 			return 0;
+		/* The key may have missed a report, or got one twice, or
+		   lost the frame when it went away: start over */
+		if (yk->disturbed != disturbed && _yk_resend(yk, &resends)) {
+			status = NULL;
+			goto again;
+		}
 	}
 
 	return 1;
 }
 
+/*
+ * Send something to the YubiKey. The command, as well as the slot, is
+ * given in the 'slot' parameter (e.g. SLOT_CHAL_HMAC2 to send a HMAC-SHA1
+ * challenge to slot 2).
+ */
+int yk_write_to_key(YK_KEY *yk, uint8_t slot, const void *buf, int bufcount)
+{
+	unsigned char reports[YK_FRAME_REPORTS][FEATURE_RPT_SIZE];
+	int n;
+
+	n = _yk_frame_reports(slot, buf, bufcount, reports);
+	if (n == 0)
+		return 0;
+
+#ifdef YK_DEBUG
+	fprintf(stderr, "YK_DEBUG: Write %i bytes to YubiKey :\n", bufcount);
+#endif
+	return _yk_write_reports(yk, slot, 0, reports, n, NULL);
+}
+
 int yk_force_key_update(YK_KEY *yk)
 {
 	unsigned char buf[FEATURE_RPT_SIZE];
 
 	memset(buf, 0, sizeof(buf));
 	buf[FEATURE_RPT_SIZE - 1] = DUMMY_REPORT_WRITE; /* Invalid sequence = update only */
-	if (!_ykusb_write(yk, REPORT_TYPE_FEATURE, 0, (char *)buf, FEATURE_RPT_SIZE))
+	if (!_yk_usb_write(yk, 0, (char *)buf, FEATURE_RPT_SIZE))
 		return 0;
 
 	return 1;
 }
 
 int yk_get_key_vid_pid(YK_KEY *yk, int *vid, int *pid) {
-	return _ykusb_get_vid_pid(yk, vid, pid);
+	return _ykusb_get_vid_pid(yk->dev, vid, pid);
 }
 
 uint16_t yk_endian_swap_16(uint16_t x)
@@ -64,14 +64,52 @@ typedef struct yk_nav_st YK_NAV;	/* Navigation structure.
 typedef struct yk_frame_st YK_FRAME;	/* Data frame for write operation */
 typedef struct ndef_st YK_NDEF;
 typedef struct yk_device_config_st YK_DEVICE_CONFIG;
+typedef struct yk_op_st YK_OP;		/* Non-blocking operation, see below */
+typedef struct yk_cancel_st YK_CANCEL;	/* Cancellation handle, see below */
+typedef struct yk_context_st YK_CONTEXT; /* Library context, see below */
+typedef struct yk_frame_plan_st YK_FRAME_PLAN; /* Encoded write, see below */
+
+/* A file descriptor an event loop should watch for yk_handle_events() */
+typedef struct yk_pollfd_st {
+	int fd;
+	short events;		/* POLLIN/POLLOUT as for poll(2) */
+} YK_POLLFD;
+
+/* A key found by yk_enumerate() */
+#define YK_DEVICE_PATH_SIZE	256
+typedef struct yk_device_info_st {
+	int index;		/* index for yk_open_key(), -1 if unknown */
+	char path[YK_DEVICE_PATH_SIZE];	/* backend specific location */
+	int vendor_id;
+	int product_id;
+	const char *family;	/* product family, e.g. "YubiKey 4" */
+	/* Only filled in with YK_ENUM_DETAILS, 0 if unknown */
+	unsigned int serial;
+	unsigned char version_major;
+	unsigned char version_minor;
+	unsigned char version_build;
+} YK_DEVICE_INFO;
 
 /*************************************************************************
  *
  * Library initialisation functions.
  *
+ * yk_init() sets up the default context, which all functions without a
+ * YK_CONTEXT argument work in. It is set up once per process; after that
+ * yk_init() and yk_release() only count users and are cheap to call
+ * around every job of a short-lived thread.
+ *
+ * A context of its own keeps the USB state, the error behind
+ * yk_context_usb_strerror(), the non-blocking operations and the hotplug
+ * registry of one part of a program apart from the rest. Keys opened
+ * through a context belong to it; close them and free their operations
+ * before freeing the context.
+ *
  ****/
 extern int yk_init(void);
 extern int yk_release(void);
+extern YK_CONTEXT *yk_context_new(void);
+extern int yk_context_free(YK_CONTEXT *ctx);
 
 /*************************************************************************
  *
@@ -83,6 +121,51 @@ extern YK_KEY *yk_open_first_key(void);
 extern YK_KEY *yk_open_key(int);	/* opens nth key available */
 extern int yk_close_key(YK_KEY *k);		/* closes a previously opened key */
 
+/* List all attached keys in a single walk of the bus. With YK_ENUM_DETAILS
+   each key is also opened to read its firmware version and serial. The
+   list is freed with yk_free_device_list(). */
+extern int yk_enumerate(YK_DEVICE_INFO **list, size_t *count,
+			unsigned int flags);
+extern void yk_free_device_list(YK_DEVICE_INFO *list);
+/* opens the key at the location given by a yk_enumerate() entry */
+extern YK_KEY *yk_open_device(const YK_DEVICE_INFO *info);
+/* opens the key with the given serial number. Where keys were last seen
+   is cached under $XDG_RUNTIME_DIR, so usually only that key is opened. */
+extern YK_KEY *yk_open_key_by_serial(unsigned int serial);
+
+/* The same, for keys of a context of its own */
+extern YK_KEY *yk_context_open_key(YK_CONTEXT *ctx, int index);
+extern int yk_context_enumerate(YK_CONTEXT *ctx, YK_DEVICE_INFO **list,
+				size_t *count, unsigned int flags);
+extern YK_KEY *yk_context_open_device(YK_CONTEXT *ctx,
+				      const YK_DEVICE_INFO *info);
+extern YK_KEY *yk_context_open_key_by_serial(YK_CONTEXT *ctx,
+					     unsigned int serial);
+
+/* A process-wide pool of open keys, for programs doing many short
+   operations. Keys are handed out by index or serial and stay open when
+   put back; before handing a key out again it is checked with a status
+   read and reopened if it was unplugged. A key is handed out to one
+   caller at a time, whether asked for by index or by serial, others
+   asking for it wait. Keys from the pool are
+   put back with yk_pool_put_key(), never closed, and come from the
+   default context, so yk_init() must have been called. */
+extern YK_KEY *yk_pool_get_key(int index);
+extern YK_KEY *yk_pool_get_key_by_serial(unsigned int serial);
+extern int yk_pool_put_key(YK_KEY *yk);
+/* close the keys in the pool that are not handed out */
+extern int yk_pool_flush(void);
+
+/* Hold the USB interface claimed across several operations instead of
+   claiming and releasing it for every feature report. Sessions nest, the
+   interface is released when the outermost session ends or the key is
+   closed. */
+extern int yk_begin_session(YK_KEY *k);
+extern int yk_end_session(YK_KEY *k);
+/* Number of interface claims and releases done on the key so far. */
+extern int yk_get_claim_counts(YK_KEY *k, unsigned long *claims,
+			       unsigned long *releases);
+
 /*************************************************************************
  *
  * Functions to get data from the key.
@@ -100,10 +183,142 @@ extern int yk_wait_for_key_status(YK_KEY *yk, uint8_t slot, unsigned int flags,
 				  unsigned int max_time_ms,
 				  bool logic_and, unsigned char mask,
 				  unsigned char *last_data);
+/* Choose how yk_wait_for_key_status() paces its status reads, and see how
+   many reads it took. See YK_POLL_* below. */
+extern int yk_set_poll_policy(YK_KEY *yk, int policy,
+			      unsigned int interval_us,
+			      unsigned int max_interval_us);
+extern int yk_get_poll_counts(YK_KEY *yk, unsigned int *last_wait,
+			      unsigned long *total);
+/* Timing profiles: how long keys of a firmware version take to process
+   each command (YK_TIMING_WRITE) or to start its response
+   (YK_TIMING_RESPONSE), learned from all waits in the process and used by
+   YK_POLL_ADAPTIVE. They can be saved to a file and loaded in the next
+   run. yk_timing_lookup() fails with YK_ENODATA for a command nothing was
+   learned about yet. */
+#define YK_TIMING_WRITE		0
+#define YK_TIMING_RESPONSE	1
+extern int yk_timing_lookup(unsigned int major, unsigned int minor,
+			    unsigned int build, uint8_t cmd, int kind,
+			    unsigned long *expect_us, unsigned long *samples);
+extern int yk_timing_load(const char *path);
+extern int yk_timing_save(const char *path);
+extern int yk_timing_reset(void);
+/* How long operations on the key may take, in milliseconds: a single USB
+   report transfer, the key getting ready for the next report of a frame,
+   the key starting a response, and the extra wait once the key says it
+   waits for a touch. */
+typedef struct yk_timeouts_st {
+	unsigned int transfer_ms;
+	unsigned int write_ms;
+	unsigned int response_ms;
+	unsigned int touch_ms;
+} YK_TIMEOUTS;
+extern int yk_set_timeouts(YK_KEY *yk, const YK_TIMEOUTS *timeouts);
+extern int yk_get_timeouts(YK_KEY *yk, YK_TIMEOUTS *timeouts);
+/* Fail operations on the key with YK_ETIMEOUT once yk_now_us() reaches
+   deadline_us, whatever the timeouts above. 0 clears the deadline. */
+extern int yk_set_deadline(YK_KEY *yk, uint64_t deadline_us);
+/* Recovery from transient USB errors, off by default (retries 0). A
+   report transfer failing with a stall, an I/O error or a busy device is
+   tried again up to 'retries' times, after a randomized wait starting
+   around backoff_us and doubling up to max_backoff_us. With 'reopen', a
+   key that went away and came back, re-enumerated, is opened again by its
+   location or serial number, and the YK_KEY stays usable. A frame or a
+   challenge interrupted this way is sent again from the start, after
+   yk_force_key_update() has brought the key back in step. Only the
+   blocking calls recover, not the operations of ykop. */
+typedef struct yk_recovery_st {
+	unsigned int retries;
+	unsigned int backoff_us;
+	unsigned int max_backoff_us;
+	int reopen;
+} YK_RECOVERY;
+extern int yk_set_recovery(YK_KEY *yk, const YK_RECOVERY *recovery);
+extern int yk_get_recovery(YK_KEY *yk, YK_RECOVERY *recovery);
+extern uint64_t yk_now_us(void);
+/* Cancel operations on keys from another thread. Once yk_cancel() is
+   called on a handle, waits on the keys it is attached to with
+   yk_set_cancel() reset the key and fail with YK_ECANCELED, until
+   yk_cancel_reset(). */
+extern YK_CANCEL *yk_cancel_new(void);
+extern void yk_cancel_free(YK_CANCEL *cancel);
+extern int yk_cancel(YK_CANCEL *cancel);
+extern int yk_cancel_reset(YK_CANCEL *cancel);
+extern int yk_cancel_requested(const YK_CANCEL *cancel);
+extern int yk_set_cancel(YK_KEY *yk, YK_CANCEL *cancel);
+/* Let threads share a key: with locking on, every operation on the key
+   holds it exclusively, and threads take turns in the order they came.
+   yk_lock_key() and yk_unlock_key() hold it across several calls.
+   Non-blocking operations hold it from start to finish, and stay queued
+   while a thread has it. */
+extern int yk_set_locking(YK_KEY *yk, int enable);
+extern int yk_lock_key(YK_KEY *yk);
+extern int yk_unlock_key(YK_KEY *yk);
+/* Touch: a slot set up with CHAL_BTN_TRIG makes the key wait for a touch
+   before answering a challenge, with YK_FLAG_MAYBLOCK. The callback is
+   called when the key starts waiting, from the thread running the
+   operation and with the key in use, so a UI can ask for the touch right
+   away; it must not use the key. While the key waits its status is read
+   every interval_us, 20000 to 50000 notices a touch quickly without much
+   traffic; 0 (the default) keeps to the poll policy. */
+typedef void (*yk_touch_cb)(YK_KEY *yk, void *userdata);
+extern int yk_set_touch_callback(YK_KEY *yk, yk_touch_cb cb, void *userdata);
+extern int yk_set_touch_polling(YK_KEY *yk, unsigned int interval_us);
+/* Number of USB feature report transfers the last operation on the key
+   took, and the total since it was opened. */
+extern int yk_get_transfer_counts(YK_KEY *yk, unsigned int *last_op,
+				  unsigned long *total);
+/* Transport statistics of a key, kept from when it was opened. Latencies
+   are in microseconds; bucket i of a histogram counts those below 2^i,
+   and the last bucket everything above. */
+#define YK_STATS_BUCKETS	24
+typedef struct yk_histogram_st {
+	unsigned long count;
+	unsigned long total_us;
+	unsigned long max_us;
+	unsigned long buckets[YK_STATS_BUCKETS];
+} YK_HISTOGRAM;
+typedef struct yk_stats_st {
+	YK_HISTOGRAM reads;		/* feature report reads */
+	YK_HISTOGRAM writes;		/* feature report writes */
+	YK_HISTOGRAM waits;		/* yk_wait_for_key_status() calls */
+	YK_HISTOGRAM ops;		/* whole operations */
+	unsigned long polls;		/* status reads while waiting */
+	unsigned long slept_us;		/* time slept between them */
+	unsigned long skipped_reports;	/* all-zero reports not written */
+	unsigned long read_errors;
+	unsigned long write_errors;
+	unsigned long timeouts;
+	YK_HISTOGRAM lock_waits;	/* waits for the operation lock */
+	unsigned long lock_acquired;
+	unsigned long lock_contended;	/* times the lock was held by another thread */
+	YK_HISTOGRAM touch_waits;	/* from the key asking for a touch to
+					   its response */
+	YK_HISTOGRAM touch_latency;	/* from the last status read still
+					   waiting for a touch to the one
+					   seeing the response, the most a
+					   touch can have gone unnoticed */
+	unsigned long retries;		/* transfers tried again */
+	unsigned long recovered;	/* transfers that succeeded on a retry */
+	unsigned long reopens;		/* times the key was opened again */
+	unsigned long resyncs;		/* frames and challenges sent again */
+} YK_STATS;
+extern int yk_get_stats(YK_KEY *yk, YK_STATS *stats);
+extern int yk_reset_stats(YK_KEY *yk);
 /* Read the response to a command from the YubiKey */
 extern int yk_read_response_from_key(YK_KEY *yk, uint8_t slot, unsigned int flags,
 				     void *buf, unsigned int bufsize, unsigned int expect_bytes,
 				     unsigned int *bytes_read);
+/* The same, putting only the expect_bytes of the response in buf and
+   checking its CRC as it is read. With expect_bytes 0 the length comes
+   from the first byte of the response, which is then that byte and the
+   ones it counts. The number of bytes put in buf is returned in
+   *bytes_read. Fails with YK_EWRONGSIZ if they don't fit in bufsize and
+   with YK_ENODATA if the key ends the response early. */
+extern int yk_read_response(YK_KEY *yk, uint8_t slot, unsigned int flags,
+			    void *buf, unsigned int bufsize,
+			    unsigned int expect_bytes, unsigned int *bytes_read);
 
 /*************************************************************************
  *
@@ -129,10 +344,41 @@ extern int yk_write_device_config(YK_KEY *yk, YK_DEVICE_CONFIG *device_config);
 extern int yk_write_scan_map(YK_KEY *yk, unsigned char *scan_map);
 /* Write something to the YubiKey (a command that is). */
 extern int yk_write_to_key(YK_KEY *yk, uint8_t slot, const void *buf, int bufcount);
+
+/* Frame plans: a configuration, NDEF or device config write encoded into
+   feature reports ahead of time, for programming many keys from
+   configurations generated beforehand. yk_frame_plan_config() updates the
+   checksum of cfg like yk_write_command() does. A plan can be saved in at
+   most YK_FRAME_PLAN_MAX_SIZE bytes and loaded again, loading checks it.
+   yk_write_plan() writes a plan to a key like yk_write_command(). */
+#define YK_FRAME_PLAN_MAX_SIZE	83
+extern YK_FRAME_PLAN *yk_frame_plan_new(uint8_t command, const void *buf,
+					int bufcount);
+extern YK_FRAME_PLAN *yk_frame_plan_config(YK_CONFIG *cfg, uint8_t command,
+					   unsigned char *acc_code);
+extern YK_FRAME_PLAN *yk_frame_plan_ndef(YK_NDEF *ndef, int confnum);
+extern YK_FRAME_PLAN *yk_frame_plan_device_config(YK_DEVICE_CONFIG *device_config);
+extern void yk_frame_plan_free(YK_FRAME_PLAN *plan);
+extern int yk_frame_plan_save(const YK_FRAME_PLAN *plan, unsigned char *buf,
+			      size_t bufsize, size_t *len);
+extern YK_FRAME_PLAN *yk_frame_plan_load(const unsigned char *buf, size_t len);
+extern int yk_write_plan(YK_KEY *yk, const YK_FRAME_PLAN *plan);
 /* Do a challenge-response round with the key. */
 extern int yk_challenge_response(YK_KEY *yk, uint8_t yk_cmd, int may_block,
 				 unsigned int challenge_len, const unsigned char *challenge,
 				 unsigned int response_len, unsigned char *response);
+/* Do challenge-response for n challenges in a row, see ykcore.c. */
+typedef struct yk_batch_stats_st {
+	unsigned int done;		/* items that succeeded */
+	unsigned long elapsed_us;
+	double ops_per_sec;
+} YK_BATCH_STATS;
+extern int yk_challenge_response_batch(YK_KEY *yk, uint8_t yk_cmd, int may_block,
+				       unsigned int n, unsigned int challenge_len,
+				       const unsigned char *const challenges[],
+				       unsigned int response_len,
+				       unsigned char *const responses[],
+				       int *status, YK_BATCH_STATS *stats);
 
 extern int yk_force_key_update(YK_KEY *yk);
 /* Get the VID and PID of an opened device. */
@@ -141,6 +387,91 @@ extern int yk_get_key_vid_pid(YK_KEY *yk, int *vid, int *pid);
 int yk_get_capabilities(YK_KEY *yk, uint8_t slot, unsigned int flags,
 			unsigned char *capabilities, unsigned int *len);
 
+/*************************************************************************
+ *
+ * Non-blocking operations.
+ *
+ * These start the same protocol exchanges as yk_challenge_response(),
+ * yk_write_command() and yk_get_serial(), but return at once. The exchange
+ * is driven by asynchronous USB transfers from yk_handle_events(), which an
+ * event loop calls whenever one of the descriptors from yk_get_pollfds()
+ * is ready or the timeout from yk_get_next_timeout() has passed. Operations
+ * on the same key are queued and run one at a time, operations on different
+ * keys run concurrently. All of this must be driven from one thread.
+ *
+ * Only the libusb-1.0 and emulator backends support this, elsewhere
+ * operations fail with YK_ENOTYETIMPL.
+ *
+ ****/
+extern YK_OP *yk_op_challenge_response(YK_KEY *yk, uint8_t yk_cmd, int may_block,
+				       unsigned int challenge_len,
+				       const unsigned char *challenge);
+extern YK_OP *yk_op_write_command(YK_KEY *yk, YK_CONFIG *cfg, uint8_t command,
+				  unsigned char *acc_code);
+extern YK_OP *yk_op_get_serial(YK_KEY *yk, uint8_t slot, unsigned int flags);
+/* Called once when the operation has finished, from yk_handle_events(). */
+extern int yk_op_set_callback(YK_OP *op, void (*cb)(YK_OP *op, void *userdata),
+			      void *userdata);
+/* Make whatever progress is possible without blocking, returns YK_OP_*. */
+extern int yk_op_step(YK_OP *op);
+extern int yk_op_state(YK_OP *op);
+/* Fetch the response of a finished challenge-response or serial read. */
+extern int yk_op_get_response(YK_OP *op, unsigned char *buf,
+			      unsigned int bufsize, unsigned int *len);
+extern int yk_op_get_serial_result(YK_OP *op, unsigned int *serial);
+/* Free an operation, aborting it if it is still running. A running one
+   keeps the key, until yk_handle_events() has reset it, from the next
+   operation. */
+extern void yk_op_free(YK_OP *op);
+
+/* Event loop integration */
+extern int yk_get_pollfds(YK_POLLFD *fds, unsigned int max, unsigned int *count);
+/* Microseconds until yk_handle_events() has to be called at the latest,
+   -1 if nothing is pending. */
+extern int yk_get_next_timeout(long *timeout_us);
+extern int yk_handle_events(void);
+/* Handle events, blocking for up to timeout_us (-1 without limit) */
+extern int yk_wait_events(long timeout_us);
+
+/* The same, for operations on keys of a context of its own */
+extern int yk_context_get_pollfds(YK_CONTEXT *ctx, YK_POLLFD *fds,
+				  unsigned int max, unsigned int *count);
+extern int yk_context_get_next_timeout(YK_CONTEXT *ctx, long *timeout_us);
+extern int yk_context_handle_events(YK_CONTEXT *ctx);
+extern int yk_context_wait_events(YK_CONTEXT *ctx, long timeout_us);
+
+/*************************************************************************
+ *
+ * Hotplug registry.
+ *
+ * Keeps the set of attached keys up to date from hotplug notifications and
+ * calls back when a key arrives or leaves. Events are delivered from
+ * yk_handle_events() and yk_wait_events(); keys already attached are
+ * reported as arrived when registering. With YK_ENUM_DETAILS arriving keys
+ * are opened to read their firmware version and serial, removals report
+ * what was read on arrival.
+ *
+ * Only the libusb-1.0 backend supports this, and only on platforms where
+ * libusb has hotplug support.
+ *
+ ****/
+typedef void (*yk_hotplug_cb)(int event, const YK_DEVICE_INFO *info,
+			      void *userdata);
+extern int yk_hotplug_register(yk_hotplug_cb cb, void *userdata,
+			       unsigned int flags);
+extern int yk_hotplug_deregister(void);
+/* A copy of the currently attached keys, free with yk_free_device_list() */
+extern int yk_hotplug_get_devices(YK_DEVICE_INFO **list, size_t *count);
+
+/* The same, for a context of its own. Events are delivered from
+   yk_context_handle_events() and yk_context_wait_events(). */
+extern int yk_context_hotplug_register(YK_CONTEXT *ctx, yk_hotplug_cb cb,
+				       void *userdata, unsigned int flags);
+extern int yk_context_hotplug_deregister(YK_CONTEXT *ctx);
+extern int yk_context_hotplug_get_devices(YK_CONTEXT *ctx,
+					  YK_DEVICE_INFO **list,
+					  size_t *count);
+
 /*************************************************************************
  *
  * Error handling fuctions
@@ -153,11 +484,42 @@ const char *yk_strerror(int errnum);
    no other USB-related operations have been performed since the time of
    error.  */
 const char *yk_usb_strerror(void);
+/* The same, for errors on a context of its own or its keys */
+const char *yk_context_usb_strerror(YK_CONTEXT *ctx);
+
+/* Details of the last operation that failed in the calling thread. Kept
+   per thread along with yk_errno, so reading them allocates nothing. */
+typedef struct yk_error_info_st {
+	int error;		/* yk_errno the operation failed with */
+	const char *op;		/* what it was doing, like "status read" */
+	int usb_error;		/* backend error code with YK_EUSBERR: a libusb
+				   error, errno, IOReturn or GetLastError(),
+				   0 if unknown */
+	unsigned long elapsed_us;	/* time spent in the operation */
+} YK_ERROR_INFO;
+/* returns 0 if no operation failed yet, leaves yk_errno alone */
+extern int yk_get_error_info(YK_ERROR_INFO *info);
 
 
 /* Swaps the two bytes between little and big endian on big endian machines */
 extern uint16_t yk_endian_swap_16(uint16_t x);
 
+/* The CRC16 used in frames, configurations and responses, the same as
+   yubikey_crc16() of libyubikey. A buffer ending in the inverted CRC of
+   what comes before it gives YK_CRC_OK_RESIDUAL. yk_crc16_update()
+   continues a CRC started from 0xffff over more data. */
+extern uint16_t yk_crc16(const uint8_t *buf, size_t len);
+extern uint16_t yk_crc16_update(uint16_t crc, const uint8_t *buf, size_t len);
+/* Pick how CRCs are computed, by default the fastest the CPU allows.
+   YK_CRC16_PCLMUL fails with YK_ENOTYETIMPL where it is not available.
+   yk_crc16_get_impl() tells which one is in use. */
+#define YK_CRC16_AUTO		0
+#define YK_CRC16_BITWISE	1
+#define YK_CRC16_SLICE8		2
+#define YK_CRC16_PCLMUL		3
+extern int yk_crc16_set_impl(int impl);
+extern int yk_crc16_get_impl(void);
+
 #define YK_EUSBERR	0x01	/* USB error reporting should be used */
 #define YK_EWRONGSIZ	0x02
 #define YK_EWRITEERR	0x03
@@ -172,6 +534,8 @@ extern uint16_t yk_endian_swap_16(uint16_t x);
 #define YK_EINVALIDCMD	0x0c	/* supplied command is invalid for this operation */
 #define YK_EMORETHANONE	0x0d    /* expected to find only one key but found more */
 #define YK_ENODATA	0x0e	/* no data was returned from a read */
+#define YK_EINVAL	0x0f	/* invalid argument */
+#define YK_ECANCELED	0x10	/* operation canceled with yk_cancel() */
 
 /* Flags for response reading. Use high numbers to not exclude the possibility
  * to combine these with for example SLOT commands from ykdef.h in the future.
@@ -180,6 +544,26 @@ extern uint16_t yk_endian_swap_16(uint16_t x);
 
 #define YK_CRC_OK_RESIDUAL	0xf0b8
 
+/* States of a non-blocking operation */
+#define YK_OP_FAILED		0
+#define YK_OP_PENDING		1
+#define YK_OP_DONE		2
+
+/* Status polling policies for yk_set_poll_policy() */
+#define YK_POLL_LEGACY		0	/* 1 ms doubling up to 500 ms (default) */
+#define YK_POLL_FIXED		1	/* fixed interval, 0 to spin */
+#define YK_POLL_BACKOFF		2	/* microsecond exponential backoff */
+#define YK_POLL_DEADLINE	3	/* backoff against absolute wakeup times */
+#define YK_POLL_ADAPTIVE	4	/* first read from the timing profile,
+					   then as YK_POLL_DEADLINE */
+
+/* Flags for yk_enumerate() */
+#define YK_ENUM_DETAILS		0x01	/* read firmware version and serial */
+
+/* Hotplug events */
+#define YK_HOTPLUG_ARRIVED	1
+#define YK_HOTPLUG_LEFT		2
+
 # ifdef __cplusplus
 }
 # endif
@@ -36,19 +36,104 @@
 
 #define	REPORT_TYPE_FEATURE		0x03
 
-int _ykusb_start(void);
-int _ykusb_stop(void);
+/* A backend context holds whatever the backend needs to talk to the bus,
+   like a libusb context and its hotplug registration. Backends without
+   such state hand out NULL, and all functions taking a context accept
+   NULL for one never started. Devices remember their context. */
+int _ykusb_start(void **ctx);
+int _ykusb_stop(void *ctx);
 
-void * _ykusb_open_device(int vendor_id, int *product_ids, size_t pids_len, int index);
+void * _ykusb_open_device(void *ctx, int vendor_id, int *product_ids,
+			  size_t pids_len, int index);
 int _ykusb_close_device(void *);
 
+/* Walk the bus once, calling cb for every matching device with a backend
+   specific location string. The entry can be opened with
+   _ykusb_open_entry() from within the callback only. A zero return from
+   cb stops the walk. */
+typedef int (*_ykusb_enum_cb)(void *userdata, void *entry, const char *path,
+			      int vendor_id, int product_id);
+
+int _ykusb_enumerate(void *ctx, int vendor_id, int *product_ids,
+		     size_t pids_len, _ykusb_enum_cb cb, void *userdata);
+void * _ykusb_open_entry(void *ctx, void *entry);
+void * _ykusb_open_path(void *ctx, int vendor_id, int *product_ids,
+			size_t pids_len, const char *path);
+
+/* Transfer one report, giving up after timeout_ms where the backend can
+   limit the time of a transfer. */
 int _ykusb_read(void *dev, int report_type, int report_number,
-		char *buffer, int buffer_size);
+		char *buffer, int buffer_size,
+		unsigned int timeout_ms);
 int _ykusb_write(void *dev, int report_type, int report_number,
-		 char *buffer, int buffer_size);
+		 char *buffer, int buffer_size,
+		 unsigned int timeout_ms);
 
 int _ykusb_get_vid_pid(void *dev, int *vid, int *pid);
+/* Where an opened device is, as _ykusb_enumerate() gives it. Backends
+   that can't tell fail, without setting yk_errno. */
+int _ykusb_get_path(void *dev, char *path, size_t len);
+
+/* Keep the device claimed between _ykusb_begin_session() and
+   _ykusb_end_session() instead of claiming it for every report.
+   Backends that never claim anything just succeed. */
+int _ykusb_begin_session(void *dev);
+int _ykusb_end_session(void *dev);
+int _ykusb_get_claim_counts(void *dev, unsigned long *claims,
+			    unsigned long *releases);
+
+/* Asynchronous reports. The callback is called from _ykusb_handle_events()
+   with the number of bytes transferred, or 0 on error with yk_errno set. */
+typedef void (*_ykusb_transfer_cb)(void *userdata, int result);
+
+int _ykusb_submit_read(void *dev, int report_type, int report_number,
+		       char *buffer, int buffer_size,
+		       unsigned int timeout_ms,
+		       _ykusb_transfer_cb cb, void *userdata);
+int _ykusb_submit_write(void *dev, int report_type, int report_number,
+			char *buffer, int buffer_size,
+			unsigned int timeout_ms,
+			_ykusb_transfer_cb cb, void *userdata);
+/* Cancel the transfers in flight on the device. Their callbacks are still
+   called, from _ykusb_handle_events(), with an error. */
+int _ykusb_cancel_transfers(void *dev);
+int _ykusb_get_pollfds(void *ctx, YK_POLLFD *fds, unsigned int max,
+		       unsigned int *count);
+int _ykusb_get_next_timeout(void *ctx, long *timeout_us);
+/* Handle pending events, waiting up to timeout_us for one to arrive. */
+int _ykusb_handle_events(void *ctx, long timeout_us);
+
+/* Hotplug notifications, delivered from _ykusb_handle_events(). Devices
+   already attached are reported as arrived when registering. The entry
+   holds a reference until _ykusb_unref_entry() and can be opened with
+   _ykusb_open_entry() meanwhile. */
+#define YKUSB_HOTPLUG_ARRIVED	1
+#define YKUSB_HOTPLUG_LEFT	2
+typedef void (*_ykusb_hotplug_cb)(void *userdata, int event, void *entry,
+				  const char *path, int vendor_id,
+				  int product_id);
+
+int _ykusb_hotplug_register(void *ctx, int vendor_id, int *product_ids,
+			    size_t pids_len, _ykusb_hotplug_cb cb,
+			    void *userdata);
+int _ykusb_hotplug_deregister(void *ctx);
+void _ykusb_unref_entry(void *entry);
+
+/* The backend's own code for the last error of this thread (a libusb
+   error, errno, IOReturn or GetLastError()), 0 if there is none to give.
+   Threads share contexts, so it is never kept in one. */
+int _ykusb_get_error(void *ctx);
+const char *_ykusb_strerror(void *ctx);
+/* Where backends keep that code, per thread like yk_errno, see
+   ykcore.c */
+int * _yk_backend_errno_location(void);
 
-const char *_ykusb_strerror(void);
+/* What that error says about the device: a transfer worth trying again
+   (a stall, an I/O error, a busy device), a device gone from the bus, or
+   neither. Backends that can't tell say neither. */
+#define YKUSB_ERROR_OTHER	0
+#define YKUSB_ERROR_TRANSIENT	1
+#define YKUSB_ERROR_GONE	2
+int _ykusb_error_class(void *ctx);
 
 #endif	/* __YKCORE_BACKEND_H_INCLUDED__ */
@@ -0,0 +1,1014 @@
+/* -*- mode:C; c-file-style: "bsd" -*- */
+/*
+ * Copyright (c) 2017 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A software YubiKey behind the backend interface, for testing and
+ * benchmarking without hardware. It speaks the feature report protocol:
+ * frames written as numbered reports with SLOT_WRITE_FLAG, status reports
+ * with pgmSeq and the slot valid bits, and responses read back with
+ * RESP_PENDING_FLAG. Both configuration slots, the serial number,
+ * HMAC-SHA1 and Yubico OTP challenge-response are emulated, the latter
+ * two waiting for a touch if the slot has CHAL_BTN_TRIG.
+ *
+ * The keys are set up from the environment when the backend starts:
+ *
+ *   YK_EMULATOR_KEYS        number of keys (default 1)
+ *   YK_EMULATOR_SERIAL      serial of the first key, the others follow
+ *   YK_EMULATOR_VERSION     firmware version, e.g. "4.3.4"
+ *   YK_EMULATOR_LATENCY_US  time every report transfer takes
+ *   YK_EMULATOR_PROCESS_US  time the key is busy after a complete frame
+ *   YK_EMULATOR_TOUCH_US    time until a touch is emulated (default 100 ms)
+ *
+ * Keys keep their state until the process exits.
+ *
+ * YK_EMULATOR_FAULTS makes the next report transfers, of any key, fail:
+ * it is a comma separated list of "pipe", "io" and "busy", for transfers
+ * that fail without reaching the key, "gone" for a key that
+ * re-enumerates, failing the transfer and every later one on the handle
+ * until the key is opened again, "drop" for a write that seems to work
+ * but never reaches the key, and "ok" for a transfer that works. It is
+ * looked at on every transfer, and the list starts over whenever it
+ * changes.
+ *
+ * Asynchronous transfers are queued on the context of the key and carried
+ * out, in the order they were submitted, when it handles events; a pipe
+ * that is readable while any are queued stands in for the USB descriptors.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <yubikey.h>
+
+#include "ykcore_lcl.h"
+#include "yktime.h"
+#include "sha.h"
+
+#define YKEM_MAX_KEYS		128
+#define YKEM_FRAME_SIZE		((int)sizeof(YK_FRAME))
+#define YKEM_PAYLOAD		(FEATURE_RPT_SIZE - 1)
+
+struct ykem_key_st {
+	pthread_mutex_t lock;
+	int index;
+	int open;
+	unsigned int gen;	/* bumped when the key re-enumerates */
+	unsigned int serial;
+	YK_STATUS status;
+	int product_id;
+
+	YK_CONFIG slots[2];
+	int valid[2];
+	unsigned short use_ctr;
+	unsigned char session_ctr;
+
+	/* Frame being written */
+	unsigned char frame[sizeof(YK_FRAME)];
+
+	/* Busy processing a frame until this time */
+	uint64_t busy_until;
+
+	/* Response being read */
+	int responding;
+	unsigned char response[SHA1_DIGEST_SIZE + 2 + YKEM_PAYLOAD];
+	unsigned int response_len;
+	unsigned int response_seq;
+	uint64_t touch_at;	/* waiting for a touch until then */
+};
+
+/* A backend context, with the asynchronous transfers on its keys */
+struct ykem_ctx_st {
+	pthread_mutex_t lock;
+	struct ykem_transfer_st *transfers;	/* in the order submitted */
+	int wake[2];		/* readable while transfers are queued */
+};
+
+/* An open key, usable until the key re-enumerates. Claims are counted as
+   the libusb backends make them: one per report, unless a session holds
+   one. */
+struct ykem_handle_st {
+	struct ykem_key_st *k;
+	unsigned int gen;
+	struct ykem_ctx_st *ctx;
+	unsigned int session_depth;
+	unsigned long claims;
+	unsigned long releases;
+};
+
+struct ykem_transfer_st {
+	struct ykem_handle_st *h;	/* NULL once the key is closed */
+	int write;
+	int report_type;
+	int report_number;
+	char *buffer;
+	int size;
+	int canceled;
+	_ykusb_transfer_cb cb;
+	void *userdata;
+	struct ykem_transfer_st *next;
+};
+
+static pthread_once_t ykem_once = PTHREAD_ONCE_INIT;
+static struct ykem_key_st *ykem_keys;
+static int ykem_nkeys;
+static unsigned long ykem_latency_us;
+static unsigned long ykem_process_us;
+static unsigned long ykem_touch_us;
+
+/* Faults to inject, see YK_EMULATOR_FAULTS */
+#define YKEM_MAX_FAULTS		32
+#define YKEM_DROP		(-1)	/* a write the key never sees */
+static pthread_mutex_t ykem_fault_lock = PTHREAD_MUTEX_INITIALIZER;
+static char ykem_fault_spec[256];
+static int ykem_faults[YKEM_MAX_FAULTS];
+static int ykem_nfaults;
+static int ykem_next_fault;
+
+/* errno of the last transfer, per thread */
+#define ykem_error (*_yk_backend_errno_location())
+
+static unsigned long _ykem_env(const char *name, unsigned long def)
+{
+	const char *v = getenv(name);
+
+	return v && *v ? strtoul(v, NULL, 0) : def;
+}
+
+static void _ykem_setup(void)
+{
+	unsigned int major = 4, minor = 3, build = 4;
+	unsigned long serial;
+	const char *v;
+	int i;
+
+	ykem_nkeys = _ykem_env("YK_EMULATOR_KEYS", 1);
+	if (ykem_nkeys > YKEM_MAX_KEYS)
+		ykem_nkeys = YKEM_MAX_KEYS;
+	serial = _ykem_env("YK_EMULATOR_SERIAL", 1000000);
+	ykem_latency_us = _ykem_env("YK_EMULATOR_LATENCY_US", 0);
+	ykem_process_us = _ykem_env("YK_EMULATOR_PROCESS_US", 0);
+	ykem_touch_us = _ykem_env("YK_EMULATOR_TOUCH_US", 100000);
+	if ((v = getenv("YK_EMULATOR_VERSION")))
+		sscanf(v, "%u.%u.%u", &major, &minor, &build);
+
+	ykem_keys = calloc(ykem_nkeys ? ykem_nkeys : 1, sizeof(*ykem_keys));
+	if (!ykem_keys) {
+		ykem_nkeys = 0;
+		return;
+	}
+	for (i = 0; i < ykem_nkeys; i++) {
+		struct ykem_key_st *k = &ykem_keys[i];
+
+		pthread_mutex_init(&k->lock, NULL);
+		k->index = i;
+		k->serial = serial + i;
+		k->status.versionMajor = major;
+		k->status.versionMinor = minor;
+		k->status.versionBuild = build;
+		if (major < 3)
+			k->product_id = YUBIKEY_PID;
+		else if (major == 3)
+			k->product_id = NEO_OTP_PID;
+		else
+			k->product_id = YK4_OTP_U2F_CCID_PID;
+	}
+}
+
+int _ykusb_start(void **ctx)
+{
+	struct ykem_ctx_st *c;
+
+	pthread_once(&ykem_once, _ykem_setup);
+	if (!(c = calloc(1, sizeof(*c)))) {
+		yk_errno = YK_ENOMEM;
+		return 0;
+	}
+	if (pipe(c->wake) != 0) {
+		ykem_error = errno;
+		free(c);
+		yk_errno = YK_EUSBERR;
+		return 0;
+	}
+	fcntl(c->wake[0], F_SETFL, O_NONBLOCK);
+	pthread_mutex_init(&c->lock, NULL);
+	*ctx = c;
+	return 1;
+}
+
+int _ykusb_stop(void *ctx)
+{
+	struct ykem_ctx_st *c = ctx;
+	struct ykem_transfer_st *t;
+
+	while ((t = c->transfers)) {
+		c->transfers = t->next;
+		free(t);
+	}
+	close(c->wake[0]);
+	close(c->wake[1]);
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+	return 1;
+}
+
+static int _ykem_matches(struct ykem_key_st *k, int vendor_id,
+			 int *product_ids, size_t pids_len)
+{
+	size_t j;
+
+	if (vendor_id != YUBICO_VID)
+		return 0;
+	for (j = 0; j < pids_len; j++)
+		if (product_ids[j] == k->product_id)
+			return 1;
+	return 0;
+}
+
+static void *_ykem_open(void *ctx, struct ykem_key_st *k)
+{
+	struct ykem_handle_st *h = malloc(sizeof(*h));
+
+	if (!h) {
+		yk_errno = YK_ENOMEM;
+		return NULL;
+	}
+	pthread_mutex_lock(&k->lock);
+	if (k->open) {
+		pthread_mutex_unlock(&k->lock);
+		free(h);
+		yk_errno = YK_EUSBERR;
+		return NULL;
+	}
+	k->open = 1;
+	h->k = k;
+	h->gen = k->gen;
+	h->ctx = ctx;
+	h->session_depth = 0;
+	h->claims = 0;
+	h->releases = 0;
+	pthread_mutex_unlock(&k->lock);
+	return h;
+}
+
+static void _ykem_path(struct ykem_key_st *k, char *path, size_t len)
+{
+	snprintf(path, len, "emulator:%d", k->index);
+}
+
+void *_ykusb_open_device(void *ctx, int vendor_id, int *product_ids,
+			 size_t pids_len, int index)
+{
+	int i, found = 0;
+
+	for (i = 0; i < ykem_nkeys; i++) {
+		if (_ykem_matches(&ykem_keys[i], vendor_id, product_ids, pids_len)
+		    && found++ == index)
+			return _ykem_open(ctx, &ykem_keys[i]);
+	}
+	yk_errno = YK_ENOKEY;
+	return NULL;
+}
+
+int _ykusb_enumerate(void *ctx, int vendor_id, int *product_ids,
+		     size_t pids_len, _ykusb_enum_cb cb, void *userdata)
+{
+	char path[YK_DEVICE_PATH_SIZE];
+	int i;
+
+	for (i = 0; i < ykem_nkeys; i++) {
+		struct ykem_key_st *k = &ykem_keys[i];
+
+		if (!_ykem_matches(k, vendor_id, product_ids, pids_len))
+			continue;
+		_ykem_path(k, path, sizeof(path));
+		if (!cb(userdata, k, path, vendor_id, k->product_id))
+			break;
+	}
+	return 1;
+}
+
+void *_ykusb_open_entry(void *ctx, void *entry)
+{
+	return _ykem_open(ctx, entry);
+}
+
+void *_ykusb_open_path(void *ctx, int vendor_id, int *product_ids,
+		       size_t pids_len, const char *path)
+{
+	char p[YK_DEVICE_PATH_SIZE];
+	int i;
+
+	for (i = 0; i < ykem_nkeys; i++) {
+		_ykem_path(&ykem_keys[i], p, sizeof(p));
+		if (strcmp(p, path) == 0 &&
+		    _ykem_matches(&ykem_keys[i], vendor_id, product_ids, pids_len))
+			return _ykem_open(ctx, &ykem_keys[i]);
+	}
+	yk_errno = YK_ENOKEY;
+	return NULL;
+}
+
+int _ykusb_close_device(void *yk)
+{
+	struct ykem_handle_st *h = yk;
+	struct ykem_key_st *k = h->k;
+	struct ykem_transfer_st *t;
+
+	/* Transfers still queued complete as canceled */
+	pthread_mutex_lock(&h->ctx->lock);
+	for (t = h->ctx->transfers; t; t = t->next)
+		if (t->h == h)
+			t->h = NULL;
+	pthread_mutex_unlock(&h->ctx->lock);
+
+	pthread_mutex_lock(&k->lock);
+	if (h->gen == k->gen) {
+		k->open = 0;
+		k->responding = 0;
+	}
+	pthread_mutex_unlock(&k->lock);
+	if (h->session_depth > 0)
+		h->releases++;
+	free(h);
+	return 1;
+}
+
+static void _ykem_parse_faults(const char *spec)
+{
+	static const struct {
+		const char *name;
+		int err;
+	} kinds[] = {
+		{"ok", 0}, {"pipe", EPIPE}, {"io", EIO}, {"busy", EBUSY},
+		{"gone", ENODEV}, {"drop", YKEM_DROP},
+	};
+	const char *p = spec;
+	size_t i, len;
+
+	strncpy(ykem_fault_spec, spec, sizeof(ykem_fault_spec) - 1);
+	ykem_nfaults = 0;
+	ykem_next_fault = 0;
+	while (*p && ykem_nfaults < YKEM_MAX_FAULTS) {
+		len = strcspn(p, ",");
+		for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+			if (strlen(kinds[i].name) == len &&
+			    strncmp(p, kinds[i].name, len) == 0)
+				ykem_faults[ykem_nfaults++] = kinds[i].err;
+		}
+		p += len;
+		if (*p == ',')
+			p++;
+	}
+}
+
+/* Whether a transfer on the handle goes through, or the errno it fails
+   with, from YK_EMULATOR_FAULTS or the key having re-enumerated. A write
+   to drop gives YKEM_DROP, a read to drop just goes through. */
+static int _ykem_transfer_error(struct ykem_handle_st *h, int write)
+{
+	struct ykem_key_st *k = h->k;
+	const char *v;
+	int err = 0;
+
+	pthread_mutex_lock(&ykem_fault_lock);
+	v = getenv("YK_EMULATOR_FAULTS");
+	if (strcmp(v ? v : "", ykem_fault_spec) != 0)
+		_ykem_parse_faults(v ? v : "");
+	if (ykem_next_fault < ykem_nfaults)
+		err = ykem_faults[ykem_next_fault++];
+
+	pthread_mutex_lock(&k->lock);
+	if (err == ENODEV && h->gen == k->gen) {
+		/* Gone from the bus and back, as if just plugged in */
+		k->gen++;
+		k->open = 0;
+		k->responding = 0;
+		k->busy_until = 0;
+		memset(k->frame, 0, sizeof(k->frame));
+	}
+	if (h->gen != k->gen)
+		err = ENODEV;
+	pthread_mutex_unlock(&k->lock);
+	pthread_mutex_unlock(&ykem_fault_lock);
+
+	if (err == YKEM_DROP)
+		err = write ? YKEM_DROP : 0;
+	ykem_error = err > 0 ? err : 0;
+	if (err > 0)
+		yk_errno = YK_EUSBERR;
+	return err;
+}
+
+/* Set up a response with a CRC the host can check */
+static void _ykem_respond(struct ykem_key_st *k, const unsigned char *data,
+			  unsigned int len, int crc)
+{
+	memset(k->response, 0, sizeof(k->response));
+	memcpy(k->response, data, len);
+	if (crc) {
+		uint16_t c = ~yk_crc16(k->response, len);
+
+		k->response[len] = c & 0xff;
+		k->response[len + 1] = c >> 8;
+		len += 2;
+	}
+	k->response_len = len;
+	k->response_seq = 0;
+	k->responding = 1;
+}
+
+/* A slot changed, update the status the host sees */
+static void _ykem_slots_changed(struct ykem_key_st *k)
+{
+	k->status.touchLevel &= ~(CONFIG1_VALID | CONFIG2_VALID);
+	if (k->valid[0])
+		k->status.touchLevel |= CONFIG1_VALID;
+	if (k->valid[1])
+		k->status.touchLevel |= CONFIG2_VALID;
+
+	if (!k->valid[0] && !k->valid[1])
+		k->status.pgmSeq = 0;
+	else if (++k->status.pgmSeq == 0)
+		k->status.pgmSeq = 1;
+}
+
+/* The access code after the configuration must match the one of the slot */
+static int _ykem_access(struct ykem_key_st *k, int slot,
+			const unsigned char *payload)
+{
+	static const unsigned char none[ACC_CODE_SIZE];
+	const unsigned char *cur = k->slots[slot].accCode;
+
+	if (!k->valid[slot] || memcmp(cur, none, ACC_CODE_SIZE) == 0)
+		return 1;
+	return memcmp(cur, payload + sizeof(YK_CONFIG), ACC_CODE_SIZE) == 0;
+}
+
+static int _ykem_config(struct ykem_key_st *k, int slot,
+			const unsigned char *payload)
+{
+	static const YK_CONFIG zero;
+	YK_CONFIG cfg;
+
+	if (!_ykem_access(k, slot, payload))
+		return 0;
+	memcpy(&cfg, payload, sizeof(cfg));
+
+	/* An all zero configuration erases the slot */
+	if (memcmp(&cfg, &zero, sizeof(cfg)) == 0) {
+		k->valid[slot] = 0;
+	} else {
+		if (yk_crc16((const uint8_t *)&cfg, sizeof(cfg)) !=
+		    YK_CRC_OK_RESIDUAL)
+			return 0;
+		k->valid[slot] = 1;
+	}
+	k->slots[slot] = cfg;
+	return 1;
+}
+
+static int _ykem_update(struct ykem_key_st *k, int slot,
+			const unsigned char *payload)
+{
+	YK_CONFIG cfg, *cur = &k->slots[slot];
+
+	if (!k->valid[slot] || !(cur->extFlags & EXTFLAG_ALLOW_UPDATE) ||
+	    !_ykem_access(k, slot, payload))
+		return 0;
+	memcpy(&cfg, payload, sizeof(cfg));
+	cur->tktFlags = (cur->tktFlags & ~TKTFLAG_UPDATE_MASK) |
+		(cfg.tktFlags & TKTFLAG_UPDATE_MASK);
+	cur->cfgFlags = (cur->cfgFlags & ~CFGFLAG_UPDATE_MASK) |
+		(cfg.cfgFlags & CFGFLAG_UPDATE_MASK);
+	cur->extFlags = (cur->extFlags & ~EXTFLAG_UPDATE_MASK) |
+		(cfg.extFlags & EXTFLAG_UPDATE_MASK);
+	memcpy(cur->accCode, cfg.accCode, ACC_CODE_SIZE);
+	return 1;
+}
+
+static int _ykem_chal_enabled(struct ykem_key_st *k, int slot, int hmac)
+{
+	YK_CONFIG *cfg = &k->slots[slot];
+
+	if (!k->valid[slot] || !(cfg->tktFlags & TKTFLAG_CHAL_RESP))
+		return 0;
+	if (hmac)
+		return (cfg->cfgFlags & CFGFLAG_CHAL_HMAC) == CFGFLAG_CHAL_HMAC;
+	return (cfg->cfgFlags & CFGFLAG_CHAL_HMAC) == CFGFLAG_CHAL_YUBICO;
+}
+
+/* A challenge to a slot with CHAL_BTN_TRIG is answered after a touch */
+static void _ykem_wait_touch(struct ykem_key_st *k, int slot)
+{
+	if (k->slots[slot].cfgFlags & CFGFLAG_CHAL_BTN_TRIG)
+		k->touch_at = yk__now_us() + ykem_process_us + ykem_touch_us;
+	else
+		k->touch_at = 0;
+}
+
+static void _ykem_chal_hmac(struct ykem_key_st *k, int slot,
+			    const unsigned char *challenge)
+{
+	YK_CONFIG *cfg = &k->slots[slot];
+	unsigned char key[KEY_SIZE_OATH];
+	uint8_t digest[USHAMaxHashSize];
+	int len = SHA1_MAX_BLOCK_SIZE;
+
+	/* With HMAC_LT64, trailing bytes equal to the last one are padding */
+	if (cfg->cfgFlags & CFGFLAG_HMAC_LT64) {
+		unsigned char pad = challenge[len - 1];
+
+		while (len > 0 && challenge[len - 1] == pad)
+			len--;
+	}
+
+	memcpy(key, cfg->key, KEY_SIZE);
+	memcpy(key + KEY_SIZE, cfg->uid, KEY_SIZE_OATH - KEY_SIZE);
+	hmac(SHA1, challenge, len, key, sizeof(key), digest);
+	_ykem_respond(k, digest, SHA1_DIGEST_SIZE, 1);
+}
+
+static void _ykem_chal_otp(struct ykem_key_st *k, int slot,
+			   const unsigned char *challenge)
+{
+	YK_CONFIG *cfg = &k->slots[slot];
+	uint64_t t = yk__now_us() / 125000;	/* 8 Hz */
+	unsigned char tkt[16];
+	uint16_t crc;
+
+	/* The challenge takes the place of the private UID */
+	memcpy(tkt, challenge, UID_SIZE);
+	tkt[6] = k->use_ctr & 0xff;
+	tkt[7] = k->use_ctr >> 8;
+	tkt[8] = t & 0xff;
+	tkt[9] = (t >> 8) & 0xff;
+	tkt[10] = (t >> 16) & 0xff;
+	tkt[11] = k->session_ctr++;
+	tkt[12] = rand() & 0xff;
+	tkt[13] = rand() & 0xff;
+	crc = ~yk_crc16(tkt, 14);
+	tkt[14] = crc & 0xff;
+	tkt[15] = crc >> 8;
+	yubikey_aes_encrypt(tkt, cfg->key);
+	_ykem_respond(k, tkt, sizeof(tkt), 1);
+}
+
+/* A complete frame was written, act on it */
+static void _ykem_frame(struct ykem_key_st *k)
+{
+	const unsigned char *payload = k->frame;
+	unsigned char slot = k->frame[SLOT_DATA_SIZE];
+	unsigned char buf[SERIAL_NUMBER_SIZE];
+	int changed = 0, tmp_valid;
+	YK_CONFIG tmp;
+
+	/* The frame CRC is little endian on the wire */
+	if (yk_crc16(payload, SLOT_DATA_SIZE) !=
+	    (k->frame[SLOT_DATA_SIZE + 1] | (k->frame[SLOT_DATA_SIZE + 2] << 8)))
+		return;
+
+	switch (slot) {
+	case SLOT_CONFIG:
+	case SLOT_CONFIG2:
+		changed = _ykem_config(k, slot == SLOT_CONFIG ? 0 : 1,
+					    payload);
+		break;
+	case SLOT_UPDATE1:
+	case SLOT_UPDATE2:
+		changed = _ykem_update(k, slot == SLOT_UPDATE1 ? 0 : 1,
+					    payload);
+		break;
+	case SLOT_SWAP:
+		tmp = k->slots[0];
+		k->slots[0] = k->slots[1];
+		k->slots[1] = tmp;
+		tmp_valid = k->valid[0];
+		k->valid[0] = k->valid[1];
+		k->valid[1] = tmp_valid;
+		changed = 1;
+		break;
+	case SLOT_NDEF:
+	case SLOT_NDEF2:
+	case SLOT_DEVICE_CONFIG:
+	case SLOT_SCAN_MAP:
+		/* Accepted, but nothing observable changes */
+		changed = 1;
+		break;
+	case SLOT_DEVICE_SERIAL:
+		buf[0] = k->serial >> 24;
+		buf[1] = k->serial >> 16;
+		buf[2] = k->serial >> 8;
+		buf[3] = k->serial;
+		_ykem_respond(k, buf, sizeof(buf), 1);
+		break;
+	case SLOT_YK4_CAPABILITIES:
+		if (k->status.versionMajor >= 4) {
+			/* Length, then USB applications supported and
+			   enabled and the serial */
+			unsigned char capa[] = {
+				14, 0x01, 2, 0x02, 0x3f, 0x03, 2, 0x02, 0x3f,
+				0x02, 4, 0, 0, 0, 0
+			};
+
+			capa[11] = k->serial >> 24;
+			capa[12] = k->serial >> 16;
+			capa[13] = k->serial >> 8;
+			capa[14] = k->serial;
+			_ykem_respond(k, capa, sizeof(capa), 1);
+		}
+		break;
+	case SLOT_CHAL_HMAC1:
+	case SLOT_CHAL_HMAC2:
+		if (_ykem_chal_enabled(k, slot == SLOT_CHAL_HMAC1 ? 0 : 1, 1)) {
+			_ykem_chal_hmac(k, slot == SLOT_CHAL_HMAC1 ? 0 : 1,
+					payload);
+			_ykem_wait_touch(k, slot == SLOT_CHAL_HMAC1 ? 0 : 1);
+		}
+		break;
+	case SLOT_CHAL_OTP1:
+	case SLOT_CHAL_OTP2:
+		if (_ykem_chal_enabled(k, slot == SLOT_CHAL_OTP1 ? 0 : 1, 0)) {
+			_ykem_chal_otp(k, slot == SLOT_CHAL_OTP1 ? 0 : 1,
+				       payload);
+			_ykem_wait_touch(k, slot == SLOT_CHAL_OTP1 ? 0 : 1);
+		}
+		break;
+	default:
+		/* Unknown commands are ignored, as by a real key */
+		break;
+	}
+
+	if (changed)
+		_ykem_slots_changed(k);
+	k->busy_until = yk__now_us() + ykem_process_us;
+}
+
+/* A report on its own claims the key and releases it again */
+static void _ykem_claim(struct ykem_handle_st *h)
+{
+	if (h->session_depth == 0) {
+		h->claims++;
+		h->releases++;
+	}
+}
+
+int _ykusb_read(void *dev, int report_type, int report_number,
+		char *buffer, int size,
+		unsigned int timeout_ms)
+{
+	struct ykem_handle_st *h = dev;
+	struct ykem_key_st *k = h->k;
+	unsigned char data[FEATURE_RPT_SIZE];
+	int busy, touch;
+
+	if (report_type != REPORT_TYPE_FEATURE || size != FEATURE_RPT_SIZE) {
+		yk_errno = YK_EUSBERR;
+		return 0;
+	}
+	_ykem_claim(h);
+	if (ykem_latency_us)
+		yk__usleep(ykem_latency_us);
+	if (_ykem_transfer_error(h, 0))
+		return 0;
+
+	memset(data, 0, sizeof(data));
+	pthread_mutex_lock(&k->lock);
+	busy = yk__now_us() < k->busy_until;
+	touch = k->responding && yk__now_us() < k->touch_at;
+	if (k->responding && !busy && !touch) {
+		unsigned int off = k->response_seq * YKEM_PAYLOAD;
+
+		/* A report with sequence 0 after the data ends the response */
+		if (off < k->response_len) {
+			memcpy(data, k->response + off, YKEM_PAYLOAD);
+			data[FEATURE_RPT_SIZE - 1] = RESP_PENDING_FLAG |
+				(k->response_seq++ & RESP_TIMEOUT_WAIT_MASK);
+		} else {
+			data[FEATURE_RPT_SIZE - 1] = RESP_PENDING_FLAG;
+		}
+	} else {
+		memcpy(data + 1, &k->status, sizeof(k->status));
+		data[1 + 4] = k->status.touchLevel & 0xff;
+		data[1 + 5] = k->status.touchLevel >> 8;
+		if (busy)
+			data[FEATURE_RPT_SIZE - 1] = SLOT_WRITE_FLAG;
+		else if (touch)	/* 15 s left, the touch always comes first */
+			data[FEATURE_RPT_SIZE - 1] = RESP_TIMEOUT_WAIT_FLAG | 15;
+	}
+	pthread_mutex_unlock(&k->lock);
+
+	memcpy(buffer, data, FEATURE_RPT_SIZE);
+	return FEATURE_RPT_SIZE;
+}
+
+int _ykusb_write(void *dev, int report_type, int report_number,
+		 char *buffer, int size,
+		 unsigned int timeout_ms)
+{
+	struct ykem_handle_st *h = dev;
+	struct ykem_key_st *k = h->k;
+	unsigned char *data = (unsigned char *)buffer;
+	unsigned char seq;
+	int err;
+
+	if (report_type != REPORT_TYPE_FEATURE || size != FEATURE_RPT_SIZE) {
+		yk_errno = YK_EUSBERR;
+		return 0;
+	}
+	_ykem_claim(h);
+	if (ykem_latency_us)
+		yk__usleep(ykem_latency_us);
+	err = _ykem_transfer_error(h, 1);
+	if (err == YKEM_DROP)
+		return 1;
+	if (err)
+		return 0;
+
+	pthread_mutex_lock(&k->lock);
+	seq = data[FEATURE_RPT_SIZE - 1];
+	if (seq == DUMMY_REPORT_WRITE) {
+		k->responding = 0;
+	} else if (seq & SLOT_WRITE_FLAG) {
+		int off;
+
+		seq &= ~SLOT_WRITE_FLAG;
+		off = seq * YKEM_PAYLOAD;
+		if (seq == 0) {
+			memset(k->frame, 0, sizeof(k->frame));
+			k->responding = 0;
+		}
+		if (off + YKEM_PAYLOAD <= YKEM_FRAME_SIZE) {
+			memcpy(k->frame + off, data, YKEM_PAYLOAD);
+			if (off + YKEM_PAYLOAD == YKEM_FRAME_SIZE)
+				_ykem_frame(k);
+		}
+	}
+	pthread_mutex_unlock(&k->lock);
+	return 1;
+}
+
+int _ykusb_get_vid_pid(void *yk, int *vid, int *pid)
+{
+	struct ykem_key_st *k = ((struct ykem_handle_st *)yk)->k;
+
+	*vid = YUBICO_VID;
+	*pid = k->product_id;
+	return 1;
+}
+
+int _ykusb_get_path(void *dev, char *path, size_t len)
+{
+	_ykem_path(((struct ykem_handle_st *)dev)->k, path, len);
+	return 1;
+}
+
+int _ykusb_begin_session(void *dev)
+{
+	struct ykem_handle_st *h = dev;
+
+	if (h->session_depth++ == 0)
+		h->claims++;
+	return 1;
+}
+
+int _ykusb_end_session(void *dev)
+{
+	struct ykem_handle_st *h = dev;
+
+	if (h->session_depth == 0) {
+		yk_errno = YK_EINVALIDCMD;
+		return 0;
+	}
+	if (--h->session_depth == 0)
+		h->releases++;
+	return 1;
+}
+
+int _ykusb_get_claim_counts(void *dev, unsigned long *claims,
+			    unsigned long *releases)
+{
+	struct ykem_handle_st *h = dev;
+
+	*claims = h->claims;
+	*releases = h->releases;
+	return 1;
+}
+
+static int _ykem_submit(struct ykem_handle_st *h, int writing,
+			int report_type, int report_number,
+			char *buffer, int size,
+			_ykusb_transfer_cb cb, void *userdata)
+{
+	struct ykem_ctx_st *c = h->ctx;
+	struct ykem_transfer_st *t, **p;
+
+	if (!(t = calloc(1, sizeof(*t)))) {
+		yk_errno = YK_ENOMEM;
+		return 0;
+	}
+	t->h = h;
+	t->write = writing;
+	t->report_type = report_type;
+	t->report_number = report_number;
+	t->buffer = buffer;
+	t->size = size;
+	t->cb = cb;
+	t->userdata = userdata;
+
+	pthread_mutex_lock(&c->lock);
+	if (!c->transfers && write(c->wake[1], "", 1) != 1) {
+		pthread_mutex_unlock(&c->lock);
+		ykem_error = errno;
+		free(t);
+		yk_errno = YK_EUSBERR;
+		return 0;
+	}
+	for (p = &c->transfers; *p; p = &(*p)->next)
+		;
+	*p = t;
+	pthread_mutex_unlock(&c->lock);
+	return 1;
+}
+
+/* Carry out a queued transfer and call its callback. The time limit is
+   not emulated, a transfer takes YK_EMULATOR_LATENCY_US. */
+static void _ykem_complete(struct ykem_transfer_st *t)
+{
+	int result = 0;
+
+	if (t->canceled || !t->h) {
+		ykem_error = ECANCELED;
+		yk_errno = YK_EUSBERR;
+	} else if (t->write) {
+		if (_ykusb_write(t->h, t->report_type, t->report_number,
+				 t->buffer, t->size, 0))
+			result = t->size;
+	} else {
+		result = _ykusb_read(t->h, t->report_type, t->report_number,
+				     t->buffer, t->size, 0);
+	}
+	t->cb(t->userdata, result);
+}
+
+int _ykusb_submit_read(void *dev, int report_type, int report_number,
+		       char *buffer, int buffer_size,
+		       unsigned int timeout_ms,
+		       _ykusb_transfer_cb cb, void *userdata)
+{
+	return _ykem_submit(dev, 0, report_type, report_number,
+			    buffer, buffer_size, cb, userdata);
+}
+
+int _ykusb_submit_write(void *dev, int report_type, int report_number,
+			char *buffer, int buffer_size,
+			unsigned int timeout_ms,
+			_ykusb_transfer_cb cb, void *userdata)
+{
+	return _ykem_submit(dev, 1, report_type, report_number,
+			    buffer, buffer_size, cb, userdata);
+}
+
+int _ykusb_cancel_transfers(void *dev)
+{
+	struct ykem_handle_st *h = dev;
+	struct ykem_transfer_st *t;
+
+	pthread_mutex_lock(&h->ctx->lock);
+	for (t = h->ctx->transfers; t; t = t->next)
+		if (t->h == h)
+			t->canceled = 1;
+	pthread_mutex_unlock(&h->ctx->lock);
+	return 1;
+}
+
+int _ykusb_get_pollfds(void *ctx, YK_POLLFD *fds, unsigned int max,
+		       unsigned int *count)
+{
+	struct ykem_ctx_st *c = ctx;
+
+	*count = 1;
+	if (max < 1) {
+		yk_errno = YK_EWRONGSIZ;
+		return 0;
+	}
+	fds[0].fd = c->wake[0];
+	fds[0].events = POLLIN;
+	return 1;
+}
+
+int _ykusb_get_next_timeout(void *ctx, long *timeout_us)
+{
+	struct ykem_ctx_st *c = ctx;
+
+	pthread_mutex_lock(&c->lock);
+	*timeout_us = c->transfers ? 0 : -1;
+	pthread_mutex_unlock(&c->lock);
+	return 1;
+}
+
+int _ykusb_handle_events(void *ctx, long timeout_us)
+{
+	struct ykem_ctx_st *c = ctx;
+	struct ykem_transfer_st *t, *next;
+	char buf[16];
+
+	pthread_mutex_lock(&c->lock);
+	if (!c->transfers && timeout_us != 0) {
+		struct pollfd pfd;
+
+		pthread_mutex_unlock(&c->lock);
+		pfd.fd = c->wake[0];
+		pfd.events = POLLIN;
+		poll(&pfd, 1, timeout_us < 0 ? -1 :
+		     (int)((timeout_us + 999) / 1000));
+		pthread_mutex_lock(&c->lock);
+	}
+	/* Callbacks submitting more transfers queue them for the next call */
+	t = c->transfers;
+	c->transfers = NULL;
+	while (read(c->wake[0], buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_unlock(&c->lock);
+
+	for (; t; t = next) {
+		next = t->next;
+		_ykem_complete(t);
+		free(t);
+	}
+	return 1;
+}
+
+int _ykusb_hotplug_register(void *ctx, int vendor_id, int *product_ids,
+			    size_t pids_len, _ykusb_hotplug_cb cb,
+			    void *userdata)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_hotplug_deregister(void *ctx)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+void _ykusb_unref_entry(void *entry)
+{
+}
+
+int _ykusb_get_error(void *ctx)
+{
+	return ykem_error;
+}
+
+int _ykusb_error_class(void *ctx)
+{
+	switch (ykem_error) {
+	case EPIPE:
+	case EIO:
+	case EBUSY:
+		return YKUSB_ERROR_TRANSIENT;
+	case ENODEV:
+		return YKUSB_ERROR_GONE;
+	default:
+		return YKUSB_ERROR_OTHER;
+	}
+}
+
+const char *_ykusb_strerror(void *ctx)
+{
+	return "emulated key error";
+}
@@ -0,0 +1,448 @@
+/* -*- mode:C; c-file-style: "bsd" -*- */
+/*
+ * Copyright (c) 2017 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Linux hidraw backend. Feature reports go through the HIDIOCSFEATURE and
+ * HIDIOCGFEATURE ioctls on /dev/hidrawN, so the usbhid driver stays bound
+ * to the key and keeps delivering keyboard output while we talk to it.
+ * Keys are found through /sys/class/hidraw, their location is the HID_PHYS
+ * of the interface, e.g. "usb-0000:00:14.0-2/input0".
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ykcore.h"
+#include "ykdef.h"
+#include "ykcore_backend.h"
+
+#define HIDRAW_SYSFS		"/sys/class/hidraw"
+#define YKH_MAX_NODES	256
+
+struct ykh_device_st {
+	int fd;
+	int num;		/* N of /dev/hidrawN */
+	int vendor_id;
+	int product_id;
+};
+
+/* errno of the last failure, per thread */
+#define ykh_errno (*_yk_backend_errno_location())
+
+int _ykusb_start(void **ctx)
+{
+	*ctx = NULL;
+	return 1;
+}
+
+int _ykusb_stop(void *ctx)
+{
+	return 1;
+}
+
+static int _ykh_cmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Read vendor, product and HID_PHYS of hidrawN from its uevent file. */
+static int _ykh_uevent(int n, int *vid, int *pid, char *phys, size_t len)
+{
+	char name[64], line[256];
+	unsigned int bus, v, p;
+	int found = 0;
+	FILE *f;
+
+	snprintf(name, sizeof(name), HIDRAW_SYSFS "/hidraw%d/device/uevent", n);
+	if (!(f = fopen(name, "r")))
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (sscanf(line, "HID_ID=%x:%x:%x", &bus, &v, &p) == 3) {
+			*vid = v;
+			*pid = p;
+			found |= 1;
+		} else if (strncmp(line, "HID_PHYS=", 9) == 0) {
+			strncpy(phys, line + 9, len - 1);
+			phys[len - 1] = '\0';
+			found |= 2;
+		}
+	}
+	fclose(f);
+	return found == 3;
+}
+
+/* Call fn for every hidraw node of a matching key, in the order of the
+   hidraw numbers, until it returns 0. Only the first interface, which
+   carries the OTP keyboard and its feature reports, is considered. */
+static int _ykh_walk(int vendor_id, int *product_ids, size_t pids_len,
+		     int (*fn)(const char *node, const char *phys, int pid,
+			       void *ctx),
+		     void *ctx)
+{
+	int numbers[YKH_MAX_NODES];
+	size_t count = 0, i, j;
+	struct dirent *de;
+	DIR *dir;
+
+	if (!(dir = opendir(HIDRAW_SYSFS))) {
+		ykh_errno = errno;
+		yk_errno = YK_EUSBERR;
+		return 0;
+	}
+	while ((de = readdir(dir)) && count < YKH_MAX_NODES) {
+		int n;
+		if (sscanf(de->d_name, "hidraw%d", &n) == 1)
+			numbers[count++] = n;
+	}
+	closedir(dir);
+	qsort(numbers, count, sizeof(int), _ykh_cmp);
+
+	for (i = 0; i < count; i++) {
+		char phys[YK_DEVICE_PATH_SIZE], node[32];
+		int vid = 0, pid = 0;
+		size_t plen;
+
+		if (!_ykh_uevent(numbers[i], &vid, &pid, phys, sizeof(phys)))
+			continue;
+		plen = strlen(phys);
+		if (vid != vendor_id || plen < 7 ||
+		    strcmp(phys + plen - 7, "/input0") != 0)
+			continue;
+		for (j = 0; j < pids_len; j++)
+			if (pid == product_ids[j])
+				break;
+		if (j == pids_len)
+			continue;
+		snprintf(node, sizeof(node), "/dev/hidraw%d", numbers[i]);
+		if (!fn(node, phys, pid, ctx))
+			break;
+	}
+	return 1;
+}
+
+static void *_ykh_open(const char *node)
+{
+	struct hidraw_devinfo info;
+	struct ykh_device_st *d;
+	int fd = open(node, O_RDWR | O_CLOEXEC);
+
+	if (fd < 0) {
+		ykh_errno = errno;
+		yk_errno = YK_EUSBERR;
+		return NULL;
+	}
+	if (ioctl(fd, HIDIOCGRAWINFO, &info) < 0) {
+		ykh_errno = errno;
+		close(fd);
+		yk_errno = YK_EUSBERR;
+		return NULL;
+	}
+	d = calloc(1, sizeof(struct ykh_device_st));
+	if (d == NULL) {
+		close(fd);
+		yk_errno = YK_ENOMEM;
+		return NULL;
+	}
+	d->fd = fd;
+	sscanf(node, "/dev/hidraw%d", &d->num);
+	d->vendor_id = (unsigned short)info.vendor;
+	d->product_id = (unsigned short)info.product;
+	return d;
+}
+
+struct ykh_find_st {
+	int index;
+	const char *path;
+	void *dev;
+	int found;
+};
+
+static int _ykh_find(const char *node, const char *phys, int pid, void *ctx)
+{
+	struct ykh_find_st *f = ctx;
+
+	if (f->path) {
+		if (strcmp(phys, f->path) != 0)
+			return 1;
+	} else if (f->found++ != f->index)
+		return 1;
+	f->dev = _ykh_open(node);
+	f->found = -1;
+	return 0;
+}
+
+void *_ykusb_open_device(void *ctx, int vendor_id, int *product_ids,
+			 size_t pids_len, int index)
+{
+	struct ykh_find_st f = { index, NULL, NULL, 0 };
+
+	if (!_ykh_walk(vendor_id, product_ids, pids_len, _ykh_find, &f))
+		return NULL;
+	if (f.found >= 0)
+		yk_errno = YK_ENOKEY;
+	return f.dev;
+}
+
+struct ykh_enum_st {
+	int vendor_id;
+	_ykusb_enum_cb cb;
+	void *userdata;
+};
+
+static int _ykh_enum(const char *node, const char *phys, int pid, void *ctx)
+{
+	struct ykh_enum_st *e = ctx;
+
+	return e->cb(e->userdata, (void *)node, phys, e->vendor_id, pid);
+}
+
+int _ykusb_enumerate(void *ctx, int vendor_id, int *product_ids,
+		     size_t pids_len, _ykusb_enum_cb cb, void *userdata)
+{
+	struct ykh_enum_st e = { vendor_id, cb, userdata };
+
+	return _ykh_walk(vendor_id, product_ids, pids_len, _ykh_enum, &e);
+}
+
+void *_ykusb_open_entry(void *ctx, void *entry)
+{
+	return _ykh_open(entry);
+}
+
+void *_ykusb_open_path(void *ctx, int vendor_id, int *product_ids,
+		       size_t pids_len, const char *path)
+{
+	struct ykh_find_st f = { 0, path, NULL, 0 };
+
+	if (!_ykh_walk(vendor_id, product_ids, pids_len, _ykh_find, &f))
+		return NULL;
+	if (f.found >= 0)
+		yk_errno = YK_ENOKEY;
+	return f.dev;
+}
+
+int _ykusb_close_device(void *yk)
+{
+	struct ykh_device_st *d = yk;
+	int rc = close(d->fd);
+
+	free(d);
+	if (rc == 0)
+		return 1;
+	ykh_errno = errno;
+	yk_errno = YK_EUSBERR;
+	return 0;
+}
+
+/* The report number goes in front of the data, as with numbered reports */
+int _ykusb_read(void *dev, int report_type, int report_number,
+		char *buffer, int size,
+		unsigned int timeout_ms)
+{
+	struct ykh_device_st *d = dev;
+	unsigned char buf[FEATURE_RPT_SIZE + 1];
+	int rc;
+
+	if (report_type != REPORT_TYPE_FEATURE || size > FEATURE_RPT_SIZE) {
+		yk_errno = YK_ENOTYETIMPL;
+		return 0;
+	}
+
+	memset(buf, 0, sizeof(buf));
+	buf[0] = report_number;
+	rc = ioctl(d->fd, HIDIOCGFEATURE(size + 1), buf);
+	if (rc < 0) {
+		ykh_errno = errno;
+		yk_errno = YK_EUSBERR;
+		return 0;
+	}
+	if (rc <= 1) {
+		yk_errno = YK_ENODATA;
+		return 0;
+	}
+	memcpy(buffer, buf + 1, rc - 1);
+	return rc - 1;
+}
+
+int _ykusb_write(void *dev, int report_type, int report_number,
+		 char *buffer, int size,
+		 unsigned int timeout_ms)
+{
+	struct ykh_device_st *d = dev;
+	unsigned char buf[FEATURE_RPT_SIZE + 1];
+
+	if (report_type != REPORT_TYPE_FEATURE || size > FEATURE_RPT_SIZE) {
+		yk_errno = YK_ENOTYETIMPL;
+		return 0;
+	}
+
+	buf[0] = report_number;
+	memcpy(buf + 1, buffer, size);
+	if (ioctl(d->fd, HIDIOCSFEATURE(size + 1), buf) < 0) {
+		ykh_errno = errno;
+		yk_errno = YK_EUSBERR;
+		return 0;
+	}
+	return 1;
+}
+
+int _ykusb_get_vid_pid(void *yk, int *vid, int *pid)
+{
+	struct ykh_device_st *d = yk;
+
+	*vid = d->vendor_id;
+	*pid = d->product_id;
+	return 1;
+}
+
+/* The physical location from the uevent, as _ykh_walk() gives it */
+int _ykusb_get_path(void *dev, char *path, size_t len)
+{
+	struct ykh_device_st *d = dev;
+	int vid, pid;
+
+	return _ykh_uevent(d->num, &vid, &pid, path, len);
+}
+
+/* The kernel driver stays bound, there is no interface to claim. */
+int _ykusb_begin_session(void *dev)
+{
+	return 1;
+}
+
+int _ykusb_end_session(void *dev)
+{
+	return 1;
+}
+
+int _ykusb_get_claim_counts(void *dev, unsigned long *claims,
+			    unsigned long *releases)
+{
+	*claims = 0;
+	*releases = 0;
+	return 1;
+}
+
+int _ykusb_submit_read(void *dev, int report_type, int report_number,
+		       char *buffer, int buffer_size,
+		       unsigned int timeout_ms,
+		       _ykusb_transfer_cb cb, void *userdata)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_submit_write(void *dev, int report_type, int report_number,
+			char *buffer, int buffer_size,
+			unsigned int timeout_ms,
+			_ykusb_transfer_cb cb, void *userdata)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_cancel_transfers(void *dev)
+{
+	/* Nothing is ever in flight */
+	return 1;
+}
+
+int _ykusb_get_pollfds(void *ctx, YK_POLLFD *fds, unsigned int max,
+		       unsigned int *count)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_get_next_timeout(void *ctx, long *timeout_us)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_handle_events(void *ctx, long timeout_us)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_hotplug_register(void *ctx, int vendor_id, int *product_ids,
+			    size_t pids_len, _ykusb_hotplug_cb cb,
+			    void *userdata)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_hotplug_deregister(void *ctx)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+void _ykusb_unref_entry(void *entry)
+{
+}
+
+int _ykusb_get_error(void *ctx)
+{
+	return ykh_errno;
+}
+
+int _ykusb_error_class(void *ctx)
+{
+	switch (ykh_errno) {
+	case EPIPE:
+	case EIO:
+	case EBUSY:
+	case EAGAIN:
+	case EINTR:
+		return YKUSB_ERROR_TRANSIENT;
+	case ENODEV:
+	case ENXIO:
+		return YKUSB_ERROR_GONE;
+	default:
+		return YKUSB_ERROR_OTHER;
+	}
+}
+
+const char *_ykusb_strerror(void *ctx)
+{
+	return strerror(ykh_errno);
+}
@@ -41,8 +41,116 @@
 #define yk_frame_st frame_st
 #define yk_device_config_st device_config_st
 
+#include <signal.h>
+#include <stdio.h>
+
 #include "ykcore.h"
 #include "ykdef.h"
+#include "ykcore_backend.h"
+#include "ykthread.h"
+
+/*
+ * Yubikey low-level interface section 2.4 (Report arbitration polling) specifies
+ * a 600 ms timeout for a Yubikey to process something written to it.
+ * Where can that document be found?
+ * It has been discovered that for swap 600 is not enough, swapping can worst
+ * case take 920 ms, which we then add 25% to for safety margin, arriving at
+ * 1150 ms.
+ */
+#define WAIT_FOR_WRITE_FLAG	1150
+
+/* Default timeouts of a key, see yk_set_timeouts(). A response should start
+ * within a second, a key waiting for a touch gives up after about 256 s.
+ */
+#define YK_TRANSFER_TIMEOUT	1000
+#define WAIT_FOR_RESPONSE	1000
+#define WAIT_FOR_TOUCH		(256 * 1000)
+
+/* Number of feature reports a full frame is split into */
+#define YK_FRAME_REPORTS	((sizeof(YK_FRAME) + FEATURE_RPT_SIZE - 2) / (FEATURE_RPT_SIZE - 1))
+
+/* A library context. 'usb' is whatever the USB backend returned from
+   _ykusb_start(), NULL for the default context before yk_init(). */
+struct yk_context_st {
+	void *usb;
+
+	/* All operations not yet freed, oldest first, see ykop.c */
+	YK_OP *ops;
+
+	/* Attached keys while registered for hotplug, see ykhotplug.c */
+	struct yk_hotplug_st *hotplug;
+};
+
+/* The handle given out as a YK_KEY. 'dev' is whatever the USB backend
+   returned from _ykusb_open_device(), the rest is per-key state kept by
+   ykcore itself. */
+struct yubikey_st {
+	void *dev;
+	YK_CONTEXT *ctx;
+
+	/* Status polling, see yk_set_poll_policy() */
+	int poll_policy;
+	unsigned int poll_interval_us;
+	unsigned int poll_max_interval_us;
+	unsigned int last_polls;
+	unsigned long total_polls;
+
+	/* For the timing profiles: firmware version from the last status
+	   read, 0 if unknown, and the command written last */
+	unsigned int version;
+	uint8_t last_cmd;
+
+	/* Waiting for a touch, see yk_set_touch_polling() */
+	unsigned int touch_interval_us;
+	yk_touch_cb touch_cb;
+	void *touch_userdata;
+	uint64_t touch_start_us;
+	uint64_t touch_seen_us;	/* last status read still waiting */
+
+	/* Non-blocking operation currently running on the key, see ykop.c */
+	YK_OP *op;
+
+	/* Feature report transfers, see yk_get_transfer_counts() */
+	unsigned long transfers;
+	const char *call_op;	/* for yk_get_error_info() */
+	unsigned long call_start;
+	unsigned int call_depth;
+	unsigned int last_transfers;
+
+	/* Timeouts and deadline, see yk_set_timeouts() and yk_set_deadline() */
+	YK_TIMEOUTS timeouts;
+	uint64_t deadline_us;
+
+	/* Recovery from transient errors, see yk_set_recovery(). A key that
+	   went away is found again by its 'path' or its 'serial', either may
+	   be unknown (empty or 0). 'disturbed' counts the retried writes and reopens, that may have
+	   put the key out of step with what is being sent to it. */
+	YK_RECOVERY recovery;
+	char path[YK_DEVICE_PATH_SIZE];
+	unsigned int serial;
+	unsigned long disturbed;
+	unsigned int session_depth;	/* sessions to take again on reopen */
+	int recovering;
+	uint32_t jitter;
+
+	/* Cancellation handle, see yk_set_cancel() */
+	YK_CANCEL *cancel;
+
+	/* Operation lock, see yk_set_locking(). Threads take tickets and get
+	   the key in the order they asked for it. */
+	int locking;
+	yk__MUTEX_T lock_mutex;
+	yk__COND_T lock_cond;
+	unsigned long lock_next;
+	unsigned long lock_serving;
+	yk__THREAD_ID_T lock_owner;
+	unsigned int lock_depth;
+	int lock_by_op;		/* held by an operation of ykop.c */
+
+	/* Latencies and counters, see yk_get_stats() */
+	uint64_t call_start_us;
+	YK_STATS stats;
+};
 
 /*************************************************************************
  **
@@ -66,4 +174,84 @@ extern int yk_read_from_key(YK_KEY *k, uint8_t slot,
 			    void *buf, unsigned int bufsize,
 			    unsigned int *bufcount);
 
+/* Split a command into the feature reports to write, returns how many. */
+extern int _yk_frame_reports(uint8_t slot, const void *buf, int bufcount,
+			     unsigned char reports[][FEATURE_RPT_SIZE]);
+/* Put a configuration, with its checksum updated, and the access code
+   in the payload of a configuration write. Either may be NULL. */
+extern void _yk_config_payload(YK_CONFIG *cfg, const unsigned char *acc_code,
+			       unsigned char buf[sizeof(YK_CONFIG) + ACC_CODE_SIZE]);
+
+/* A frame encoded ahead of time, see ykframe.c */
+struct yk_frame_plan_st {
+	uint8_t command;
+	int nreports;
+	unsigned char reports[YK_FRAME_REPORTS][FEATURE_RPT_SIZE];
+};
+
+/* Internal flag for yk_wait_for_key_status(): read status before the
+   first sleep instead of after it. */
+#define YK_FLAG_POLL_FIRST	(0x02 << 16)
+/* Internal flag for yk_wait_for_key_status(): the wait is for the command
+   written last to be processed or answered, learn how long it takes. */
+#define YK_FLAG_TIMED		(0x04 << 16)
+
+/* Timing profiles, see yktiming.c. 'version' is major << 16 | minor << 8 |
+   build, 'kind' YK_TIMING_WRITE or YK_TIMING_RESPONSE. */
+extern uint64_t _yk_timing_expect(unsigned int version, uint8_t cmd, int kind);
+extern void _yk_timing_learn(unsigned int version, uint8_t cmd, int kind,
+			     uint64_t missed_us, uint64_t done_us, int early);
+
+/* The key started waiting for a touch, and answered after one */
+extern void _yk_touch_begin(YK_KEY *yk);
+extern void _yk_touch_done(YK_KEY *yk);
+
+/* Bracket a synchronous operation on a key, see ykcore.c. 'op' says what
+   the operation does, for yk_get_error_info(). */
+extern void _yk_call_begin(YK_KEY *yk, const char *op);
+extern int _yk_call_end(YK_KEY *yk, int rc);
+/* Keep the details of a failed operation for yk_get_error_info() */
+extern void _yk_error_record(YK_CONTEXT *ctx, const char *op,
+			     uint64_t elapsed_us);
+
+/* Set from any thread or signal handler by yk_cancel(), only ever read
+   by the others */
+struct yk_cancel_st {
+	volatile sig_atomic_t canceled;
+};
+#define _yk_canceled(yk)	((yk)->cancel && \
+				 yk__atomic_load(&(yk)->cancel->canceled))
+
+/* The operation lock, for an operation of ykop.c rather than a thread.
+   Never waits: fails if the lock is taken, succeeds if locking is off. */
+extern int _yk_op_trylock_key(YK_KEY *yk);
+extern void _yk_op_unlock_key(YK_KEY *yk);
+
+/* Time left until the deadline of the key, at most 'us' */
+extern uint64_t _yk_time_left(YK_KEY *yk, uint64_t us);
+/* Timeout for the next transfer on the key, 0 if the deadline has passed */
+extern unsigned int _yk_transfer_timeout(YK_KEY *yk);
+
+/* Add a latency, in microseconds, to a histogram of YK_STATS */
+extern void _yk_stats_add(YK_HISTOGRAM *h, uint64_t us);
+
+/* The products yk_open_key() looks for, see ykcore.c */
+#define YK_NPRODUCTS	10
+extern void _yk_product_ids(int pids[YK_NPRODUCTS]);
+extern const char *_yk_product_family(int pid);
+/* The context of the functions without a context argument */
+extern YK_CONTEXT *_yk_default_context(void);
+/* Wrap a device opened by the backend, closing it on failure. */
+extern YK_KEY *_yk_new_key(YK_CONTEXT *ctx, void *dev);
+/* Fill in firmware version and serial of a key being enumerated. */
+extern void _yk_device_details(YK_CONTEXT *ctx, YK_DEVICE_INFO *info,
+			       void *entry);
+
+/* Deliver queued hotplug events, see ykhotplug.c */
+extern void _yk_hotplug_dispatch(YK_CONTEXT *ctx);
+
+/* A temporary file of its own to write and rename over 'path', see
+   ykcache.c */
+extern FILE *_yk_temp_file(const char *path, char *tmp, size_t len);
+
 #endif	/* __YKCORE_LCL_H_INCLUDED__ */
@@ -31,6 +31,7 @@
 
 #include <libusb.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "ykcore.h"
@@ -40,16 +41,72 @@
 #define HID_GET_REPORT			0x01
 #define HID_SET_REPORT			0x09
 
-static int ykl_errno;
-static int libusb_inited = 0;
-static libusb_context *usb_ctx = NULL;
+/* A backend context: the libusb context and its hotplug registration. */
+struct ykl_ctx_st {
+	libusb_context *usb;
+
+	struct {
+		libusb_hotplug_callback_handle handle;
+		int registered;
+		int vendor_id;
+		int *pids;
+		size_t pids_len;
+		_ykusb_hotplug_cb cb;
+		void *userdata;
+	} hotplug;
+};
+
+/* Stands in for a context never started, on libusb's default context. */
+static struct ykl_ctx_st ykl_null_ctx;
+
+/* libusb return code of the last call, per thread as every thread may
+   use the same context */
+#define ykl_err (*_yk_backend_errno_location())
+
+static struct ykl_ctx_st *_ykl_ctx(void *ctx)
+{
+	return ctx ? ctx : &ykl_null_ctx;
+}
+
+/* What we hand out as a YK_KEY. The interface is normally claimed and
+   released around every single feature report, but while a session is
+   open (see _ykusb_begin_session()) the claim is held and reused. */
+struct ykl_device_st {
+	struct ykl_ctx_st *ctx;
+	libusb_device_handle *h;
+	unsigned int session_depth;
+	unsigned long claims;
+	unsigned long releases;
+	struct ykl_transfer_st *transfers;	/* in flight */
+};
+
+static int _ykl_claim(struct ykl_device_st *d)
+{
+	int rc;
+
+	if (d->session_depth > 0)
+		return 0;
+	rc = libusb_claim_interface(d->h, 0);
+	if (rc == 0)
+		d->claims++;
+	return rc;
+}
+
+static int _ykl_release(struct ykl_device_st *d)
+{
+	if (d->session_depth > 0)
+		return 0;
+	d->releases++;
+	return libusb_release_interface(d->h, 0);
+}
 
 /*************************************************************************
  **  function _ykusb_write						**
  **  Set HID report							**
  **									**
  **  int _ykusb_write(YUBIKEY *yk, int report_type, int report_number,	**
- **			char *buffer, int size)				**
+ **			char *buffer, int size,				**
+ **			unsigned int timeout_ms)			**
  **									**
  **  Where:								**
  **  "yk" is handle to open Yubikey					**
@@ -57,33 +114,37 @@ static libusb_context *usb_ctx = NULL;
  **  "report_number" is report identifier				**
  **  "buffer" is pointer to in buffer					**
  **  "size" is size of the buffer					**
+ **  "timeout_ms" is how long the transfer may take			**
  **									**
  **  Returns: Nonzero if successful, zero otherwise			**
  **									**
  *************************************************************************/
 
 int _ykusb_write(void *dev, int report_type, int report_number,
-		 char *buffer, int size)
+		 char *buffer, int size,
+		 unsigned int timeout_ms)
 {
-	ykl_errno = libusb_claim_interface((libusb_device_handle *)dev, 0);
+	struct ykl_device_st *d = dev;
 
-	if (ykl_errno == 0) {
+	ykl_err = _ykl_claim(d);
+
+	if (ykl_err == 0) {
 		int rc2;
-		ykl_errno = libusb_control_transfer((libusb_device_handle *)dev,
+		ykl_err = libusb_control_transfer(d->h,
 					     LIBUSB_REQUEST_TYPE_CLASS |
 					     LIBUSB_RECIPIENT_INTERFACE |
 					     LIBUSB_ENDPOINT_OUT,
 					     HID_SET_REPORT,
 					     report_type << 8 | report_number, 0,
 					     (unsigned char *)buffer, size,
-					     1000);
+					     timeout_ms);
 		/* preserve a control message error over an interface
 		   release one */
-		rc2 = libusb_release_interface((libusb_device_handle *)dev, 0);
-		if (ykl_errno > 0 && rc2 < 0)
-			ykl_errno = rc2;
+		rc2 = _ykl_release(d);
+		if (ykl_err > 0 && rc2 < 0)
+			ykl_err = rc2;
 	}
-	if (ykl_errno > 0)
+	if (ykl_err > 0)
 		return 1;
 	yk_errno = YK_EUSBERR;
 	return 0;
@@ -94,7 +155,8 @@ int _ykusb_write(void *dev, int report_type, int report_number,
 **  Get HID report							**
 **                                                                      **
 **  int _ykusb_read(YUBIKEY *dev, int report_type, int report_number,	**
-**		       char *buffer, int size)				**
+**		       char *buffer, int size,				**
+**		       unsigned int timeout_ms)				**
 **                                                                      **
 **  Where:                                                              **
 **  "dev" is handle to open Yubikey					**
@@ -102,35 +164,39 @@ int _ykusb_write(void *dev, int report_type, int report_number,
 **  "report_number" is report identifier					**
 **  "buffer" is pointer to in buffer					**
 **  "size" is size of the buffer					**
+**  "timeout_ms" is how long the transfer may take			**
 **									**
 **  Returns: Number of bytes read. Zero if failure			**
 **                                                                      **
 *************************************************************************/
 
 int _ykusb_read(void *dev, int report_type, int report_number,
-		char *buffer, int size)
+		char *buffer, int size,
+		unsigned int timeout_ms)
 {
-	ykl_errno = libusb_claim_interface((libusb_device_handle *)dev, 0);
+	struct ykl_device_st *d = dev;
+
+	ykl_err = _ykl_claim(d);
 
-	if (ykl_errno == 0) {
+	if (ykl_err == 0) {
 		int rc2;
-		ykl_errno = libusb_control_transfer((libusb_device_handle *)dev,
+		ykl_err = libusb_control_transfer(d->h,
 					     LIBUSB_REQUEST_TYPE_CLASS |
 					     LIBUSB_RECIPIENT_INTERFACE | 
 					     LIBUSB_ENDPOINT_IN,
 					     HID_GET_REPORT,
 					     report_type << 8 | report_number, 0,
 					     (unsigned char *)buffer, size,
-					     1000);
+					     timeout_ms);
 		/* preserve a control message error over an interface
 		   release one */
-		rc2 = libusb_release_interface((libusb_device_handle *)dev, 0);
-		if (ykl_errno > 0 && rc2 < 0)
-			ykl_errno = rc2;
+		rc2 = _ykl_release(d);
+		if (ykl_err > 0 && rc2 < 0)
+			ykl_err = rc2;
 	}
-	if (ykl_errno > 0) {
-		return ykl_errno;
-	} else if(ykl_errno == 0) {
+	if (ykl_err > 0) {
+		return ykl_err;
+	} else if(ykl_err == 0) {
 		yk_errno = YK_ENODATA;
 	} else {
 		yk_errno = YK_EUSBERR;
@@ -138,101 +204,269 @@ int _ykusb_read(void *dev, int report_type, int report_number,
 	return 0;
 }
 
-int _ykusb_start(void)
+int _ykusb_start(void **ctx)
 {
-	ykl_errno = libusb_init(&usb_ctx);
-	if(ykl_errno) {
+	struct ykl_ctx_st *c = calloc(1, sizeof(struct ykl_ctx_st));
+
+	if (c == NULL) {
+		yk_errno = YK_ENOMEM;
+		return 0;
+	}
+	ykl_err = libusb_init(&c->usb);
+	if (ykl_err) {
+		free(c);
 		yk_errno = YK_EUSBERR;
 		return 0;
 	}
-	libusb_inited = 1;
+	*ctx = c;
 	return 1;
 }
 
-extern int _ykusb_stop(void)
+extern int _ykusb_stop(void *ctx)
 {
-	if (libusb_inited == 1) {
-		libusb_exit(usb_ctx);
-		usb_ctx = NULL;
-		libusb_inited = 0;
-		return 1;
+	struct ykl_ctx_st *c = ctx;
+
+	if (c == NULL) {
+		yk_errno = YK_EUSBERR;
+		return 0;
 	}
+	if (c->hotplug.registered)
+		_ykusb_hotplug_deregister(c);
+	libusb_exit(c->usb);
+	free(c);
+	return 1;
+}
+
+/* Open and set up a device found on the bus. */
+static struct ykl_device_st *_ykl_open(struct ykl_ctx_st *c,
+				       libusb_device *dev)
+{
+	libusb_device_handle *h = NULL;
+	struct ykl_device_st *d;
+	const int desired_cfg = 1;
+	int current_cfg;
+
+	ykl_err = libusb_open(dev, &h);
+	if (ykl_err != 0)
+		goto err;
+	ykl_err = libusb_kernel_driver_active(h, 0);
+	if (ykl_err == 1) {
+		ykl_err = libusb_detach_kernel_driver(h, 0);
+		if (ykl_err != 0)
+			goto err;
+	} else if (ykl_err != 0)
+		goto err;
+	/* This is needed for yubikey-personalization to work inside virtualbox virtualization. */
+	ykl_err = libusb_get_configuration(h, &current_cfg);
+	if (ykl_err != 0)
+		goto err;
+	if (desired_cfg != current_cfg) {
+		ykl_err = libusb_set_configuration(h, desired_cfg);
+		if (ykl_err != 0)
+			goto err;
+	}
+
+	d = calloc(1, sizeof(struct ykl_device_st));
+	if (d == NULL) {
+		libusb_attach_kernel_driver(h, 0);
+		libusb_close(h);
+		yk_errno = YK_ENOMEM;
+		return NULL;
+	}
+	d->ctx = c;
+	d->h = h;
+	return d;
+
+ err:
+	if (h)
+		libusb_close(h);
 	yk_errno = YK_EUSBERR;
+	return NULL;
+}
+
+/* Location of a device as "bus-port.port...", the same as sysfs uses. */
+static void _ykl_device_path(libusb_device *dev, char *path, size_t len)
+{
+	uint8_t ports[7];
+	int n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	int i, off;
+
+	off = snprintf(path, len, "%d", libusb_get_bus_number(dev));
+	for (i = 0; i < n && off > 0 && (size_t)off < len; i++)
+		off += snprintf(path + off, len - off, "%c%d",
+				i == 0 ? '-' : '.', ports[i]);
+}
+
+static int _ykl_match(struct ykl_ctx_st *c, libusb_device *dev,
+		      int vendor_id, int *product_ids, size_t pids_len, int *pid)
+{
+	struct libusb_device_descriptor desc;
+	size_t j;
+
+	ykl_err = libusb_get_device_descriptor(dev, &desc);
+	if (ykl_err != 0 || desc.idVendor != vendor_id)
+		return 0;
+	for (j = 0; j < pids_len; j++) {
+		if (desc.idProduct == product_ids[j]) {
+			*pid = desc.idProduct;
+			return 1;
+		}
+	}
 	return 0;
 }
 
-void *_ykusb_open_device(int vendor_id, int *product_ids, size_t pids_len, int index)
+void *_ykusb_open_device(void *ctx, int vendor_id, int *product_ids,
+			 size_t pids_len, int index)
 {
+	struct ykl_ctx_st *c = _ykl_ctx(ctx);
 	libusb_device *dev = NULL;
-	libusb_device_handle *h = NULL;
-	struct libusb_device_descriptor desc;
 	libusb_device **list;
-	ssize_t cnt = libusb_get_device_list(usb_ctx, &list);
+	ssize_t cnt = libusb_get_device_list(c->usb, &list);
 	ssize_t i = 0;
-	int rc = YK_ENOKEY;
-	const int desired_cfg = 1;
+	void *d = NULL;
 	int found = 0;
+	int pid;
 
 	for (i = 0; i < cnt; i++) {
-		ykl_errno = libusb_get_device_descriptor(list[i], &desc);
-		if (ykl_errno != 0)
-			goto done;
-
-		if (desc.idVendor == vendor_id) {
-			size_t j;
-			for(j = 0; j < pids_len; j++) {
-				if (desc.idProduct == product_ids[j]) {
-					found++;
-					if (found-1 == index) {
-						dev = list[i];
-						break;
-					}
-				}
+		if (_ykl_match(c, list[i], vendor_id, product_ids, pids_len, &pid)) {
+			if (found++ == index) {
+				dev = list[i];
+				break;
 			}
 		}
 	}
 
-	if (dev) {
-		int current_cfg;
-		rc = YK_EUSBERR;
-		ykl_errno = libusb_open(dev, &h);
-		if (ykl_errno != 0)
-			goto done;
-		ykl_errno = libusb_kernel_driver_active(h, 0);
-		if (ykl_errno == 1) {
-			ykl_errno = libusb_detach_kernel_driver(h, 0);
-			if (ykl_errno != 0)
-				goto done;
-		} else if (ykl_errno != 0)
-			goto done;
-		/* This is needed for yubikey-personalization to work inside virtualbox virtualization. */
-		ykl_errno = libusb_get_configuration(h, &current_cfg);
-		if (ykl_errno != 0)
-			goto done;
-		if (desired_cfg != current_cfg) {
-			ykl_errno = libusb_set_configuration(h, desired_cfg);
-			if (ykl_errno != 0)
-				goto done;
-		}
+	if (dev)
+		d = _ykl_open(c, dev);
+	else
+		yk_errno = YK_ENOKEY;
+	if (cnt >= 0)
+		libusb_free_device_list(list, 1);
+	return d;
+}
+
+int _ykusb_enumerate(void *ctx, int vendor_id, int *product_ids,
+		     size_t pids_len, _ykusb_enum_cb cb, void *userdata)
+{
+	struct ykl_ctx_st *c = _ykl_ctx(ctx);
+	libusb_device **list;
+	ssize_t cnt = libusb_get_device_list(c->usb, &list);
+	ssize_t i;
+	char path[YK_DEVICE_PATH_SIZE];
+	int pid;
+
+	if (cnt < 0) {
+		ykl_err = cnt;
+		yk_errno = YK_EUSBERR;
+		return 0;
+	}
+	for (i = 0; i < cnt; i++) {
+		if (!_ykl_match(c, list[i], vendor_id, product_ids, pids_len, &pid))
+			continue;
+		_ykl_device_path(list[i], path, sizeof(path));
+		if (!cb(userdata, list[i], path, vendor_id, pid))
+			break;
 	}
- done:
 	libusb_free_device_list(list, 1);
-	if (h == NULL)
-		yk_errno = rc;
-	return h;
+	return 1;
+}
+
+void *_ykusb_open_entry(void *ctx, void *entry)
+{
+	return _ykl_open(_ykl_ctx(ctx), entry);
+}
+
+void *_ykusb_open_path(void *ctx, int vendor_id, int *product_ids,
+		       size_t pids_len, const char *path)
+{
+	struct ykl_ctx_st *c = _ykl_ctx(ctx);
+	libusb_device **list;
+	ssize_t cnt = libusb_get_device_list(c->usb, &list);
+	ssize_t i;
+	char p[YK_DEVICE_PATH_SIZE];
+	void *d = NULL;
+	int pid;
+
+	yk_errno = YK_ENOKEY;
+	for (i = 0; i < cnt; i++) {
+		if (!_ykl_match(c, list[i], vendor_id, product_ids, pids_len, &pid))
+			continue;
+		_ykl_device_path(list[i], p, sizeof(p));
+		if (strcmp(p, path) == 0) {
+			d = _ykl_open(c, list[i]);
+			break;
+		}
+	}
+	if (cnt >= 0)
+		libusb_free_device_list(list, 1);
+	return d;
 }
 
 int _ykusb_close_device(void *yk)
 {
-	libusb_attach_kernel_driver(yk, 0);
-	libusb_close((libusb_device_handle *) yk);
+	struct ykl_device_st *d = yk;
+
+	if (d->session_depth > 0) {
+		d->session_depth = 0;
+		d->releases++;
+		libusb_release_interface(d->h, 0);
+	}
+	libusb_attach_kernel_driver(d->h, 0);
+	libusb_close(d->h);
+	free(d);
+	return 1;
+}
+
+int _ykusb_begin_session(void *yk)
+{
+	struct ykl_device_st *d = yk;
+
+	if (d->session_depth == 0) {
+		ykl_err = libusb_claim_interface(d->h, 0);
+		if (ykl_err != 0) {
+			yk_errno = YK_EUSBERR;
+			return 0;
+		}
+		d->claims++;
+	}
+	d->session_depth++;
+	return 1;
+}
+
+int _ykusb_end_session(void *yk)
+{
+	struct ykl_device_st *d = yk;
+
+	if (d->session_depth == 0) {
+		yk_errno = YK_EINVALIDCMD;
+		return 0;
+	}
+	if (--d->session_depth == 0) {
+		d->releases++;
+		ykl_err = libusb_release_interface(d->h, 0);
+		if (ykl_err != 0) {
+			yk_errno = YK_EUSBERR;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int _ykusb_get_claim_counts(void *yk, unsigned long *claims,
+			    unsigned long *releases)
+{
+	struct ykl_device_st *d = yk;
+
+	*claims = d->claims;
+	*releases = d->releases;
 	return 1;
 }
 
 int _ykusb_get_vid_pid(void *yk, int *vid, int *pid)
 {
+	struct ykl_device_st *d = yk;
 	struct libusb_device_descriptor desc;
-	libusb_device *dev = libusb_get_device(yk);
+	libusb_device *dev = libusb_get_device(d->h);
 	int rc = libusb_get_device_descriptor(dev, &desc);
 
 	if (rc == 0) {
@@ -244,10 +478,319 @@ int _ykusb_get_vid_pid(void *yk, int *vid, int *pid)
 	return 0;
 }
 
-const char *_ykusb_strerror(void)
+int _ykusb_get_path(void *dev, char *path, size_t len)
 {
-	static const char *buf;
-	switch (ykl_errno) {
+	struct ykl_device_st *d = dev;
+
+	_ykl_device_path(libusb_get_device(d->h), path, len);
+	return 1;
+}
+
+struct ykl_transfer_st {
+	struct ykl_device_st *d;
+	struct libusb_transfer *transfer;
+	_ykusb_transfer_cb cb;
+	void *userdata;
+	char *buffer;
+	struct ykl_transfer_st *next;
+};
+
+static void LIBUSB_CALL _ykl_transfer_done(struct libusb_transfer *transfer)
+{
+	struct ykl_transfer_st *t = transfer->user_data;
+	struct ykl_transfer_st **p;
+	int result = 0;
+
+	for (p = &t->d->transfers; *p; p = &(*p)->next) {
+		if (*p == t) {
+			*p = t->next;
+			break;
+		}
+	}
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		result = transfer->actual_length;
+		if (result > 0 && (transfer->buffer[0] & LIBUSB_ENDPOINT_IN))
+			memcpy(t->buffer, libusb_control_transfer_get_data(transfer), result);
+		if (result == 0)
+			yk_errno = YK_ENODATA;
+	} else {
+		switch (transfer->status) {
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			ykl_err = LIBUSB_ERROR_TIMEOUT;
+			break;
+		case LIBUSB_TRANSFER_STALL:
+			ykl_err = LIBUSB_ERROR_PIPE;
+			break;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			ykl_err = LIBUSB_ERROR_NO_DEVICE;
+			break;
+		case LIBUSB_TRANSFER_OVERFLOW:
+			ykl_err = LIBUSB_ERROR_OVERFLOW;
+			break;
+		default:
+			ykl_err = LIBUSB_ERROR_IO;
+			break;
+		}
+		yk_errno = YK_EUSBERR;
+	}
+	t->cb(t->userdata, result);
+	free(t);
+}
+
+static int _ykl_submit(struct ykl_device_st *d, uint8_t request_type,
+		       uint8_t request, int report_type, int report_number,
+		       char *buffer, int size, unsigned int timeout_ms,
+		       _ykusb_transfer_cb cb, void *userdata)
+{
+	struct libusb_transfer *transfer;
+	struct ykl_transfer_st *t;
+	unsigned char *setup;
+
+	transfer = libusb_alloc_transfer(0);
+	setup = malloc(LIBUSB_CONTROL_SETUP_SIZE + size);
+	t = malloc(sizeof(struct ykl_transfer_st));
+	if (!transfer || !setup || !t) {
+		libusb_free_transfer(transfer);
+		free(setup);
+		free(t);
+		yk_errno = YK_ENOMEM;
+		return 0;
+	}
+	t->d = d;
+	t->transfer = transfer;
+	t->cb = cb;
+	t->userdata = userdata;
+	t->buffer = buffer;
+
+	libusb_fill_control_setup(setup, request_type, request,
+				  report_type << 8 | report_number, 0, size);
+	if (!(request_type & LIBUSB_ENDPOINT_IN))
+		memcpy(setup + LIBUSB_CONTROL_SETUP_SIZE, buffer, size);
+	libusb_fill_control_transfer(transfer, d->h, setup,
+				     _ykl_transfer_done, t, timeout_ms);
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+
+	ykl_err = libusb_submit_transfer(transfer);
+	if (ykl_err != 0) {
+		libusb_free_transfer(transfer);
+		free(t);
+		yk_errno = YK_EUSBERR;
+		return 0;
+	}
+	t->next = d->transfers;
+	d->transfers = t;
+	return 1;
+}
+
+/* The asynchronous transfers don't claim the interface themselves, the
+   caller is expected to hold a session while they are in flight. */
+int _ykusb_submit_read(void *dev, int report_type, int report_number,
+		       char *buffer, int size,
+		       unsigned int timeout_ms,
+		       _ykusb_transfer_cb cb, void *userdata)
+{
+	return _ykl_submit(dev, LIBUSB_REQUEST_TYPE_CLASS |
+			   LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_IN,
+			   HID_GET_REPORT, report_type, report_number,
+			   buffer, size, timeout_ms, cb, userdata);
+}
+
+int _ykusb_submit_write(void *dev, int report_type, int report_number,
+			char *buffer, int size,
+			unsigned int timeout_ms,
+			_ykusb_transfer_cb cb, void *userdata)
+{
+	return _ykl_submit(dev, LIBUSB_REQUEST_TYPE_CLASS |
+			   LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT,
+			   HID_SET_REPORT, report_type, report_number,
+			   buffer, size, timeout_ms, cb, userdata);
+}
+
+int _ykusb_cancel_transfers(void *dev)
+{
+	struct ykl_device_st *d = dev;
+	struct ykl_transfer_st *t;
+
+	for (t = d->transfers; t; t = t->next)
+		libusb_cancel_transfer(t->transfer);
+	return 1;
+}
+
+int _ykusb_get_pollfds(void *ctx, YK_POLLFD *fds, unsigned int max,
+		       unsigned int *count)
+{
+	struct ykl_ctx_st *c = _ykl_ctx(ctx);
+	const struct libusb_pollfd **pollfds = libusb_get_pollfds(c->usb);
+	unsigned int i;
+
+	if (pollfds == NULL) {
+		ykl_err = LIBUSB_ERROR_NOT_SUPPORTED;
+		yk_errno = YK_EUSBERR;
+		return 0;
+	}
+	for (i = 0; pollfds[i] != NULL; i++) {
+		if (i < max) {
+			fds[i].fd = pollfds[i]->fd;
+			fds[i].events = pollfds[i]->events;
+		}
+	}
+	libusb_free_pollfds(pollfds);
+	*count = i;
+	if (i > max) {
+		yk_errno = YK_EWRONGSIZ;
+		return 0;
+	}
+	return 1;
+}
+
+int _ykusb_get_next_timeout(void *ctx, long *timeout_us)
+{
+	struct ykl_ctx_st *c = _ykl_ctx(ctx);
+	struct timeval tv;
+	int rc = libusb_get_next_timeout(c->usb, &tv);
+
+	if (rc < 0) {
+		ykl_err = rc;
+		yk_errno = YK_EUSBERR;
+		return 0;
+	}
+	if (rc == 0)
+		*timeout_us = -1;
+	else
+		*timeout_us = tv.tv_sec * 1000000L + tv.tv_usec;
+	return 1;
+}
+
+int _ykusb_handle_events(void *ctx, long timeout_us)
+{
+	struct ykl_ctx_st *c = _ykl_ctx(ctx);
+	struct timeval tv;
+
+	if (timeout_us < 0) {
+		ykl_err = libusb_handle_events_completed(c->usb, NULL);
+	} else {
+		tv.tv_sec = timeout_us / 1000000;
+		tv.tv_usec = timeout_us % 1000000;
+		ykl_err = libusb_handle_events_timeout_completed(c->usb, &tv, NULL);
+	}
+	if (ykl_err != 0) {
+		yk_errno = YK_EUSBERR;
+		return 0;
+	}
+	return 1;
+}
+
+static int LIBUSB_CALL _ykl_hotplug_event(libusb_context *ctx,
+					  libusb_device *dev,
+					  libusb_hotplug_event event,
+					  void *userdata)
+{
+	struct ykl_ctx_st *c = userdata;
+	char path[YK_DEVICE_PATH_SIZE];
+	int pid;
+
+	if (!_ykl_match(c, dev, c->hotplug.vendor_id, c->hotplug.pids,
+			c->hotplug.pids_len, &pid))
+		return 0;
+	_ykl_device_path(dev, path, sizeof(path));
+	libusb_ref_device(dev);
+	c->hotplug.cb(c->hotplug.userdata,
+		      event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ?
+		      YKUSB_HOTPLUG_ARRIVED : YKUSB_HOTPLUG_LEFT,
+		      dev, path, c->hotplug.vendor_id, pid);
+	return 0;
+}
+
+int _ykusb_hotplug_register(void *ctx, int vendor_id, int *product_ids,
+			    size_t pids_len, _ykusb_hotplug_cb cb,
+			    void *userdata)
+{
+	struct ykl_ctx_st *c = _ykl_ctx(ctx);
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		yk_errno = YK_ENOTYETIMPL;
+		return 0;
+	}
+	if (c->hotplug.registered) {
+		yk_errno = YK_EINVALIDCMD;
+		return 0;
+	}
+	c->hotplug.pids = malloc(pids_len * sizeof(int));
+	if (!c->hotplug.pids) {
+		yk_errno = YK_ENOMEM;
+		return 0;
+	}
+	memcpy(c->hotplug.pids, product_ids, pids_len * sizeof(int));
+	c->hotplug.pids_len = pids_len;
+	c->hotplug.vendor_id = vendor_id;
+	c->hotplug.cb = cb;
+	c->hotplug.userdata = userdata;
+
+	ykl_err = libusb_hotplug_register_callback(c->usb,
+				LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+				LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+				LIBUSB_HOTPLUG_ENUMERATE, vendor_id,
+				LIBUSB_HOTPLUG_MATCH_ANY,
+				LIBUSB_HOTPLUG_MATCH_ANY,
+				_ykl_hotplug_event, c,
+				&c->hotplug.handle);
+	if (ykl_err != LIBUSB_SUCCESS) {
+		free(c->hotplug.pids);
+		c->hotplug.pids = NULL;
+		yk_errno = YK_EUSBERR;
+		return 0;
+	}
+	c->hotplug.registered = 1;
+	return 1;
+}
+
+int _ykusb_hotplug_deregister(void *ctx)
+{
+	struct ykl_ctx_st *c = _ykl_ctx(ctx);
+
+	if (!c->hotplug.registered) {
+		yk_errno = YK_EINVALIDCMD;
+		return 0;
+	}
+	libusb_hotplug_deregister_callback(c->usb, c->hotplug.handle);
+	free(c->hotplug.pids);
+	memset(&c->hotplug, 0, sizeof(c->hotplug));
+	return 1;
+}
+
+void _ykusb_unref_entry(void *entry)
+{
+	libusb_unref_device(entry);
+}
+
+int _ykusb_get_error(void *ctx)
+{
+	int err = ykl_err;
+
+	/* successful transfers leave their length behind */
+	return err < 0 ? err : 0;
+}
+
+int _ykusb_error_class(void *ctx)
+{
+	switch (ykl_err) {
+	case LIBUSB_ERROR_PIPE:
+	case LIBUSB_ERROR_IO:
+	case LIBUSB_ERROR_BUSY:
+	case LIBUSB_ERROR_INTERRUPTED:
+		return YKUSB_ERROR_TRANSIENT;
+	case LIBUSB_ERROR_NO_DEVICE:
+		return YKUSB_ERROR_GONE;
+	default:
+		return YKUSB_ERROR_OTHER;
+	}
+}
+
+const char *_ykusb_strerror(void *ctx)
+{
+	const char *buf;
+
+	switch (ykl_err) {
 	case LIBUSB_SUCCESS:
 		buf = "Success (no error)";
 		break;
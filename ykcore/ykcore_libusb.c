@@ -44,7 +44,8 @@
  **  Set HID report							**
  **									**
  **  int _ykusb_write(YUBIKEY *yk, int report_type, int report_number,	**
- **			char *buffer, int size)				**
+ **			char *buffer, int size,				**
+ **			unsigned int timeout_ms)			**
  **									**
  **  Where:								**
  **  "yk" is handle to open Yubikey					**
@@ -52,13 +53,15 @@
  **  "report_number" is report identifier				**
  **  "buffer" is pointer to in buffer					**
  **  "size" is size of the buffer					**
+ **  "timeout_ms" is how long the transfer may take			**
  **									**
  **  Returns: Nonzero if successful, zero otherwise			**
  **									**
  *************************************************************************/
 
 int _ykusb_write(void *dev, int report_type, int report_number,
-		 char *buffer, int size)
+		 char *buffer, int size,
+		 unsigned int timeout_ms)
 {
 	int rc = usb_claim_interface((usb_dev_handle *)dev, 0);
 
@@ -69,7 +72,7 @@ int _ykusb_write(void *dev, int report_type, int report_number,
 				     HID_SET_REPORT,
 				     report_type << 8 | report_number, 0,
 				     buffer, size,
-				     1000);
+				     timeout_ms);
 		/* preserve a control message error over an interface
 		   release one */
 		rc2 = usb_release_interface((usb_dev_handle *)dev, 0);
@@ -87,7 +90,8 @@ int _ykusb_write(void *dev, int report_type, int report_number,
 **  Get HID report							**
 **                                                                      **
 **  int _ykusb_read(YUBIKEY *dev, int report_type, int report_number,	**
-**		       char *buffer, int size)				**
+**		       char *buffer, int size,				**
+**		       unsigned int timeout_ms)				**
 **                                                                      **
 **  Where:                                                              **
 **  "dev" is handle to open Yubikey					**
@@ -95,13 +99,15 @@ int _ykusb_write(void *dev, int report_type, int report_number,
 **  "report_number" is report identifier					**
 **  "buffer" is pointer to in buffer					**
 **  "size" is size of the buffer					**
+**  "timeout_ms" is how long the transfer may take			**
 **									**
 **  Returns: Number of bytes read. Zero if failure			**
 **                                                                      **
 *************************************************************************/
 
 int _ykusb_read(void *dev, int report_type, int report_number,
-		char *buffer, int size)
+		char *buffer, int size,
+		unsigned int timeout_ms)
 {
 	int rc = usb_claim_interface((usb_dev_handle *)dev, 0);
 
@@ -112,7 +118,7 @@ int _ykusb_read(void *dev, int report_type, int report_number,
 				     HID_GET_REPORT,
 				     report_type << 8 | report_number, 0,
 				     buffer, size,
-				     1000);
+				     timeout_ms);
 		/* preserve a control message error over an interface
 		   release one */
 		rc2 = usb_release_interface((usb_dev_handle *)dev, 0);
@@ -128,7 +134,7 @@ int _ykusb_read(void *dev, int report_type, int report_number,
 	return 0;
 }
 
-int _ykusb_start(void)
+int _ykusb_start(void **ctx)
 {
 	int rc;
 	usb_init();
@@ -137,59 +143,122 @@ int _ykusb_start(void)
 	if (rc >= 0)
 		rc = usb_find_devices();
 
+	*ctx = NULL;
 	if (rc >= 0)
 		return 1;
 	yk_errno = YK_EUSBERR;
 	return 0;
 }
 
-extern int _ykusb_stop(void)
+extern int _ykusb_stop(void *ctx)
 {
 	return 1;
 }
 
-void *_ykusb_open_device(int vendor_id, int *product_ids, size_t pids_len, int index)
+static usb_dev_handle *_ykl_open(struct usb_device *yk_device)
+{
+	usb_dev_handle *h = usb_open(yk_device);
+
+#ifdef LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP
+	if (h != NULL)
+		usb_detach_kernel_driver_np(h, 0);
+#endif
+	/* This is needed for yubikey-personalization to work inside virtualbox virtualization. */
+	if (h != NULL)
+		usb_set_configuration(h, 1);
+	else
+		yk_errno = YK_EUSBERR;
+	return h;
+}
+
+static int _ykl_match(struct usb_device *dev, int vendor_id,
+		      int *product_ids, size_t pids_len)
+{
+	size_t j;
+
+	if (dev->descriptor.idVendor != vendor_id)
+		return 0;
+	for (j = 0; j < pids_len; j++)
+		if (dev->descriptor.idProduct == product_ids[j])
+			return 1;
+	return 0;
+}
+
+/* Location of a device as "bus/device", as in /proc/bus/usb. */
+static void _ykl_device_path(struct usb_bus *bus, struct usb_device *dev,
+			     char *path, size_t len)
+{
+	snprintf(path, len, "%s/%s", bus->dirname, dev->filename);
+}
+
+void *_ykusb_open_device(void *ctx, int vendor_id, int *product_ids,
+			 size_t pids_len, int index)
 {
 	struct usb_bus *bus;
 	struct usb_device *yk_device = NULL;
-	struct usb_dev_handle *h = NULL;
 	int rc = YK_EUSBERR;
 	int found = 0;
 
-	for (bus = usb_get_busses(); bus; bus = bus->next) {
+	for (bus = usb_get_busses(); bus && !yk_device; bus = bus->next) {
 		struct usb_device *dev;
 		rc = YK_ENOKEY;
 		for (dev = bus->devices; dev; dev = dev->next) {
-			if (dev->descriptor.idVendor == vendor_id) {
-				size_t j;
-				for (j = 0; j < pids_len; j++) {
-					if (dev->descriptor.idProduct == product_ids[j]) {
-                                                found++;
-                                                if (found-1 == index) {
-                                                        yk_device = dev;
-                                                        break;
-                                                }
-					}
-				}
+			if (_ykl_match(dev, vendor_id, product_ids, pids_len)
+			    && found++ == index) {
+				yk_device = dev;
+				break;
 			}
 		}
 	}
-	if(yk_device != NULL) {
-		rc = YK_EUSBERR;
-		h = usb_open(yk_device);
-#ifdef LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP
-		if (h != NULL)
-			usb_detach_kernel_driver_np(h, 0);
-#endif
-		/* This is needed for yubikey-personalization to work inside virtualbox virtualization. */
-		if (h != NULL)
-			usb_set_configuration(h, 1);
-		goto done;
+	if (yk_device != NULL)
+		return _ykl_open(yk_device);
+	yk_errno = rc;
+	return NULL;
+}
+
+int _ykusb_enumerate(void *ctx, int vendor_id, int *product_ids,
+		     size_t pids_len, _ykusb_enum_cb cb, void *userdata)
+{
+	struct usb_bus *bus;
+	char path[YK_DEVICE_PATH_SIZE];
+
+	for (bus = usb_get_busses(); bus; bus = bus->next) {
+		struct usb_device *dev;
+		for (dev = bus->devices; dev; dev = dev->next) {
+			if (!_ykl_match(dev, vendor_id, product_ids, pids_len))
+				continue;
+			_ykl_device_path(bus, dev, path, sizeof(path));
+			if (!cb(userdata, dev, path, vendor_id,
+				dev->descriptor.idProduct))
+				return 1;
+		}
 	}
- done:
-	if (h == NULL)
-		yk_errno = rc;
-	return h;
+	return 1;
+}
+
+void *_ykusb_open_entry(void *ctx, void *entry)
+{
+	return _ykl_open(entry);
+}
+
+void *_ykusb_open_path(void *ctx, int vendor_id, int *product_ids,
+		       size_t pids_len, const char *path)
+{
+	struct usb_bus *bus;
+	char p[YK_DEVICE_PATH_SIZE];
+
+	for (bus = usb_get_busses(); bus; bus = bus->next) {
+		struct usb_device *dev;
+		for (dev = bus->devices; dev; dev = dev->next) {
+			if (!_ykl_match(dev, vendor_id, product_ids, pids_len))
+				continue;
+			_ykl_device_path(bus, dev, p, sizeof(p));
+			if (strcmp(p, path) == 0)
+				return _ykl_open(dev);
+		}
+	}
+	yk_errno = YK_ENOKEY;
+	return NULL;
 }
 
 int _ykusb_close_device(void *yk)
@@ -210,7 +279,106 @@ int _ykusb_get_vid_pid(void *yk, int *vid, int *pid) {
 	return 1;
 }
 
-const char *_ykusb_strerror(void)
+int _ykusb_get_path(void *dev, char *path, size_t len)
+{
+	struct usb_device *d = usb_device(dev);
+
+	_ykl_device_path(d->bus, d, path, len);
+	return 1;
+}
+
+/* Sessions are not implemented for libusb 0.1, every report still claims
+   and releases the interface on its own. */
+int _ykusb_begin_session(void *dev)
+{
+	return 1;
+}
+
+int _ykusb_end_session(void *dev)
+{
+	return 1;
+}
+
+int _ykusb_get_claim_counts(void *dev, unsigned long *claims,
+			    unsigned long *releases)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_submit_read(void *dev, int report_type, int report_number,
+		       char *buffer, int buffer_size,
+		       unsigned int timeout_ms,
+		       _ykusb_transfer_cb cb, void *userdata)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_submit_write(void *dev, int report_type, int report_number,
+			char *buffer, int buffer_size,
+			unsigned int timeout_ms,
+			_ykusb_transfer_cb cb, void *userdata)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_cancel_transfers(void *dev)
+{
+	/* Nothing is ever in flight */
+	return 1;
+}
+
+int _ykusb_get_pollfds(void *ctx, YK_POLLFD *fds, unsigned int max,
+		       unsigned int *count)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_get_next_timeout(void *ctx, long *timeout_us)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_handle_events(void *ctx, long timeout_us)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_hotplug_register(void *ctx, int vendor_id, int *product_ids,
+			    size_t pids_len, _ykusb_hotplug_cb cb,
+			    void *userdata)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_hotplug_deregister(void *ctx)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+void _ykusb_unref_entry(void *entry)
+{
+}
+
+int _ykusb_get_error(void *ctx)
+{
+	/* libusb-0.1 only keeps a message */
+	return 0;
+}
+
+int _ykusb_error_class(void *ctx)
+{
+	return YKUSB_ERROR_OTHER;
+}
+
+const char *_ykusb_strerror(void *ctx)
 {
 	return usb_strerror();
 }
@@ -29,6 +29,9 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdio.h>
+#include <string.h>
+
 #include "ykcore.h"
 #include "ykdef.h"
 #include "ykcore_backend.h"
@@ -42,16 +45,18 @@
 #define	FEATURE_RPT_SIZE		8
 
 static IOHIDManagerRef ykosxManager = NULL;
-static IOReturn _ykusb_IOReturn = 0;
+/* IOReturn of the last call, per thread (IOReturn is an int) */
+#define _ykusb_IOReturn (*_yk_backend_errno_location())
 
-int _ykusb_start(void)
+int _ykusb_start(void **ctx)
 {
 	ykosxManager = IOHIDManagerCreate( kCFAllocatorDefault, 0L );
 
+	*ctx = NULL;
 	return 1;
 }
 
-int _ykusb_stop(void)
+int _ykusb_stop(void *ctx)
 {
 	if (ykosxManager != NULL) {
 		CFRelease(ykosxManager);
@@ -79,15 +84,12 @@ static int _ykosx_getIntProperty( IOHIDDeviceRef dev, CFStringRef key ) {
 	return result;
 }
 
-void *_ykusb_open_device(int vendor_id, int *product_ids, size_t pids_len, int index)
+/* Call fn for every keyboard interface of a matching device, until it
+   returns 0. */
+static void _ykosx_walk(int vendor_id, int *product_ids, size_t pids_len,
+			int (*fn)(IOHIDDeviceRef dev, long pid, void *ctx),
+			void *ctx)
 {
-	void *yk = NULL;
-
-	int rc = YK_ENOKEY;
-
-	size_t i;
-	int found = 0;
-
 	IOHIDManagerSetDeviceMatchingMultiple( ykosxManager, NULL );
 
 	CFSetRef devSet = IOHIDManagerCopyDevices( ykosxManager );
@@ -111,14 +113,11 @@ void *_ykusb_open_device(int vendor_id, int *product_ids, size_t pids_len, int i
 				long devProductId = _ykosx_getIntProperty( dev, CFSTR( kIOHIDProductIDKey ));
 				size_t j;
 				for(j = 0; j < pids_len; j++) {
-					if(product_ids[j] == devProductId) {
-						found++;
-						if(found-1 == index) {
-							yk = dev;
-							break;
-						}
-					}
+					if(product_ids[j] == devProductId)
+						break;
 				}
+				if (j < pids_len && !fn(dev, devProductId, ctx))
+					break;
 			}
 		}
 
@@ -129,25 +128,104 @@ void *_ykusb_open_device(int vendor_id, int *product_ids, size_t pids_len, int i
 		CFRelease( array );
 		CFRelease( devSet );
 	}
+}
 
-	if (yk) {
-		CFRetain(yk);
-		_ykusb_IOReturn = IOHIDDeviceOpen( yk, 0L );
-
-		if ( _ykusb_IOReturn != kIOReturnSuccess ) {
-			CFRelease(yk);
-			rc = YK_EUSBERR;
-			goto error;
-		}
+static void *_ykosx_open(IOHIDDeviceRef yk)
+{
+	CFRetain(yk);
+	_ykusb_IOReturn = IOHIDDeviceOpen( yk, 0L );
 
-		return yk;
+	if ( _ykusb_IOReturn != kIOReturnSuccess ) {
+		CFRelease(yk);
+		yk_errno = YK_EUSBERR;
+		return 0;
 	}
+	return (void *)yk;
+}
 
-error:
-	yk_errno = rc;
+/* The location ID identifies the port a device is plugged into. */
+static void _ykosx_device_path(IOHIDDeviceRef dev, char *path, size_t len)
+{
+	snprintf(path, len, "%08x",
+		 (unsigned int)_ykosx_getIntProperty( dev, CFSTR( kIOHIDLocationIDKey )));
+}
+
+struct ykosx_find_st {
+	int index;
+	const char *path;
+	void *yk;
+	int found;
+};
+
+static int _ykosx_find(IOHIDDeviceRef dev, long pid, void *ctx)
+{
+	struct ykosx_find_st *f = ctx;
+
+	if (f->path) {
+		char p[YK_DEVICE_PATH_SIZE];
+
+		_ykosx_device_path(dev, p, sizeof(p));
+		if (strcmp(p, f->path) != 0)
+			return 1;
+	} else if (f->found++ != f->index)
+		return 1;
+	f->yk = _ykosx_open(dev);
+	if (!f->yk)
+		f->found = -1;
 	return 0;
 }
 
+void *_ykusb_open_device(void *ctx, int vendor_id, int *product_ids,
+			 size_t pids_len, int index)
+{
+	struct ykosx_find_st f = { index, NULL, NULL, 0 };
+
+	_ykosx_walk(vendor_id, product_ids, pids_len, _ykosx_find, &f);
+	if (!f.yk && f.found >= 0)
+		yk_errno = YK_ENOKEY;
+	return f.yk;
+}
+
+struct ykosx_enum_st {
+	int vendor_id;
+	_ykusb_enum_cb cb;
+	void *userdata;
+};
+
+static int _ykosx_enum(IOHIDDeviceRef dev, long pid, void *ctx)
+{
+	struct ykosx_enum_st *e = ctx;
+	char path[YK_DEVICE_PATH_SIZE];
+
+	_ykosx_device_path(dev, path, sizeof(path));
+	return e->cb(e->userdata, (void *)dev, path, e->vendor_id, pid);
+}
+
+int _ykusb_enumerate(void *ctx, int vendor_id, int *product_ids,
+		     size_t pids_len, _ykusb_enum_cb cb, void *userdata)
+{
+	struct ykosx_enum_st e = { vendor_id, cb, userdata };
+
+	_ykosx_walk(vendor_id, product_ids, pids_len, _ykosx_enum, &e);
+	return 1;
+}
+
+void *_ykusb_open_entry(void *ctx, void *entry)
+{
+	return _ykosx_open((IOHIDDeviceRef)entry);
+}
+
+void *_ykusb_open_path(void *ctx, int vendor_id, int *product_ids,
+		       size_t pids_len, const char *path)
+{
+	struct ykosx_find_st f = { 0, path, NULL, 0 };
+
+	_ykosx_walk(vendor_id, product_ids, pids_len, _ykosx_find, &f);
+	if (!f.yk && f.found >= 0)
+		yk_errno = YK_ENOKEY;
+	return f.yk;
+}
+
 int _ykusb_close_device(void *dev)
 {
 	_ykusb_IOReturn = IOHIDDeviceClose( dev, 0L );
@@ -161,7 +239,8 @@ int _ykusb_close_device(void *dev)
 }
 
 int _ykusb_read(void *dev, int report_type, int report_number,
-		char *buffer, int size)
+		char *buffer, int size,
+		unsigned int timeout_ms)
 {
 	CFIndex sizecf = (CFIndex)size;
 
@@ -186,7 +265,8 @@ int _ykusb_read(void *dev, int report_type, int report_number,
 }
 
 int _ykusb_write(void *dev, int report_type, int report_number,
-		char *buffer, int size)
+		char *buffer, int size,
+		unsigned int timeout_ms)
 {
 	if (report_type != REPORT_TYPE_FEATURE)
 	{
@@ -212,7 +292,115 @@ int _ykusb_get_vid_pid(void *yk, int *vid, int *pid) {
 	return 1;
 }
 
-const char *_ykusb_strerror()
+int _ykusb_get_path(void *dev, char *path, size_t len)
+{
+	_ykosx_device_path((IOHIDDeviceRef)dev, path, len);
+	return 1;
+}
+
+/* There is no interface to claim here, so sessions are a no-op. */
+int _ykusb_begin_session(void *dev)
+{
+	return 1;
+}
+
+int _ykusb_end_session(void *dev)
+{
+	return 1;
+}
+
+int _ykusb_get_claim_counts(void *dev, unsigned long *claims,
+			    unsigned long *releases)
+{
+	*claims = 0;
+	*releases = 0;
+	return 1;
+}
+
+int _ykusb_submit_read(void *dev, int report_type, int report_number,
+		       char *buffer, int buffer_size,
+		       unsigned int timeout_ms,
+		       _ykusb_transfer_cb cb, void *userdata)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_submit_write(void *dev, int report_type, int report_number,
+			char *buffer, int buffer_size,
+			unsigned int timeout_ms,
+			_ykusb_transfer_cb cb, void *userdata)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_cancel_transfers(void *dev)
+{
+	/* Nothing is ever in flight */
+	return 1;
+}
+
+int _ykusb_get_pollfds(void *ctx, YK_POLLFD *fds, unsigned int max,
+		       unsigned int *count)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_get_next_timeout(void *ctx, long *timeout_us)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_handle_events(void *ctx, long timeout_us)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_hotplug_register(void *ctx, int vendor_id, int *product_ids,
+			    size_t pids_len, _ykusb_hotplug_cb cb,
+			    void *userdata)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_hotplug_deregister(void *ctx)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+void _ykusb_unref_entry(void *entry)
+{
+}
+
+int _ykusb_get_error(void *ctx)
+{
+	return _ykusb_IOReturn;
+}
+
+int _ykusb_error_class(void *ctx)
+{
+	switch (_ykusb_IOReturn) {
+	case kIOReturnBusy:
+	case kIOReturnExclusiveAccess:
+	case kIOReturnNotResponding:
+	case kIOReturnAborted:
+	case kIOReturnIOError:
+		return YKUSB_ERROR_TRANSIENT;
+	case kIOReturnNoDevice:
+	case kIOReturnNotAttached:
+		return YKUSB_ERROR_GONE;
+	default:
+		return YKUSB_ERROR_OTHER;
+	}
+}
+
+const char *_ykusb_strerror(void *ctx)
 {
 	switch (_ykusb_IOReturn) {
 		case kIOReturnSuccess:
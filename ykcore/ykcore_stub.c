@@ -34,19 +34,20 @@
 #include "ykdef.h"
 #include "ykcore_backend.h"
 
-int _ykusb_start(void)
+int _ykusb_start(void **ctx)
 {
 	yk_errno = YK_ENOTYETIMPL;
 	return 0;
 }
 
-int _ykusb_stop(void)
+int _ykusb_stop(void *ctx)
 {
 	yk_errno = YK_ENOTYETIMPL;
 	return 0;
 }
 
-void * _ykusb_open_device(int vendor_id, int *product_ids, size_t pids_len)
+void * _ykusb_open_device(void *ctx, int vendor_id, int *product_ids,
+			  size_t pids_len, int index)
 {
 	yk_errno = YK_ENOTYETIMPL;
 	return NULL;
@@ -58,15 +59,37 @@ int _ykusb_close_device(void *yk)
 	return 0;
 }
 
+int _ykusb_enumerate(void *ctx, int vendor_id, int *product_ids,
+		     size_t pids_len, _ykusb_enum_cb cb, void *userdata)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+void *_ykusb_open_entry(void *ctx, void *entry)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return NULL;
+}
+
+void *_ykusb_open_path(void *ctx, int vendor_id, int *product_ids,
+		       size_t pids_len, const char *path)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return NULL;
+}
+
 int _ykusb_read(void *dev, int report_type, int report_number,
-		char *buffer, int buffer_size)
+		char *buffer, int buffer_size,
+		unsigned int timeout_ms)
 {
 	yk_errno = YK_ENOTYETIMPL;
 	return 0;
 }
 
 int _ykusb_write(void *dev, int report_type, int report_number,
-		 char *buffer, int buffer_size)
+		 char *buffer, int buffer_size,
+		 unsigned int timeout_ms)
 {
 	yk_errno = YK_ENOTYETIMPL;
 	return 0;
@@ -78,7 +101,102 @@ int _ykusb_get_vid_pid(void *dev, int *vid, int *pid)
 	return 0;
 }
 
-const char *_ykusb_strerror(void)
+int _ykusb_get_path(void *dev, char *path, size_t len)
+{
+	return 0;
+}
+
+int _ykusb_begin_session(void *dev)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_end_session(void *dev)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_get_claim_counts(void *dev, unsigned long *claims,
+			    unsigned long *releases)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_submit_read(void *dev, int report_type, int report_number,
+		       char *buffer, int buffer_size,
+		       unsigned int timeout_ms,
+		       _ykusb_transfer_cb cb, void *userdata)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_submit_write(void *dev, int report_type, int report_number,
+			char *buffer, int buffer_size,
+			unsigned int timeout_ms,
+			_ykusb_transfer_cb cb, void *userdata)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_cancel_transfers(void *dev)
+{
+	/* Nothing is ever in flight */
+	return 1;
+}
+
+int _ykusb_get_pollfds(void *ctx, YK_POLLFD *fds, unsigned int max,
+		       unsigned int *count)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_get_next_timeout(void *ctx, long *timeout_us)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_handle_events(void *ctx, long timeout_us)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_hotplug_register(void *ctx, int vendor_id, int *product_ids,
+			    size_t pids_len, _ykusb_hotplug_cb cb,
+			    void *userdata)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_hotplug_deregister(void *ctx)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+void _ykusb_unref_entry(void *entry)
+{
+}
+
+int _ykusb_get_error(void *ctx)
+{
+	return 0;
+}
+
+int _ykusb_error_class(void *ctx)
+{
+	return YKUSB_ERROR_OTHER;
+}
+
+const char *_ykusb_strerror(void *ctx)
 {
 	yk_errno = YK_ENOTYETIMPL;
 	return 0;
@@ -34,42 +34,46 @@
 
 #define INITGUID
 #include <stdio.h>
+#include <string.h>
 #include <windows.h>
 #include <setupapi.h>
 #include <ntddkbd.h>
 #include <hidsdi.h>
 
-int _ykusb_start(void)
+int _ykusb_start(void **ctx)
 {
+	*ctx = NULL;
 	return 1;
 }
 
-int _ykusb_stop(void)
+int _ykusb_stop(void *ctx)
 {
 	return 1;
 }
 
-void * _ykusb_open_device(int vendor_id, int *product_ids, size_t pids_len, int index)
+/* Call fn with an open handle for every matching keyboard device, until it
+   returns 0. fn can keep the handle by setting *hp to NULL. */
+static int _ykwin_walk(int vendor_id, int *product_ids, size_t pids_len,
+		       int (*fn)(HANDLE *hp, const char *path, int pid, void *ctx),
+		       void *ctx)
 {
 	HDEVINFO hi;
 	SP_DEVICE_INTERFACE_DATA di;
 	PSP_DEVICE_INTERFACE_DETAIL_DATA pi;
-	int i, numDev = 0;
-	LPTSTR path = 0;
+	int i;
 	DWORD len, rc;
-	HANDLE ret_handle = NULL;
-	int found = 0;
-
-	yk_errno = YK_EUSBERR;
+	int cont = 1;
 
 	hi = SetupDiGetClassDevs(&GUID_DEVINTERFACE_KEYBOARD, 0, 0,
 				 DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
-	if (hi == INVALID_HANDLE_VALUE)
-		return NULL;
+	if (hi == INVALID_HANDLE_VALUE) {
+		yk_errno = YK_EUSBERR;
+		return 0;
+	}
 
 	di.cbSize = sizeof (SP_DEVICE_INTERFACE_DATA);
 
-	for (i = 0; i < 1000; i++) {
+	for (i = 0; i < 1000 && cont; i++) {
 		if (!SetupDiEnumDeviceInterfaces(hi, 0, &GUID_DEVINTERFACE_KEYBOARD, i, &di))
 			break;
 
@@ -78,8 +82,9 @@ void * _ykusb_open_device(int vendor_id, int *product_ids, size_t pids_len, int
 
 		pi = malloc (len);
 		if (!pi) {
+			SetupDiDestroyDeviceInfoList(hi);
 			yk_errno = YK_ENOMEM;
-			goto done;
+			return 0;
 		}
 		pi->cbSize = sizeof (SP_DEVICE_INTERFACE_DETAIL_DATA);
 
@@ -97,34 +102,99 @@ void * _ykusb_open_device(int vendor_id, int *product_ids, size_t pids_len, int
 						size_t j;
 						for (j = 0; j < pids_len; j++) {
 							if (devInfo.ProductID == product_ids[j]) {
-								found++;
-								if (found-1 == index) {
-									ret_handle = m_handle;
-									break;
-								}
+								cont = fn(&m_handle, pi->DevicePath,
+									  devInfo.ProductID, ctx);
+								break;
 							}
 						}
 					}
 				}
-			}
-			if(ret_handle == NULL) {
-				CloseHandle (m_handle);
-			} else {
-				break;
+				if (m_handle != NULL)
+					CloseHandle (m_handle);
 			}
 		}
 
 		free (pi);
 	}
-	if(ret_handle != NULL) {
-		goto done;
-	}
-
-	yk_errno = YK_ENOKEY;
 
-done:
 	SetupDiDestroyDeviceInfoList(hi);
-	return ret_handle;
+	return 1;
+}
+
+struct ykwin_find_st {
+	int index;
+	const char *path;
+	HANDLE h;
+	int found;
+};
+
+static int _ykwin_find(HANDLE *hp, const char *path, int pid, void *ctx)
+{
+	struct ykwin_find_st *f = ctx;
+
+	if (f->path) {
+		if (strcmp(path, f->path) != 0)
+			return 1;
+	} else if (f->found++ != f->index)
+		return 1;
+	f->h = *hp;
+	*hp = NULL;
+	return 0;
+}
+
+void * _ykusb_open_device(void *ctx, int vendor_id, int *product_ids,
+			  size_t pids_len, int index)
+{
+	struct ykwin_find_st f = { index, NULL, NULL, 0 };
+
+	if (!_ykwin_walk(vendor_id, product_ids, pids_len, _ykwin_find, &f))
+		return NULL;
+	if (f.h == NULL)
+		yk_errno = YK_ENOKEY;
+	return f.h;
+}
+
+struct ykwin_enum_st {
+	int vendor_id;
+	_ykusb_enum_cb cb;
+	void *userdata;
+};
+
+static int _ykwin_enum(HANDLE *hp, const char *path, int pid, void *ctx)
+{
+	struct ykwin_enum_st *e = ctx;
+
+	return e->cb(e->userdata, hp, path, e->vendor_id, pid);
+}
+
+int _ykusb_enumerate(void *ctx, int vendor_id, int *product_ids,
+		     size_t pids_len, _ykusb_enum_cb cb, void *userdata)
+{
+	struct ykwin_enum_st e = { vendor_id, cb, userdata };
+
+	return _ykwin_walk(vendor_id, product_ids, pids_len, _ykwin_enum, &e);
+}
+
+/* The walk already has the device open, hand over its handle. */
+void *_ykusb_open_entry(void *ctx, void *entry)
+{
+	HANDLE *hp = entry;
+	HANDLE h = *hp;
+
+	*hp = NULL;
+	return h;
+}
+
+void *_ykusb_open_path(void *ctx, int vendor_id, int *product_ids,
+		       size_t pids_len, const char *path)
+{
+	struct ykwin_find_st f = { 0, path, NULL, 0 };
+
+	if (!_ykwin_walk(vendor_id, product_ids, pids_len, _ykwin_find, &f))
+		return NULL;
+	if (f.h == NULL)
+		yk_errno = YK_ENOKEY;
+	return f.h;
 }
 
 int _ykusb_close_device(void *yk)
@@ -140,7 +210,8 @@ int _ykusb_close_device(void *yk)
 #define FEATURE_BUF_SIZE 9
 
 int _ykusb_read(void *dev, int report_type, int report_number,
-		char *buffer, int buffer_size)
+		char *buffer, int buffer_size,
+		unsigned int timeout_ms)
 {
 	HANDLE h = dev;
 	BYTE buf[FEATURE_BUF_SIZE];
@@ -163,7 +234,8 @@ int _ykusb_read(void *dev, int report_type, int report_number,
 }
 
 int _ykusb_write(void *dev, int report_type, int report_number,
-		 char *buffer, int buffer_size)
+		 char *buffer, int buffer_size,
+		 unsigned int timeout_ms)
 {
 	HANDLE h = dev;
 	BYTE buf[FEATURE_BUF_SIZE];
@@ -196,7 +268,113 @@ int _ykusb_get_vid_pid(void *yk, int *vid, int *pid) {
 	return 0;
 }
 
-const char *_ykusb_strerror(void)
+/* The handle doesn't tell which device interface it was opened from. */
+int _ykusb_get_path(void *dev, char *path, size_t len)
+{
+	return 0;
+}
+
+/* There is no interface to claim here, so sessions are a no-op. */
+int _ykusb_begin_session(void *dev)
+{
+	return 1;
+}
+
+int _ykusb_end_session(void *dev)
+{
+	return 1;
+}
+
+int _ykusb_get_claim_counts(void *dev, unsigned long *claims,
+			    unsigned long *releases)
+{
+	*claims = 0;
+	*releases = 0;
+	return 1;
+}
+
+int _ykusb_submit_read(void *dev, int report_type, int report_number,
+		       char *buffer, int buffer_size,
+		       unsigned int timeout_ms,
+		       _ykusb_transfer_cb cb, void *userdata)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_submit_write(void *dev, int report_type, int report_number,
+			char *buffer, int buffer_size,
+			unsigned int timeout_ms,
+			_ykusb_transfer_cb cb, void *userdata)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_cancel_transfers(void *dev)
+{
+	/* Nothing is ever in flight */
+	return 1;
+}
+
+int _ykusb_get_pollfds(void *ctx, YK_POLLFD *fds, unsigned int max,
+		       unsigned int *count)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_get_next_timeout(void *ctx, long *timeout_us)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_handle_events(void *ctx, long timeout_us)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_hotplug_register(void *ctx, int vendor_id, int *product_ids,
+			    size_t pids_len, _ykusb_hotplug_cb cb,
+			    void *userdata)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+int _ykusb_hotplug_deregister(void *ctx)
+{
+	yk_errno = YK_ENOTYETIMPL;
+	return 0;
+}
+
+void _ykusb_unref_entry(void *entry)
+{
+}
+
+int _ykusb_get_error(void *ctx)
+{
+	return GetLastError();
+}
+
+int _ykusb_error_class(void *ctx)
+{
+	switch (GetLastError()) {
+	case ERROR_BUSY:
+	case ERROR_GEN_FAILURE:
+	case ERROR_SEM_TIMEOUT:
+		return YKUSB_ERROR_TRANSIENT;
+	case ERROR_DEVICE_NOT_CONNECTED:
+	case ERROR_BAD_COMMAND:
+		return YKUSB_ERROR_GONE;
+	default:
+		return YKUSB_ERROR_OTHER;
+	}
+}
+
+const char *_ykusb_strerror(void *ctx)
 {
 	static char buf[1024];
 	FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(), 0,
@@ -0,0 +1,315 @@
+/* -*- mode:C; c-file-style: "bsd" -*- */
+/*
+ * Copyright (c) 2017 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The CRC16 of frames, configurations and responses.
+ *
+ * This is the CCITT polynomial bit reversed (0x8408), starting from 0xffff
+ * with no final inversion, the same as yubikey_crc16() of libyubikey which
+ * works one bit at a time. There are three ways to compute it here, one is
+ * picked the first time a CRC is taken:
+ *
+ *  - bit by bit, as libyubikey does;
+ *  - slicing-by-8, eight tables of 256 entries taking eight bytes a step;
+ *  - carry-less multiplication on x86 CPUs with PCLMULQDQ, folding 16 bytes
+ *    a step. The CRC16 is run as a CRC32 with the polynomial P(x)·x^16,
+ *    which leaves it in the low half of the register, so the folding and
+ *    Barrett reduction of the usual CRC32 code apply as they are. Whatever
+ *    is left of the buffer after the last fold goes through the tables.
+ */
+
+#include "ykcore_lcl.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define YK_CRC_PCLMUL
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#define YK_CRC_POLY		0x8408
+/* The folds need one 16 byte block, from there on they keep up with the
+   tables even for a single block */
+#define YK_CRC_PCLMUL_MIN	16
+
+static uint16_t crc_tab[8][256];
+static int crc_impl = YK_CRC16_AUTO;
+static int crc_have_pclmul;
+static yk__ONCE_T crc_once = yk__ONCE_INITIALIZER;
+
+static uint16_t _yk_crc16_bitwise(uint16_t crc, const uint8_t *buf, size_t len)
+{
+	int i;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 1) ? (crc >> 1) ^ YK_CRC_POLY : crc >> 1;
+	}
+	return crc;
+}
+
+static uint16_t _yk_crc16_slice8(uint16_t crc, const uint8_t *buf, size_t len)
+{
+	while (len >= 8) {
+		crc ^= buf[0] | (buf[1] << 8);
+		crc = crc_tab[7][crc & 0xff] ^ crc_tab[6][crc >> 8] ^
+			crc_tab[5][buf[2]] ^ crc_tab[4][buf[3]] ^
+			crc_tab[3][buf[4]] ^ crc_tab[2][buf[5]] ^
+			crc_tab[1][buf[6]] ^ crc_tab[0][buf[7]];
+		buf += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc >> 8) ^ crc_tab[0][(crc ^ *buf++) & 0xff];
+	return crc;
+}
+
+#ifdef YK_CRC_PCLMUL
+/* Folding constants, all bit reflected: r1/r2 fold 512 bits ahead, r3/r4
+   128 bits, r5 64 bits, then the polynomial and its Barrett quotient
+   x^64 / P for the last step. */
+static struct {
+	uint64_t r1, r2, r3, r4, r5, poly, mu;
+} crc_k;
+
+/* P(x)·x^16 without the x^32 term, most significant bit first */
+#define YK_CRC_POLY32		0x10210000
+
+static uint64_t _yk_reflect(uint64_t v, int bits)
+{
+	uint64_t r = 0;
+	int i;
+
+	for (i = 0; i < bits; i++)
+		if (v & ((uint64_t)1 << i))
+			r |= (uint64_t)1 << (bits - 1 - i);
+	return r;
+}
+
+/* x^n mod P32, reflected and shifted as pclmulqdq wants it */
+static uint64_t _yk_crc_xpow(unsigned int n)
+{
+	uint32_t r = 1;
+
+	while (n--)
+		r = (r << 1) ^ ((r & 0x80000000) ? YK_CRC_POLY32 : 0);
+	return _yk_reflect(r, 32) << 1;
+}
+
+static void _yk_crc_pclmul_init(void)
+{
+	const uint64_t p = ((uint64_t)1 << 32) | YK_CRC_POLY32;
+	uint64_t t, q;
+	int d;
+
+	crc_k.r1 = _yk_crc_xpow(4 * 128 + 32);
+	crc_k.r2 = _yk_crc_xpow(4 * 128 - 32);
+	crc_k.r3 = _yk_crc_xpow(128 + 32);
+	crc_k.r4 = _yk_crc_xpow(128 - 32);
+	crc_k.r5 = _yk_crc_xpow(64);
+	crc_k.poly = _yk_reflect(p, 33);
+
+	/* x^64 / P32 by long division. The first step, for x^64 itself,
+	   would not fit in t and is done here. */
+	q = (uint64_t)1 << 32;
+	t = (p & 0xffffffff) << 32;
+	for (d = 63; d >= 32; d--) {
+		if (t & ((uint64_t)1 << d)) {
+			q |= (uint64_t)1 << (d - 32);
+			t ^= p << (d - 32);
+		}
+	}
+	crc_k.mu = _yk_reflect(q, 33);
+}
+
+static int _yk_crc_cpu_has_pclmul(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ecx & bit_PCLMUL) && (edx & bit_SSE2);
+}
+
+#define YK_CRC_FOLD(x, k, next)						\
+	_mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),	\
+				    _mm_clmulepi64_si128(x, k, 0x11)),	\
+		      next)
+
+__attribute__((target("pclmul,sse2")))
+static uint16_t _yk_crc16_pclmul(uint16_t crc, const uint8_t *buf, size_t len)
+{
+	const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+	__m128i k, x1, x2, x3, x4;
+
+	if (len < YK_CRC_PCLMUL_MIN)
+		return _yk_crc16_slice8(crc, buf, len);
+
+	x1 = _mm_loadu_si128((const __m128i *)buf);
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	buf += 16;
+	len -= 16;
+
+	k = _mm_set_epi64x(crc_k.r4, crc_k.r3);
+	if (len >= 48) {
+		const __m128i k4 = _mm_set_epi64x(crc_k.r2, crc_k.r1);
+
+		x2 = _mm_loadu_si128((const __m128i *)(buf + 0));
+		x3 = _mm_loadu_si128((const __m128i *)(buf + 16));
+		x4 = _mm_loadu_si128((const __m128i *)(buf + 32));
+		buf += 48;
+		len -= 48;
+		while (len >= 64) {
+			x1 = YK_CRC_FOLD(x1, k4, _mm_loadu_si128((const __m128i *)(buf + 0)));
+			x2 = YK_CRC_FOLD(x2, k4, _mm_loadu_si128((const __m128i *)(buf + 16)));
+			x3 = YK_CRC_FOLD(x3, k4, _mm_loadu_si128((const __m128i *)(buf + 32)));
+			x4 = YK_CRC_FOLD(x4, k4, _mm_loadu_si128((const __m128i *)(buf + 48)));
+			buf += 64;
+			len -= 64;
+		}
+		x1 = YK_CRC_FOLD(x1, k, x2);
+		x1 = YK_CRC_FOLD(x1, k, x3);
+		x1 = YK_CRC_FOLD(x1, k, x4);
+	}
+	while (len >= 16) {
+		x1 = YK_CRC_FOLD(x1, k, _mm_loadu_si128((const __m128i *)buf));
+		buf += 16;
+		len -= 16;
+	}
+
+	/* 128 bits down to 64 */
+	x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, _mm_set_epi64x(0, crc_k.r5), 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits, of which the CRC16 is the low half */
+	k = _mm_set_epi64x(crc_k.mu, crc_k.poly);
+	x2 = x1;
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x10);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	crc = (uint16_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+
+	return _yk_crc16_slice8(crc, buf, len);
+}
+#endif
+
+static void _yk_crc16_init(void)
+{
+	uint16_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ YK_CRC_POLY : c >> 1;
+		crc_tab[0][i] = c;
+	}
+	for (i = 0; i < 256; i++) {
+		c = crc_tab[0][i];
+		for (j = 1; j < 8; j++) {
+			c = (c >> 8) ^ crc_tab[0][c & 0xff];
+			crc_tab[j][i] = c;
+		}
+	}
+
+#ifdef YK_CRC_PCLMUL
+	if (_yk_crc_cpu_has_pclmul()) {
+		_yk_crc_pclmul_init();
+		crc_have_pclmul = 1;
+	}
+#endif
+}
+
+static int _yk_crc16_resolve(int impl)
+{
+	if (impl != YK_CRC16_AUTO)
+		return impl;
+	return crc_have_pclmul ? YK_CRC16_PCLMUL : YK_CRC16_SLICE8;
+}
+
+/* Continue a CRC over more data, starting from 0xffff. Feeding a buffer
+   in pieces gives the same result as yk_crc16() over all of it. */
+uint16_t yk_crc16_update(uint16_t crc, const uint8_t *buf, size_t len)
+{
+	yk__once(crc_once, _yk_crc16_init);
+
+	switch (_yk_crc16_resolve(crc_impl)) {
+	case YK_CRC16_BITWISE:
+		return _yk_crc16_bitwise(crc, buf, len);
+#ifdef YK_CRC_PCLMUL
+	case YK_CRC16_PCLMUL:
+		return _yk_crc16_pclmul(crc, buf, len);
+#endif
+	default:
+		return _yk_crc16_slice8(crc, buf, len);
+	}
+}
+
+uint16_t yk_crc16(const uint8_t *buf, size_t len)
+{
+	return yk_crc16_update(0xffff, buf, len);
+}
+
+int yk_crc16_set_impl(int impl)
+{
+	yk__once(crc_once, _yk_crc16_init);
+
+	switch (impl) {
+	case YK_CRC16_AUTO:
+	case YK_CRC16_BITWISE:
+	case YK_CRC16_SLICE8:
+		break;
+	case YK_CRC16_PCLMUL:
+		if (!crc_have_pclmul) {
+			yk_errno = YK_ENOTYETIMPL;
+			return 0;
+		}
+		break;
+	default:
+		yk_errno = YK_EINVAL;
+		return 0;
+	}
+	crc_impl = impl;
+	return 1;
+}
+
+int yk_crc16_get_impl(void)
+{
+	yk__once(crc_once, _yk_crc16_init);
+
+	return _yk_crc16_resolve(crc_impl);
+}
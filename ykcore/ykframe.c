@@ -0,0 +1,264 @@
+/* -*- mode:C; c-file-style: "bsd" -*- */
+/*
+ * Copyright (c) 2017 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Frames: the encoding of a command into the feature reports written to
+ * the key.
+ *
+ * Besides the framing done on every write, a frame can be encoded ahead
+ * of time into a plan: the reports to write, with their sequence numbers
+ * set and the all-zero ones already left out. A plan can be saved as a
+ * few dozen bytes and loaded again, so a station programming many keys
+ * from configurations generated beforehand has nothing left to encode
+ * when a key is plugged in. Saved plans look like this:
+ *
+ *   format (1)  command (1)  reports (1)  reports * 8 bytes
+ *
+ * and are checked on loading by putting the frame back together and
+ * verifying its checksum.
+ */
+
+#include "ykcore_lcl.h"
+
+#include <string.h>
+
+#define YK_FRAME_PLAN_FORMAT	1
+#define YK_FRAME_PLAN_HEADER	3
+
+/*
+ * Build the feature reports needed to send a command to the YubiKey. The
+ * data is put in a frame together with the slot and a checksum, and chopped
+ * up into parts that fit in the payload of a feature report. The sequence
+ * number | 0x80 is set in the last byte of each report; when the Yubikey has
+ * processed the report it clears this byte, signaling that the next part can
+ * be sent. Parts that are all zeroes, except the first and last, are left out
+ * to speed up the transfer.
+ *
+ * Returns the number of reports put in 'reports', 0 on error.
+ */
+int _yk_frame_reports(uint8_t slot, const void *buf, int bufcount,
+		      unsigned char reports[][FEATURE_RPT_SIZE])
+{
+	YK_FRAME frame;
+	int i, seq, n = 0;
+	unsigned char *ptr, *end;
+
+	if (bufcount > sizeof(frame.payload)) {
+		yk_errno = YK_EWRONGSIZ;
+		return 0;
+	}
+
+	/* Insert data and set slot # */
+
+	memset(&frame, 0, sizeof(frame));
+	memcpy(frame.payload, buf, bufcount);
+	frame.slot = slot;
+
+	/* Append slot checksum */
+
+	i = yk_crc16(frame.payload, sizeof(frame.payload));
+	frame.crc = yk_endian_swap_16(i);
+
+	ptr = (unsigned char *) &frame;
+	end = (unsigned char *) &frame + sizeof(frame);
+
+	for (seq = 0; ptr < end; seq++) {
+		unsigned char *repbuf = reports[n];
+		int all_zeros = 1;
+
+		for (i = 0; i < (FEATURE_RPT_SIZE - 1); i++) {
+			if ((repbuf[i] = *ptr++)) all_zeros = 0;
+		}
+		if (all_zeros && (seq > 0) && (ptr < end))
+			continue;
+
+		/* sequence number goes into lower bits of last byte */
+		repbuf[i] = seq | SLOT_WRITE_FLAG;
+		n++;
+	}
+
+	return n;
+}
+
+void _yk_config_payload(YK_CONFIG *cfg, const unsigned char *acc_code,
+			unsigned char buf[sizeof(YK_CONFIG) + ACC_CODE_SIZE])
+{
+	/* Update checksum and insert config block in buffer if present */
+
+	memset(buf, 0, sizeof(YK_CONFIG) + ACC_CODE_SIZE);
+
+	if (cfg) {
+		cfg->crc = ~yk_crc16((unsigned char *) cfg,
+				     sizeof(YK_CONFIG) - sizeof(cfg->crc));
+		cfg->crc = yk_endian_swap_16(cfg->crc);
+		memcpy(buf, cfg, sizeof(YK_CONFIG));
+	}
+
+	/* Append current access code if present */
+
+	if (acc_code)
+		memcpy(buf + sizeof(YK_CONFIG), acc_code, ACC_CODE_SIZE);
+}
+
+YK_FRAME_PLAN *yk_frame_plan_new(uint8_t command, const void *buf,
+				 int bufcount)
+{
+	YK_FRAME_PLAN *plan;
+
+	if (!(plan = malloc(sizeof(YK_FRAME_PLAN)))) {
+		yk_errno = YK_ENOMEM;
+		return NULL;
+	}
+	plan->command = command;
+	plan->nreports = _yk_frame_reports(command, buf, bufcount,
+					   plan->reports);
+	if (plan->nreports == 0) {
+		free(plan);
+		return NULL;
+	}
+	return plan;
+}
+
+YK_FRAME_PLAN *yk_frame_plan_config(YK_CONFIG *cfg, uint8_t command,
+				    unsigned char *acc_code)
+{
+	unsigned char buf[sizeof(YK_CONFIG) + ACC_CODE_SIZE];
+
+	_yk_config_payload(cfg, acc_code, buf);
+	return yk_frame_plan_new(command, buf, sizeof(buf));
+}
+
+YK_FRAME_PLAN *yk_frame_plan_ndef(YK_NDEF *ndef, int confnum)
+{
+	uint8_t command;
+
+	switch(confnum) {
+		case 1:
+			command = SLOT_NDEF;
+			break;
+		case 2:
+			command = SLOT_NDEF2;
+			break;
+		default:
+			yk_errno = YK_EINVALIDCMD;
+			return NULL;
+	}
+	return yk_frame_plan_new(command, ndef, sizeof(YK_NDEF));
+}
+
+YK_FRAME_PLAN *yk_frame_plan_device_config(YK_DEVICE_CONFIG *device_config)
+{
+	return yk_frame_plan_new(SLOT_DEVICE_CONFIG, device_config,
+				 sizeof(YK_DEVICE_CONFIG));
+}
+
+void yk_frame_plan_free(YK_FRAME_PLAN *plan)
+{
+	free(plan);
+}
+
+/* Save a plan in buf, its size is put in *len. With buf NULL only the
+ * size is given, it is never more than YK_FRAME_PLAN_MAX_SIZE.
+ */
+int yk_frame_plan_save(const YK_FRAME_PLAN *plan, unsigned char *buf,
+		       size_t bufsize, size_t *len)
+{
+	size_t need = YK_FRAME_PLAN_HEADER +
+		(size_t)plan->nreports * FEATURE_RPT_SIZE;
+
+	if (len)
+		*len = need;
+	if (!buf)
+		return 1;
+	if (bufsize < need) {
+		yk_errno = YK_EWRONGSIZ;
+		return 0;
+	}
+	buf[0] = YK_FRAME_PLAN_FORMAT;
+	buf[1] = plan->command;
+	buf[2] = plan->nreports;
+	memcpy(buf + YK_FRAME_PLAN_HEADER, plan->reports,
+	       plan->nreports * FEATURE_RPT_SIZE);
+	return 1;
+}
+
+/* Load a plan saved by yk_frame_plan_save(). Fails with YK_EINVAL if buf
+ * does not hold a plan and with YK_ECHECKSUM if the frame it makes up has
+ * the wrong checksum.
+ */
+YK_FRAME_PLAN *yk_frame_plan_load(const unsigned char *buf, size_t len)
+{
+	YK_FRAME frame;
+	YK_FRAME_PLAN *plan;
+	const unsigned char *rep;
+	int i, n, seq, last = -1;
+
+	if (len < YK_FRAME_PLAN_HEADER || buf[0] != YK_FRAME_PLAN_FORMAT)
+		goto invalid;
+	n = buf[2];
+	if (n < 1 || n > (int)YK_FRAME_REPORTS ||
+	    len != YK_FRAME_PLAN_HEADER + (size_t)n * FEATURE_RPT_SIZE)
+		goto invalid;
+
+	/* Put the frame back together, the reports left out being zero.
+	 * The first and the last report are always there, and the sequence
+	 * numbers go up. */
+	memset(&frame, 0, sizeof(frame));
+	rep = buf + YK_FRAME_PLAN_HEADER;
+	for (i = 0; i < n; i++, rep += FEATURE_RPT_SIZE) {
+		seq = rep[FEATURE_RPT_SIZE - 1] ^ SLOT_WRITE_FLAG;
+		if (seq <= last || seq >= (int)YK_FRAME_REPORTS ||
+		    (i == 0 && seq != 0))
+			goto invalid;
+		memcpy((unsigned char *)&frame + seq * (FEATURE_RPT_SIZE - 1),
+		       rep, FEATURE_RPT_SIZE - 1);
+		last = seq;
+	}
+	if (last != (int)YK_FRAME_REPORTS - 1 || frame.slot != buf[1])
+		goto invalid;
+	if (yk_crc16(frame.payload, sizeof(frame.payload)) !=
+	    yk_endian_swap_16(frame.crc)) {
+		yk_errno = YK_ECHECKSUM;
+		return NULL;
+	}
+
+	if (!(plan = malloc(sizeof(YK_FRAME_PLAN)))) {
+		yk_errno = YK_ENOMEM;
+		return NULL;
+	}
+	plan->command = buf[1];
+	plan->nreports = n;
+	memcpy(plan->reports, buf + YK_FRAME_PLAN_HEADER, n * FEATURE_RPT_SIZE);
+	return plan;
+
+ invalid:
+	yk_errno = YK_EINVAL;
+	return NULL;
+}
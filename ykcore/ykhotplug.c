@@ -0,0 +1,289 @@
+/* -*- mode:C; c-file-style: "bsd" -*- */
+/*
+ * Copyright (c) 2017 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Registry of attached keys, kept up to date by backend hotplug events.
+ *
+ * The backend reports events from inside its event handling, where keys
+ * must not be talked to. They are queued here and processed once the
+ * backend returns, which is also where keys are opened for details.
+ */
+
+#include "ykcore_lcl.h"
+#include "ykcore_backend.h"
+
+#include <stdio.h>
+#include <string.h>
+
+struct yk_hotplug_event_st {
+	struct yk_hotplug_event_st *next;
+	int event;
+	void *entry;
+	char path[YK_DEVICE_PATH_SIZE];
+	int vendor_id;
+	int product_id;
+};
+
+/* The registry of one context, allocated while registered */
+struct yk_hotplug_st {
+	yk_hotplug_cb cb;
+	void *userdata;
+	unsigned int flags;
+
+	YK_DEVICE_INFO *devices;
+	size_t count;
+	size_t size;
+
+	struct yk_hotplug_event_st *head, *tail;
+};
+
+static void _yk_hotplug_queue(void *userdata, int event, void *entry,
+			      const char *path, int vendor_id, int product_id)
+{
+	struct yk_hotplug_st *r = ((YK_CONTEXT *)userdata)->hotplug;
+	struct yk_hotplug_event_st *ev = calloc(1, sizeof(*ev));
+
+	/* Nothing better to do than to miss the event */
+	if (!ev) {
+		_ykusb_unref_entry(entry);
+		return;
+	}
+	ev->event = event;
+	ev->entry = entry;
+	snprintf(ev->path, sizeof(ev->path), "%s", path);
+	ev->vendor_id = vendor_id;
+	ev->product_id = product_id;
+
+	if (r->tail)
+		r->tail->next = ev;
+	else
+		r->head = ev;
+	r->tail = ev;
+}
+
+static struct yk_hotplug_event_st *_yk_hotplug_pop(struct yk_hotplug_st *r)
+{
+	struct yk_hotplug_event_st *ev = r->head;
+
+	if (ev) {
+		r->head = ev->next;
+		if (!r->head)
+			r->tail = NULL;
+	}
+	return ev;
+}
+
+static YK_DEVICE_INFO *_yk_hotplug_find(struct yk_hotplug_st *r,
+					const char *path)
+{
+	size_t i;
+
+	for (i = 0; i < r->count; i++)
+		if (strcmp(r->devices[i].path, path) == 0)
+			return &r->devices[i];
+	return NULL;
+}
+
+static int _yk_hotplug_arrived(YK_CONTEXT *ctx,
+			       struct yk_hotplug_event_st *ev,
+			       YK_DEVICE_INFO *info)
+{
+	struct yk_hotplug_st *r = ctx->hotplug;
+
+	if (_yk_hotplug_find(r, ev->path))
+		return 0;
+
+	if (r->count == r->size) {
+		size_t size = r->size ? r->size * 2 : 8;
+		YK_DEVICE_INFO *devices = realloc(r->devices,
+						  size * sizeof(*devices));
+
+		if (!devices)
+			return 0;
+		r->devices = devices;
+		r->size = size;
+	}
+
+	memset(info, 0, sizeof(*info));
+	info->index = -1;
+	snprintf(info->path, sizeof(info->path), "%s", ev->path);
+	info->vendor_id = ev->vendor_id;
+	info->product_id = ev->product_id;
+	info->family = _yk_product_family(ev->product_id);
+	if (r->flags & YK_ENUM_DETAILS)
+		_yk_device_details(ctx, info, ev->entry);
+
+	r->devices[r->count++] = *info;
+	return 1;
+}
+
+static int _yk_hotplug_left(struct yk_hotplug_st *r,
+			    struct yk_hotplug_event_st *ev,
+			    YK_DEVICE_INFO *info)
+{
+	YK_DEVICE_INFO *found = _yk_hotplug_find(r, ev->path);
+
+	if (!found)
+		return 0;
+	*info = *found;
+	*found = r->devices[--r->count];
+	return 1;
+}
+
+void _yk_hotplug_dispatch(YK_CONTEXT *ctx)
+{
+	struct yk_hotplug_event_st *ev;
+	int errsave = yk_errno;
+
+	/* The callback may deregister, which drops the rest of the queue */
+	while (ctx->hotplug && (ev = _yk_hotplug_pop(ctx->hotplug))) {
+		struct yk_hotplug_st *r = ctx->hotplug;
+		YK_DEVICE_INFO info;
+		int report;
+
+		if (ev->event == YKUSB_HOTPLUG_ARRIVED)
+			report = _yk_hotplug_arrived(ctx, ev, &info);
+		else
+			report = _yk_hotplug_left(r, ev, &info);
+		_ykusb_unref_entry(ev->entry);
+
+		if (report && r->cb)
+			r->cb(ev->event == YKUSB_HOTPLUG_ARRIVED ?
+			      YK_HOTPLUG_ARRIVED : YK_HOTPLUG_LEFT,
+			      &info, r->userdata);
+		free(ev);
+	}
+	/* errors reading details of single keys are not reported */
+	yk_errno = errsave;
+}
+
+static void _yk_hotplug_free(YK_CONTEXT *ctx)
+{
+	struct yk_hotplug_st *r = ctx->hotplug;
+	struct yk_hotplug_event_st *ev;
+
+	while ((ev = _yk_hotplug_pop(r))) {
+		_ykusb_unref_entry(ev->entry);
+		free(ev);
+	}
+	free(r->devices);
+	free(r);
+	ctx->hotplug = NULL;
+}
+
+int yk_hotplug_register(yk_hotplug_cb cb, void *userdata, unsigned int flags)
+{
+	return yk_context_hotplug_register(_yk_default_context(), cb, userdata,
+					   flags);
+}
+
+int yk_context_hotplug_register(YK_CONTEXT *ctx, yk_hotplug_cb cb,
+				void *userdata, unsigned int flags)
+{
+	int pids[YK_NPRODUCTS];
+
+	if (!ctx) {
+		yk_errno = YK_EINVAL;
+		return 0;
+	}
+	if (ctx->hotplug) {
+		yk_errno = YK_EINVALIDCMD;
+		return 0;
+	}
+	/* In place before registering, the keys already attached are
+	   queued from in there */
+	ctx->hotplug = calloc(1, sizeof(struct yk_hotplug_st));
+	if (!ctx->hotplug) {
+		yk_errno = YK_ENOMEM;
+		return 0;
+	}
+	ctx->hotplug->cb = cb;
+	ctx->hotplug->userdata = userdata;
+	ctx->hotplug->flags = flags;
+
+	_yk_product_ids(pids);
+	if (!_ykusb_hotplug_register(ctx->usb, YUBICO_VID, pids, YK_NPRODUCTS,
+				     _yk_hotplug_queue, ctx)) {
+		_yk_hotplug_free(ctx);
+		return 0;
+	}
+
+	/* Report the keys that are already there */
+	_yk_hotplug_dispatch(ctx);
+	return 1;
+}
+
+int yk_hotplug_deregister(void)
+{
+	return yk_context_hotplug_deregister(_yk_default_context());
+}
+
+int yk_context_hotplug_deregister(YK_CONTEXT *ctx)
+{
+	if (!ctx || !ctx->hotplug) {
+		yk_errno = ctx ? YK_EINVALIDCMD : YK_EINVAL;
+		return 0;
+	}
+	_ykusb_hotplug_deregister(ctx->usb);
+	_yk_hotplug_free(ctx);
+	return 1;
+}
+
+int yk_hotplug_get_devices(YK_DEVICE_INFO **list, size_t *count)
+{
+	return yk_context_hotplug_get_devices(_yk_default_context(), list,
+					      count);
+}
+
+int yk_context_hotplug_get_devices(YK_CONTEXT *ctx, YK_DEVICE_INFO **list,
+				   size_t *count)
+{
+	struct yk_hotplug_st *r;
+
+	if (!ctx || !list || !count) {
+		yk_errno = YK_EINVAL;
+		return 0;
+	}
+	if (!(r = ctx->hotplug)) {
+		yk_errno = YK_EINVALIDCMD;
+		return 0;
+	}
+	*list = NULL;
+	*count = r->count;
+	if (r->count == 0)
+		return 1;
+	*list = malloc(r->count * sizeof(YK_DEVICE_INFO));
+	if (!*list) {
+		yk_errno = YK_ENOMEM;
+		return 0;
+	}
+	memcpy(*list, r->devices, r->count * sizeof(YK_DEVICE_INFO));
+	return 1;
+}
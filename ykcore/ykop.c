@@ -0,0 +1,825 @@
+/* -*- mode:C; c-file-style: "bsd" -*- */
+/*
+ * Copyright (c) 2017 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Non-blocking versions of the protocol exchanges in ykcore.c.
+ *
+ * An operation is a small state machine. Every state either submits one
+ * asynchronous feature report transfer or waits for the time of the next
+ * status poll; the transfer callback moves the machine on to the next
+ * state. Nothing in here ever sleeps.
+ */
+
+#include "ykcore_lcl.h"
+#include "ykcore_backend.h"
+#include "yktime.h"
+
+#include <string.h>
+
+/* Where an operation is in the protocol */
+#define OP_QUEUED	0	/* waiting for another operation on the key */
+#define OP_STATUS	1	/* read status to get the programming sequence */
+#define OP_WAIT		2	/* poll status until the key is ready */
+#define OP_WRITE	3	/* write the next report of the frame */
+#define OP_READ		4	/* read the next report of the response */
+#define OP_RESET	5	/* write a dummy report to reset read mode */
+#define OP_VERIFY	6	/* verify a configuration write from the status */
+#define OP_FINISHED	7
+
+/* What kind of exchange the operation is */
+#define OP_KIND_WRITE		0	/* configuration write, no response */
+#define OP_KIND_RESPONSE	1	/* command with a response */
+
+/* Response buffer, big enough for any response plus the CRC */
+#define OP_RESPONSE_SIZE	(SHA1_DIGEST_SIZE + 2 + FEATURE_RPT_SIZE)
+
+/* How often a queued operation looks again at a key another thread has
+   locked, see yk_set_locking() */
+#define OP_LOCK_RETRY_US	1000
+
+struct yk_op_st {
+	YK_CONTEXT *ctx;	/* of the key, whose list the operation is on */
+	YK_KEY *yk;
+	int kind;
+	int state;
+	int result;		/* YK_OP_* */
+	int err;		/* yk_errno for a failed operation */
+	int inflight;		/* a transfer is submitted */
+	int freed;		/* yk_op_free() called */
+	int abandoned;		/* freed, the key reset is submitted */
+	int notified;		/* completion callback has been called */
+	uint8_t slot;
+	unsigned int flags;
+
+	void (*cb)(YK_OP *op, void *userdata);
+	void *userdata;
+
+	/* The frame to write */
+	unsigned char reports[YK_FRAME_REPORTS][FEATURE_RPT_SIZE];
+	int nreports;
+	int report;
+
+	/* Buffer for the transfer in flight */
+	unsigned char data[FEATURE_RPT_SIZE];
+	int writing;
+	uint64_t submitted;
+	uint64_t started;	/* when the operation got the key */
+	uint64_t lock_wait;	/* since when the key was locked, or 0 */
+
+	/* Status polling, see _yk_op_wait() */
+	int wait_next;
+	bool wait_set;
+	unsigned char wait_mask;
+	uint64_t wait_start;
+	uint64_t wait_max;
+	uint64_t next_poll;
+	unsigned int poll_interval;
+	int blocking;
+	int wait_kind;		/* YK_TIMING_*, or -1 for an untimed wait */
+	uint64_t wait_first;	/* first poll placed by the timing profile */
+	uint64_t wait_missed;	/* last poll that found the key busy */
+	unsigned int wait_polls;
+
+	/* The response */
+	unsigned char response[OP_RESPONSE_SIZE];
+	unsigned int response_len;
+	unsigned int expect_bytes;
+	int pgm_seq;
+	int final_result;	/* result once read mode is reset */
+
+	YK_OP *next;
+};
+
+static void _yk_op_advance(YK_OP *op);
+static void _yk_op_verify_done(YK_OP *op);
+static int _yk_op_submit_reset(YK_OP *op);
+
+static void _yk_op_unlink(YK_OP *op)
+{
+	YK_OP **p;
+
+	for (p = &op->ctx->ops; *p; p = &(*p)->next) {
+		if (*p == op) {
+			*p = op->next;
+			break;
+		}
+	}
+	op->next = NULL;
+}
+
+static YK_OP *_yk_op_new(YK_KEY *yk, int kind, uint8_t slot,
+			 const void *buf, int bufcount)
+{
+	YK_OP *op = calloc(1, sizeof(YK_OP));
+	YK_OP **p;
+
+	if (!op) {
+		yk_errno = YK_ENOMEM;
+		return NULL;
+	}
+	op->ctx = yk->ctx;
+	op->yk = yk;
+	op->kind = kind;
+	op->slot = slot;
+	op->state = OP_QUEUED;
+	op->result = YK_OP_PENDING;
+	op->nreports = _yk_frame_reports(slot, buf, bufcount, op->reports);
+	if (op->nreports == 0) {
+		free(op);
+		return NULL;
+	}
+	yk->stats.skipped_reports += YK_FRAME_REPORTS - op->nreports;
+
+	for (p = &yk->ctx->ops; *p; p = &(*p)->next)
+		;
+	*p = op;
+	return op;
+}
+
+/* The completion callback is not called from here but from
+   _yk_op_notify(), so that a callback freeing the operation never pulls
+   it away from under the transfer handling. */
+static void _yk_op_finish(YK_OP *op, int result)
+{
+	YK_KEY *yk = op->yk;
+
+	op->state = OP_FINISHED;
+	op->result = result;
+	if (yk->op == op) {
+		_ykusb_end_session(yk->dev);
+		_yk_op_unlock_key(yk);
+		yk->op = NULL;
+		_yk_stats_add(&yk->stats.ops, yk__now_us() - op->started);
+	}
+}
+
+/* The end of an operation freed while it had the key, once nothing of it
+   is in flight. The key may be in the middle of a frame or a response, so
+   it gets a dummy report as from yk_force_key_update() before the next
+   operation can have it. */
+static void _yk_op_abandon(YK_OP *op)
+{
+	if (op->yk->op == op && !op->abandoned) {
+		op->abandoned = 1;
+		op->state = OP_RESET;
+		if (_yk_op_submit_reset(op)) {
+			op->inflight = 1;
+			return;
+		}
+	}
+	_yk_op_finish(op, YK_OP_FAILED);
+	free(op);
+}
+
+static void _yk_op_notify(YK_OP *op)
+{
+	if (op->state == OP_FINISHED && !op->notified) {
+		op->notified = 1;
+		if (op->cb)
+			op->cb(op, op->userdata);
+	}
+}
+
+static void _yk_op_fail(YK_OP *op, int err)
+{
+	op->err = err;
+	_yk_op_finish(op, YK_OP_FAILED);
+}
+
+/* Reset read mode of the key, then finish with 'result'. */
+static void _yk_op_reset(YK_OP *op, int result, int err)
+{
+	op->final_result = result;
+	op->err = err;
+	op->state = OP_RESET;
+}
+
+/* Start polling status until the key sets (wait_set) or clears the bits in
+   mask, then go on to state 'next'. Same schedule as yk_wait_for_key_status(),
+   the waits for a frame to be done being timed like there. */
+static void _yk_op_wait(YK_OP *op, bool wait_set, unsigned char mask,
+			unsigned int max_time_ms, int next)
+{
+	YK_KEY *yk = op->yk;
+
+	op->state = OP_WAIT;
+	op->wait_next = next;
+	op->wait_set = wait_set;
+	op->wait_mask = mask;
+	op->wait_start = yk__now_us();
+	op->wait_max = (uint64_t)max_time_ms * 1000;
+	op->blocking = 0;
+	if (yk->poll_policy == YK_POLL_LEGACY)
+		op->poll_interval = 1000;
+	else
+		op->poll_interval = yk->poll_interval_us;
+
+	op->wait_kind = -1;
+	op->wait_first = 0;
+	op->wait_missed = 0;
+	op->wait_polls = 0;
+	if (yk->version && (next == OP_VERIFY || next == OP_READ))
+		op->wait_kind = next == OP_READ ? YK_TIMING_RESPONSE :
+			YK_TIMING_WRITE;
+	/* Read first just after the key usually gets done */
+	if (op->wait_kind >= 0 && yk->poll_policy == YK_POLL_ADAPTIVE) {
+		op->wait_first = _yk_timing_expect(yk->version, op->slot,
+						   op->wait_kind);
+		op->wait_first += op->wait_first / 8;
+	}
+	op->next_poll = op->wait_start +
+		(op->wait_first ? op->wait_first : op->poll_interval);
+}
+
+static void _yk_op_backoff(YK_OP *op)
+{
+	YK_KEY *yk = op->yk;
+	unsigned int max = yk->poll_max_interval_us;
+
+	if (yk->poll_policy == YK_POLL_LEGACY)
+		max = 500 * 1000;
+	if (op->blocking && yk->touch_interval_us) {
+		/* Waiting for a touch, see yk_set_touch_polling() */
+		op->poll_interval = yk->touch_interval_us;
+		op->next_poll = yk__now_us() + op->poll_interval;
+		return;
+	}
+	/* The interval after a poll placed by the timing profile is the
+	   first one */
+	if (yk->poll_policy != YK_POLL_FIXED &&
+	    (op->wait_polls > 1 || !op->wait_first)) {
+		op->poll_interval *= 2;
+		if (op->poll_interval > max)
+			op->poll_interval = max;
+	}
+	if (yk->poll_policy == YK_POLL_DEADLINE ||
+	    yk->poll_policy == YK_POLL_ADAPTIVE)
+		op->next_poll += op->poll_interval;
+	else
+		op->next_poll = yk__now_us() + op->poll_interval;
+}
+
+/* What to do once the frame is written */
+static void _yk_op_frame_written(YK_OP *op)
+{
+	if (op->kind == OP_KIND_WRITE) {
+		/* When the Yubikey clears the SLOT_WRITE_FLAG, it has
+		 * processed the last write. */
+		_yk_op_wait(op, false, SLOT_WRITE_FLAG,
+			    op->yk->timeouts.write_ms, OP_VERIFY);
+	} else {
+		/* Wait for the key to turn on RESP_PENDING_FLAG */
+		_yk_op_wait(op, true, RESP_PENDING_FLAG,
+			    op->yk->timeouts.response_ms, OP_READ);
+	}
+}
+
+static void _yk_op_wait_timeout(YK_OP *op)
+{
+	_yk_stats_add(&op->yk->stats.waits, yk__now_us() - op->wait_start);
+	op->yk->stats.timeouts++;
+	_yk_op_fail(op, YK_ETIMEOUT);
+}
+
+static void _yk_op_wait_done(YK_OP *op)
+{
+	unsigned char st = op->data[FEATURE_RPT_SIZE - 1];
+
+	if (op->wait_set ? (st & op->wait_mask) == op->wait_mask :
+	    !(st & op->wait_mask)) {
+		uint64_t waited = yk__now_us() - op->wait_start;
+
+		_yk_stats_add(&op->yk->stats.waits, waited);
+		/* Waits for a touch say nothing about the key */
+		if (op->blocking)
+			_yk_touch_done(op->yk);
+		else if (op->wait_kind >= 0)
+			_yk_timing_learn(op->yk->version, op->slot,
+					 op->wait_kind, op->wait_missed, waited,
+					 op->wait_first && op->wait_polls == 1);
+		op->state = op->wait_next;
+		if (op->state == OP_VERIFY) {
+			/* The report that ended the wait has the new
+			 * programming sequence. */
+			_yk_op_verify_done(op);
+		} else if (op->state == OP_READ) {
+			/* The first part of the response came with the
+			 * status report. */
+			memcpy(op->response, op->data, FEATURE_RPT_SIZE - 1);
+			op->response_len = FEATURE_RPT_SIZE - 1;
+		}
+		return;
+	}
+	op->wait_missed = yk__now_us() - op->wait_start;
+
+	/* Check if Yubikey says it will wait for user interaction */
+	if ((st & RESP_TIMEOUT_WAIT_FLAG) == RESP_TIMEOUT_WAIT_FLAG) {
+		if ((op->flags & YK_FLAG_MAYBLOCK) == YK_FLAG_MAYBLOCK) {
+			if (!op->blocking) {
+				op->blocking = 1;
+				op->wait_max +=
+					(uint64_t)op->yk->timeouts.touch_ms * 1000;
+				_yk_touch_begin(op->yk);
+			}
+			op->yk->touch_seen_us = yk__now_us();
+		} else {
+			_yk_op_reset(op, YK_OP_FAILED, YK_EWOULDBLOCK);
+			return;
+		}
+	} else if (op->blocking) {
+		/* YubiKey timed out waiting for user interaction */
+		_yk_op_wait_timeout(op);
+		return;
+	}
+
+	if (yk__now_us() - op->wait_start >= op->wait_max ||
+	    !_yk_time_left(op->yk, 1)) {
+		_yk_op_wait_timeout(op);
+		return;
+	}
+	_yk_op_backoff(op);
+}
+
+static void _yk_op_read_done(YK_OP *op)
+{
+	unsigned char st = op->data[FEATURE_RPT_SIZE - 1];
+
+	if (!(st & RESP_PENDING_FLAG)) {
+		_yk_op_reset(op, YK_OP_FAILED, YK_ENODATA);
+		return;
+	}
+
+	/* The lower five bits of the status byte has the response sequence
+	 * number. If that gets reset to zero we are done. */
+	if ((st & 31) == 0) {
+		if (op->expect_bytes > 0 &&
+		    yk_crc16(op->response, op->expect_bytes + 2) != YK_CRC_OK_RESIDUAL) {
+			_yk_op_reset(op, YK_OP_FAILED, YK_ECHECKSUM);
+			return;
+		}
+		_yk_op_reset(op, YK_OP_DONE, 0);
+		return;
+	}
+
+	if (op->response_len + FEATURE_RPT_SIZE - 1 > sizeof(op->response)) {
+		_yk_op_reset(op, YK_OP_FAILED, YK_EWRONGSIZ);
+		return;
+	}
+	memcpy(op->response + op->response_len, op->data, FEATURE_RPT_SIZE - 1);
+	op->response_len += FEATURE_RPT_SIZE - 1;
+}
+
+static void _yk_op_verify_done(YK_OP *op)
+{
+	YK_STATUS st;
+
+	memcpy(&st, op->data + 1, sizeof(st));
+	st.touchLevel = yk_endian_swap_16(st.touchLevel);
+
+	/* when both configurations from a YubiKey is erased it will return
+	 * pgmSeq 0, if one is still configured after an erase pgmSeq is
+	 * counted up as usual. */
+	if (((st.touchLevel & (CONFIG1_VALID | CONFIG2_VALID)) == 0 && st.pgmSeq == 0) ||
+	    st.pgmSeq != op->pgm_seq)
+		_yk_op_finish(op, YK_OP_DONE);
+	else
+		_yk_op_fail(op, YK_EWRITEERR);
+}
+
+static void _yk_op_transfer_done(void *userdata, int result)
+{
+	YK_OP *op = userdata;
+	YK_STATS *stats;
+
+	op->inflight = 0;
+	if (op->freed) {
+		_yk_op_abandon(op);
+		return;
+	}
+
+	stats = &op->yk->stats;
+	_yk_stats_add(op->writing ? &stats->writes : &stats->reads,
+		      yk__now_us() - op->submitted);
+	if (result == 0) {
+		if (op->writing)
+			stats->write_errors++;
+		else
+			stats->read_errors++;
+		_yk_op_fail(op, yk_errno);
+		return;
+	}
+
+	switch (op->state) {
+	case OP_STATUS:
+		op->pgm_seq = op->data[1 + 3];
+		op->report = 0;
+		/* The same report tells if the key is ready for the frame */
+		if (op->data[FEATURE_RPT_SIZE - 1] & SLOT_WRITE_FLAG)
+			_yk_op_wait(op, false, SLOT_WRITE_FLAG,
+				    op->yk->timeouts.write_ms, OP_WRITE);
+		else
+			op->state = OP_WRITE;
+		break;
+	case OP_WAIT:
+		_yk_op_wait_done(op);
+		break;
+	case OP_WRITE:
+		if (++op->report < op->nreports)
+			_yk_op_wait(op, false, SLOT_WRITE_FLAG,
+				    op->yk->timeouts.write_ms, OP_WRITE);
+		else
+			_yk_op_frame_written(op);
+		break;
+	case OP_READ:
+		_yk_op_read_done(op);
+		break;
+	case OP_RESET:
+		if (op->final_result == YK_OP_DONE)
+			_yk_op_finish(op, YK_OP_DONE);
+		else
+			_yk_op_fail(op, op->err);
+		return;
+	default:
+		break;
+	}
+
+	if (op->state != OP_FINISHED)
+		_yk_op_advance(op);
+}
+
+static int _yk_op_submit_read(YK_OP *op)
+{
+	unsigned int timeout_ms = _yk_transfer_timeout(op->yk);
+
+	if (!timeout_ms) {
+		op->yk->stats.timeouts++;
+		yk_errno = YK_ETIMEOUT;
+		return 0;
+	}
+	op->yk->transfers++;
+	if (op->state == OP_WAIT) {
+		op->yk->stats.polls++;
+		op->wait_polls++;
+	}
+	op->writing = 0;
+	op->submitted = yk__now_us();
+	memset(op->data, 0, sizeof(op->data));
+	return _ykusb_submit_read(op->yk->dev, REPORT_TYPE_FEATURE, 0,
+				  (char *)op->data, FEATURE_RPT_SIZE, timeout_ms,
+				  _yk_op_transfer_done, op);
+}
+
+static int _yk_op_submit_write(YK_OP *op, const unsigned char *report)
+{
+	unsigned int timeout_ms = _yk_transfer_timeout(op->yk);
+
+	if (!timeout_ms) {
+		op->yk->stats.timeouts++;
+		yk_errno = YK_ETIMEOUT;
+		return 0;
+	}
+	op->yk->transfers++;
+	op->writing = 1;
+	op->submitted = yk__now_us();
+	memcpy(op->data, report, FEATURE_RPT_SIZE);
+	return _ykusb_submit_write(op->yk->dev, REPORT_TYPE_FEATURE, 0,
+				   (char *)op->data, FEATURE_RPT_SIZE, timeout_ms,
+				   _yk_op_transfer_done, op);
+}
+
+static int _yk_op_submit_reset(YK_OP *op)
+{
+	unsigned char buf[FEATURE_RPT_SIZE];
+
+	memset(buf, 0, sizeof(buf));
+	buf[FEATURE_RPT_SIZE - 1] = DUMMY_REPORT_WRITE;
+	return _yk_op_submit_write(op, buf);
+}
+
+/* Submit the next transfer, unless one is in flight or it isn't time yet. */
+static void _yk_op_advance(YK_OP *op)
+{
+	YK_KEY *yk = op->yk;
+	int rc = 0;
+
+	if (op->inflight || op->state == OP_FINISHED)
+		return;
+
+	if (op->state == OP_QUEUED) {
+		YK_OP *o;
+
+		if (yk->op != NULL)
+			return;
+		/* Operations on a key run in the order they were created */
+		for (o = op->ctx->ops; o != op; o = o->next)
+			if (o->yk == yk && o->state == OP_QUEUED)
+				return;
+		if (!_yk_op_trylock_key(yk)) {
+			if (!op->lock_wait) {
+				op->lock_wait = yk__now_us();
+				yk->stats.lock_contended++;
+			}
+			return;
+		}
+		if (op->lock_wait)
+			_yk_stats_add(&yk->stats.lock_waits,
+				      yk__now_us() - op->lock_wait);
+		if (!_ykusb_begin_session(yk->dev)) {
+			_yk_op_unlock_key(yk);
+			_yk_op_fail(op, yk_errno);
+			return;
+		}
+		yk->op = op;
+		op->started = yk__now_us();
+		if (op->kind == OP_KIND_WRITE) {
+			op->state = OP_STATUS;
+		} else {
+			op->report = 0;
+			_yk_op_wait(op, false, SLOT_WRITE_FLAG,
+				    op->yk->timeouts.write_ms, OP_WRITE);
+		}
+	}
+
+	/* A canceled operation resets the key on its way out */
+	if (op->state == OP_WAIT && _yk_canceled(yk))
+		_yk_op_reset(op, YK_OP_FAILED, YK_ECANCELED);
+
+	switch (op->state) {
+	case OP_WAIT:
+		if (yk__now_us() < op->next_poll)
+			return;
+		/* fall through */
+	case OP_STATUS:
+	case OP_READ:
+		rc = _yk_op_submit_read(op);
+		break;
+	case OP_WRITE:
+		rc = _yk_op_submit_write(op, op->reports[op->report]);
+		break;
+	case OP_RESET:
+		rc = _yk_op_submit_reset(op);
+		break;
+	default:
+		return;
+	}
+
+	if (rc)
+		op->inflight = 1;
+	else
+		_yk_op_fail(op, yk_errno);
+}
+
+YK_OP *yk_op_challenge_response(YK_KEY *yk, uint8_t yk_cmd, int may_block,
+				unsigned int challenge_len,
+				const unsigned char *challenge)
+{
+	unsigned int expect_bytes;
+	YK_OP *op;
+
+	switch(yk_cmd) {
+	case SLOT_CHAL_HMAC1:
+	case SLOT_CHAL_HMAC2:
+		expect_bytes = 20;
+		break;
+	case SLOT_CHAL_OTP1:
+	case SLOT_CHAL_OTP2:
+		expect_bytes = 16;
+		break;
+	default:
+		yk_errno = YK_EINVALIDCMD;
+		return NULL;
+	}
+
+	op = _yk_op_new(yk, OP_KIND_RESPONSE, yk_cmd, challenge, challenge_len);
+	if (op) {
+		op->expect_bytes = expect_bytes;
+		if (may_block)
+			op->flags |= YK_FLAG_MAYBLOCK;
+	}
+	return op;
+}
+
+YK_OP *yk_op_write_command(YK_KEY *yk, YK_CONFIG *cfg, uint8_t command,
+			   unsigned char *acc_code)
+{
+	unsigned char buf[sizeof(YK_CONFIG) + ACC_CODE_SIZE];
+
+	_yk_config_payload(cfg, acc_code, buf);
+	return _yk_op_new(yk, OP_KIND_WRITE, command, buf, sizeof(buf));
+}
+
+YK_OP *yk_op_get_serial(YK_KEY *yk, uint8_t slot, unsigned int flags)
+{
+	unsigned char buf[FEATURE_RPT_SIZE * 2];
+	YK_OP *op;
+
+	memset(buf, 0, sizeof(buf));
+	op = _yk_op_new(yk, OP_KIND_RESPONSE, SLOT_DEVICE_SERIAL, buf, 0);
+	if (op) {
+		op->expect_bytes = SERIAL_NUMBER_SIZE;
+		op->flags = flags;
+	}
+	return op;
+}
+
+int yk_op_set_callback(YK_OP *op, void (*cb)(YK_OP *op, void *userdata),
+		       void *userdata)
+{
+	op->cb = cb;
+	op->userdata = userdata;
+	return 1;
+}
+
+int yk_op_step(YK_OP *op)
+{
+	int result;
+
+	_yk_op_advance(op);
+	result = yk_op_state(op);
+	_yk_op_notify(op);
+	return result;
+}
+
+int yk_op_state(YK_OP *op)
+{
+	if (op->result == YK_OP_FAILED)
+		yk_errno = op->err;
+	return op->result;
+}
+
+int yk_op_get_response(YK_OP *op, unsigned char *buf, unsigned int bufsize,
+		       unsigned int *len)
+{
+	if (op->result != YK_OP_DONE || op->kind != OP_KIND_RESPONSE) {
+		yk_errno = YK_EINVALIDCMD;
+		return 0;
+	}
+	if (bufsize < op->expect_bytes) {
+		yk_errno = YK_EWRONGSIZ;
+		return 0;
+	}
+	memcpy(buf, op->response, op->expect_bytes);
+	*len = op->expect_bytes;
+	return 1;
+}
+
+int yk_op_get_serial_result(YK_OP *op, unsigned int *serial)
+{
+	unsigned char buf[SERIAL_NUMBER_SIZE];
+	unsigned int len;
+
+	if (op->slot != SLOT_DEVICE_SERIAL) {
+		yk_errno = YK_EINVALIDCMD;
+		return 0;
+	}
+	if (!yk_op_get_response(op, buf, sizeof(buf), &len))
+		return 0;
+
+	/* Serial number is stored in big endian byte order */
+	*serial =
+		(buf[0] << 24) +
+		(buf[1] << 16) +
+		(buf[2] << 8) +
+		(buf[3]);
+	return 1;
+}
+
+void yk_op_free(YK_OP *op)
+{
+	if (op == NULL)
+		return;
+	_yk_op_unlink(op);
+	/* An operation that has the key keeps it until the key is reset,
+	   see _yk_op_abandon(). A transfer still in flight is canceled, and
+	   holds on to the operation until its callback. */
+	op->freed = 1;
+	if (op->yk->op == op) {
+		if (!op->inflight)
+			_yk_op_abandon(op);
+		else if (op->state == OP_RESET)
+			op->abandoned = 1;
+		else
+			_ykusb_cancel_transfers(op->yk->dev);
+		return;
+	}
+	if (op->state != OP_FINISHED)
+		_yk_op_finish(op, YK_OP_FAILED);
+	if (!op->inflight)
+		free(op);
+}
+
+int yk_get_pollfds(YK_POLLFD *fds, unsigned int max, unsigned int *count)
+{
+	return yk_context_get_pollfds(_yk_default_context(), fds, max, count);
+}
+
+int yk_context_get_pollfds(YK_CONTEXT *ctx, YK_POLLFD *fds,
+			   unsigned int max, unsigned int *count)
+{
+	return _ykusb_get_pollfds(ctx->usb, fds, max, count);
+}
+
+int yk_get_next_timeout(long *timeout_us)
+{
+	return yk_context_get_next_timeout(_yk_default_context(), timeout_us);
+}
+
+int yk_context_get_next_timeout(YK_CONTEXT *ctx, long *timeout_us)
+{
+	uint64_t now = yk__now_us();
+	YK_OP *op;
+
+	if (!_ykusb_get_next_timeout(ctx->usb, timeout_us))
+		return 0;
+
+	for (op = ctx->ops; op; op = op->next) {
+		long t;
+
+		if (op->inflight || op->notified)
+			continue;
+		if (op->state == OP_QUEUED && op->yk->op != NULL)
+			continue;
+		if (op->state == OP_WAIT && op->next_poll > now)
+			t = (long)(op->next_poll - now);
+		else if (op->state == OP_QUEUED && op->lock_wait)
+			t = OP_LOCK_RETRY_US;
+		else
+			t = 0;
+		if (*timeout_us < 0 || t < *timeout_us)
+			*timeout_us = t;
+	}
+	return 1;
+}
+
+static int _yk_handle_events(YK_CONTEXT *ctx, long timeout_us)
+{
+	YK_OP *op, *next;
+
+	if (!_ykusb_handle_events(ctx->usb, timeout_us))
+		return 0;
+	_yk_hotplug_dispatch(ctx);
+
+	/* A completion callback may free its own operation, but no other. */
+	for (op = ctx->ops; op; op = next) {
+		next = op->next;
+		_yk_op_advance(op);
+		_yk_op_notify(op);
+	}
+	return 1;
+}
+
+int yk_handle_events(void)
+{
+	return _yk_handle_events(_yk_default_context(), 0);
+}
+
+int yk_context_handle_events(YK_CONTEXT *ctx)
+{
+	return _yk_handle_events(ctx, 0);
+}
+
+/* Like yk_handle_events(), but block until something happened or the
+   timeout passed. The wait is cut short when an operation needs to poll
+   its key before that. */
+int yk_wait_events(long timeout_us)
+{
+	return yk_context_wait_events(_yk_default_context(), timeout_us);
+}
+
+int yk_context_wait_events(YK_CONTEXT *ctx, long timeout_us)
+{
+	long next;
+
+	if (!yk_context_get_next_timeout(ctx, &next))
+		return 0;
+	if (next >= 0 && (timeout_us < 0 || next < timeout_us))
+		timeout_us = next;
+	return _yk_handle_events(ctx, timeout_us);
+}
@@ -0,0 +1,264 @@
+/* -*- mode:C; c-file-style: "bsd" -*- */
+/*
+ * Copyright (c) 2017 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Process-wide pool of open keys.
+ *
+ * Opening a key walks the bus, detaches the kernel driver and reads the
+ * status, closing it reattaches the driver. Programs doing many short
+ * operations take their keys from here and put them back when done, and
+ * the handles stay open in between. A handle is checked with a status
+ * read before it is handed out again, and reopened if the key went away.
+ */
+
+#include "ykcore_lcl.h"
+
+#include <string.h>
+
+/* An entry is one key, found by how it was first asked for until it is
+   open and then by where it is and its serial, so a key asked for by
+   index and by serial is handed out once. */
+struct yk_pool_entry_st {
+	struct yk_pool_entry_st *next;
+	YK_KEY *yk;		/* NULL while being opened */
+	int by_serial;
+	unsigned int id;	/* index or serial */
+	char path[YK_DEVICE_PATH_SIZE];	/* "" if unknown */
+	unsigned int serial;	/* 0 if unknown */
+	int busy;		/* handed out, or being checked */
+};
+
+static struct yk_pool_entry_st *pool;
+static yk__STATIC_MUTEX_T pool_lock = yk__STATIC_MUTEX_INITIALIZER;
+static yk__COND_T pool_cond = yk__STATIC_COND_INITIALIZER;
+
+static struct yk_pool_entry_st *_yk_pool_find(int by_serial, unsigned int id,
+					      const char *path)
+{
+	struct yk_pool_entry_st *e;
+
+	for (e = pool; e; e = e->next) {
+		if (by_serial && e->serial == id)
+			return e;
+		if (!by_serial && *path && strcmp(e->path, path) == 0)
+			return e;
+		if (e->by_serial == by_serial && e->id == id)
+			return e;
+	}
+	return NULL;
+}
+
+/* Another entry for the key just opened in entry */
+static struct yk_pool_entry_st *_yk_pool_twin(struct yk_pool_entry_st *entry)
+{
+	struct yk_pool_entry_st *e;
+
+	for (e = pool; e; e = e->next) {
+		if (e == entry || !e->yk)
+			continue;
+		if (*entry->path && strcmp(e->path, entry->path) == 0)
+			return e;
+		if (entry->serial && e->serial == entry->serial)
+			return e;
+	}
+	return NULL;
+}
+
+static void _yk_pool_remove(struct yk_pool_entry_st *entry)
+{
+	struct yk_pool_entry_st **p;
+
+	for (p = &pool; *p; p = &(*p)->next) {
+		if (*p == entry) {
+			*p = entry->next;
+			break;
+		}
+	}
+	free(entry);
+}
+
+/* Where the key with the given index is, "" if that can't be told */
+static void _yk_pool_index_path(unsigned int index, char *path)
+{
+	YK_DEVICE_INFO *list;
+	size_t count;
+	int err = yk_errno;
+
+	*path = '\0';
+	if (yk_enumerate(&list, &count, 0)) {
+		if (index < count)
+			memcpy(path, list[index].path, YK_DEVICE_PATH_SIZE);
+		yk_free_device_list(list);
+	}
+	yk_errno = err;
+}
+
+/* Open the key of an entry, where it was last if that is known */
+static YK_KEY *_yk_pool_open(struct yk_pool_entry_st *e)
+{
+	YK_DEVICE_INFO info;
+	YK_KEY *yk;
+
+	if (*e->path) {
+		memset(&info, 0, sizeof(info));
+		memcpy(info.path, e->path, sizeof(info.path));
+		if ((yk = yk_open_device(&info)))
+			return yk;
+	}
+	return e->by_serial ? yk_open_key_by_serial(e->id) : yk_open_key(e->id);
+}
+
+static YK_KEY *_yk_pool_get(int by_serial, unsigned int id)
+{
+	char path[YK_DEVICE_PATH_SIZE];
+	struct yk_pool_entry_st *e, *twin;
+	YK_STATUS st;
+	YK_KEY *yk;
+	int err;
+
+	if (by_serial)
+		path[0] = '\0';
+	else
+		_yk_pool_index_path(id, path);
+
+	yk__static_mutex_lock(pool_lock);
+	e = _yk_pool_find(by_serial, id, path);
+again:
+	while (e && e->busy) {
+		yk__static_cond_wait(pool_cond, pool_lock);
+		e = _yk_pool_find(by_serial, id, path);
+	}
+	if (!e) {
+		if (!(e = calloc(1, sizeof(*e)))) {
+			yk__static_mutex_unlock(pool_lock);
+			yk_errno = YK_ENOMEM;
+			return NULL;
+		}
+		e->by_serial = by_serial;
+		e->id = id;
+		e->next = pool;
+		pool = e;
+	}
+	e->busy = 1;
+	yk = e->yk;
+	yk__static_mutex_unlock(pool_lock);
+
+	/* The entry is ours now, talk to the key without holding the lock */
+	if (yk && !yk_get_status(yk, &st)) {
+		yk_close_key(yk);
+		yk = NULL;
+	}
+	if (!yk && (yk = _yk_pool_open(e))) {
+		memcpy(e->path, yk->path, sizeof(e->path));
+		if (by_serial)
+			e->serial = id;
+		else if (!yk_get_serial(yk, 0, 0, &e->serial))
+			e->serial = 0;
+	}
+	err = yk_errno;
+
+	yk__static_mutex_lock(pool_lock);
+	if (!yk) {
+		_yk_pool_remove(e);
+		yk__cond_broadcast(pool_cond);
+	} else if (!e->yk && (twin = _yk_pool_twin(e))) {
+		/* The key was in the pool already, under another name */
+		yk_close_key(yk);
+		_yk_pool_remove(e);
+		yk__cond_broadcast(pool_cond);
+		e = twin;
+		goto again;
+	} else {
+		e->yk = yk;
+	}
+	yk__static_mutex_unlock(pool_lock);
+	yk_errno = err;
+	return yk;
+}
+
+/* Hand out the key with the given index, see yk_open_key(). */
+YK_KEY *yk_pool_get_key(int index)
+{
+	if (index < 0) {
+		yk_errno = YK_EINVAL;
+		return NULL;
+	}
+	return _yk_pool_get(0, index);
+}
+
+/* Hand out the key with the given serial, see yk_open_key_by_serial(). */
+YK_KEY *yk_pool_get_key_by_serial(unsigned int serial)
+{
+	return _yk_pool_get(1, serial);
+}
+
+/* Give a key back for the next caller. The deadline and cancellation
+   handle set on it are dropped, other settings stay with the key. */
+int yk_pool_put_key(YK_KEY *yk)
+{
+	struct yk_pool_entry_st *e;
+
+	yk__static_mutex_lock(pool_lock);
+	for (e = pool; e; e = e->next)
+		if (e->yk == yk && yk)
+			break;
+	if (!e || !e->busy) {
+		yk__static_mutex_unlock(pool_lock);
+		yk_errno = YK_EINVAL;
+		return 0;
+	}
+	yk->deadline_us = 0;
+	yk->cancel = NULL;
+	e->busy = 0;
+	yk__cond_broadcast(pool_cond);
+	yk__static_mutex_unlock(pool_lock);
+	return 1;
+}
+
+/* Close all keys in the pool that are not handed out. */
+int yk_pool_flush(void)
+{
+	struct yk_pool_entry_st **p, *e;
+	int rc = 1;
+
+	yk__static_mutex_lock(pool_lock);
+	for (p = &pool; (e = *p); ) {
+		if (e->busy) {
+			p = &e->next;
+			continue;
+		}
+		*p = e->next;
+		if (!yk_close_key(e->yk))
+			rc = 0;
+		free(e);
+	}
+	yk__static_mutex_unlock(pool_lock);
+	return rc;
+}
@@ -0,0 +1,105 @@
+/* -*- mode:C; c-file-style: "bsd" -*- */
+/*
+ * Copyright (c) 2017 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef YKTHREAD_H
+#define YKTHREAD_H
+
+/* Define thread, mutex, condition variable, one-time initialisation and
+   thread identity primitives. Static mutexes and condition variables need
+   no init and destroy, for use at file scope. The atomic flag functions
+   work on an int sized flag, also from signal handlers. */
+#if defined _WIN32
+#include <windows.h>
+#define yk__THREAD_T			HANDLE
+#define yk__THREAD_RETURN		DWORD WINAPI
+#define yk__thread_create(t, fn, arg)	((t = CreateThread(NULL, 0, fn, arg, 0, NULL)) == NULL)
+#define yk__thread_join(t)		(WaitForSingleObject(t, INFINITE), CloseHandle(t))
+#define yk__MUTEX_T			CRITICAL_SECTION
+#define yk__mutex_init(m)		InitializeCriticalSection(&m)
+#define yk__mutex_destroy(m)		DeleteCriticalSection(&m)
+#define yk__mutex_lock(m)		EnterCriticalSection(&m)
+#define yk__mutex_unlock(m)		LeaveCriticalSection(&m)
+#define yk__COND_T			CONDITION_VARIABLE
+#define yk__cond_init(c)		InitializeConditionVariable(&c)
+#define yk__cond_destroy(c)		do { } while (0)
+#define yk__cond_wait(c, m)		SleepConditionVariableCS(&c, &m, INFINITE)
+#define yk__cond_broadcast(c)		WakeAllConditionVariable(&c)
+#define yk__THREAD_ID_T			DWORD
+#define yk__thread_self()		GetCurrentThreadId()
+#define yk__thread_equal(a, b)		((a) == (b))
+#define yk__STATIC_MUTEX_T		SRWLOCK
+#define yk__STATIC_MUTEX_INITIALIZER	SRWLOCK_INIT
+#define yk__static_mutex_lock(m)	AcquireSRWLockExclusive(&m)
+#define yk__static_mutex_unlock(m)	ReleaseSRWLockExclusive(&m)
+#define yk__STATIC_COND_INITIALIZER	CONDITION_VARIABLE_INIT
+#define yk__static_cond_wait(c, m)	SleepConditionVariableSRW(&c, &m, INFINITE, 0)
+#define yk__ONCE_T			INIT_ONCE
+#define yk__ONCE_INITIALIZER		INIT_ONCE_STATIC_INIT
+#define yk__once(o, fn)			InitOnceExecuteOnce(&o, yk__once_cb, (PVOID)(fn), NULL)
+#define yk__atomic_store(p, v)		InterlockedExchange((volatile LONG *)(p), (v))
+#define yk__atomic_load(p)		InterlockedCompareExchange((volatile LONG *)(p), 0, 0)
+static __inline BOOL CALLBACK yk__once_cb(PINIT_ONCE o, PVOID fn, PVOID *ctx)
+{
+	((void (*)(void))fn)();
+	return TRUE;
+}
+#else
+#include <pthread.h>
+#define yk__THREAD_T			pthread_t
+#define yk__THREAD_RETURN		void *
+#define yk__thread_create(t, fn, arg)	pthread_create(&t, NULL, fn, arg)
+#define yk__thread_join(t)		pthread_join(t, NULL)
+#define yk__MUTEX_T			pthread_mutex_t
+#define yk__mutex_init(m)		pthread_mutex_init(&m, NULL)
+#define yk__mutex_destroy(m)		pthread_mutex_destroy(&m)
+#define yk__mutex_lock(m)		pthread_mutex_lock(&m)
+#define yk__mutex_unlock(m)		pthread_mutex_unlock(&m)
+#define yk__COND_T			pthread_cond_t
+#define yk__cond_init(c)		pthread_cond_init(&c, NULL)
+#define yk__cond_destroy(c)		pthread_cond_destroy(&c)
+#define yk__cond_wait(c, m)		pthread_cond_wait(&c, &m)
+#define yk__cond_broadcast(c)		pthread_cond_broadcast(&c)
+#define yk__THREAD_ID_T			pthread_t
+#define yk__thread_self()		pthread_self()
+#define yk__thread_equal(a, b)		pthread_equal(a, b)
+#define yk__STATIC_MUTEX_T		pthread_mutex_t
+#define yk__STATIC_MUTEX_INITIALIZER	PTHREAD_MUTEX_INITIALIZER
+#define yk__static_mutex_lock(m)	pthread_mutex_lock(&m)
+#define yk__static_mutex_unlock(m)	pthread_mutex_unlock(&m)
+#define yk__STATIC_COND_INITIALIZER	PTHREAD_COND_INITIALIZER
+#define yk__static_cond_wait(c, m)	pthread_cond_wait(&c, &m)
+#define yk__ONCE_T			pthread_once_t
+#define yk__ONCE_INITIALIZER		PTHREAD_ONCE_INIT
+#define yk__once(o, fn)			pthread_once(&o, fn)
+#define yk__atomic_store(p, v)		__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define yk__atomic_load(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#endif
+
+#endif
@@ -0,0 +1,228 @@
+/* -*- mode:C; c-file-style: "bsd" -*- */
+/*
+ * Copyright (c) 2017 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Timing profiles: how long keys take to finish a command.
+ *
+ * A key takes about the same time to process a given command every time,
+ * and keys with the same firmware take about the same time. Every wait
+ * for a command to be processed (SLOT_WRITE_FLAG cleared) or a response
+ * to start (RESP_PENDING_FLAG set) is learned here, per firmware version,
+ * command and kind of wait, as a running estimate of its duration. Keys
+ * polled with YK_POLL_ADAPTIVE read their status first just after that,
+ * instead of backing off from 1 ms.
+ *
+ * A poll only tells that the key finished somewhere between the previous
+ * poll and this one, so the middle of that is what gets learned. When the
+ * first poll placed by the profile already finds the key done, the key
+ * may have been done earlier and the estimate is nudged down.
+ *
+ * Profiles live as long as the process. They can be saved in a file and
+ * loaded again, one "major.minor.build command kind expect_us samples"
+ * line per entry, kind being 'w' or 'r' for YK_TIMING_WRITE or
+ * YK_TIMING_RESPONSE.
+ */
+
+#include "ykcore_lcl.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define YK_TIMING_MAX		128
+
+struct yk_timing_entry_st {
+	unsigned int version;	/* major << 16 | minor << 8 | build */
+	uint8_t cmd;
+	int kind;
+	unsigned long expect_us;
+	unsigned long samples;
+};
+
+static struct yk_timing_entry_st timings[YK_TIMING_MAX];
+static size_t ntimings;
+static yk__STATIC_MUTEX_T timing_lock = yk__STATIC_MUTEX_INITIALIZER;
+
+/* Called with timing_lock held */
+static struct yk_timing_entry_st *_yk_timing_find(unsigned int version,
+						  uint8_t cmd, int kind,
+						  int add)
+{
+	size_t i;
+
+	for (i = 0; i < ntimings; i++)
+		if (timings[i].version == version && timings[i].cmd == cmd &&
+		    timings[i].kind == kind)
+			return &timings[i];
+	if (!add || ntimings == YK_TIMING_MAX)
+		return NULL;
+	memset(&timings[ntimings], 0, sizeof(timings[0]));
+	timings[ntimings].version = version;
+	timings[ntimings].cmd = cmd;
+	timings[ntimings].kind = kind;
+	return &timings[ntimings++];
+}
+
+/* Expected duration of a wait, 0 if nothing was learned yet */
+uint64_t _yk_timing_expect(unsigned int version, uint8_t cmd, int kind)
+{
+	struct yk_timing_entry_st *e;
+	uint64_t us = 0;
+
+	yk__static_mutex_lock(timing_lock);
+	if ((e = _yk_timing_find(version, cmd, kind, 0)))
+		us = e->expect_us;
+	yk__static_mutex_unlock(timing_lock);
+	return us;
+}
+
+/* Learn from a wait that ended with the key done at the poll 'done_us'
+ * after the wait began, the poll before having been at 'missed_us' (0 if
+ * there was none). 'early' says the first poll was placed by the profile
+ * and found the key done already.
+ */
+void _yk_timing_learn(unsigned int version, uint8_t cmd, int kind,
+		      uint64_t missed_us, uint64_t done_us, int early)
+{
+	struct yk_timing_entry_st *e;
+	unsigned long sample = (unsigned long)((missed_us + done_us) / 2);
+
+	yk__static_mutex_lock(timing_lock);
+	if ((e = _yk_timing_find(version, cmd, kind, 1))) {
+		if (early)
+			e->expect_us -= e->expect_us / 16;
+		else if (e->samples == 0)
+			e->expect_us = sample;
+		else if (sample > e->expect_us)
+			e->expect_us += (sample - e->expect_us) / 4;
+		else
+			e->expect_us -= (e->expect_us - sample) / 4;
+		e->samples++;
+	}
+	yk__static_mutex_unlock(timing_lock);
+}
+
+int yk_timing_lookup(unsigned int major, unsigned int minor,
+		     unsigned int build, uint8_t cmd, int kind,
+		     unsigned long *expect_us, unsigned long *samples)
+{
+	struct yk_timing_entry_st *e;
+	int rc = 0;
+
+	yk__static_mutex_lock(timing_lock);
+	e = _yk_timing_find(major << 16 | minor << 8 | build, cmd, kind, 0);
+	if (e) {
+		if (expect_us)
+			*expect_us = e->expect_us;
+		if (samples)
+			*samples = e->samples;
+		rc = 1;
+	}
+	yk__static_mutex_unlock(timing_lock);
+	if (!rc)
+		yk_errno = YK_ENODATA;
+	return rc;
+}
+
+int yk_timing_reset(void)
+{
+	yk__static_mutex_lock(timing_lock);
+	ntimings = 0;
+	yk__static_mutex_unlock(timing_lock);
+	return 1;
+}
+
+/* Add the entries of a file to the profiles, replacing what was learned
+   for the same firmware, command and kind. */
+int yk_timing_load(const char *path)
+{
+	unsigned int major, minor, build, cmd;
+	unsigned long expect_us, samples;
+	struct yk_timing_entry_st *e;
+	char kind;
+	FILE *f;
+
+	if (!path) {
+		yk_errno = YK_EINVAL;
+		return 0;
+	}
+	if (!(f = fopen(path, "r"))) {
+		yk_errno = YK_ENODATA;
+		return 0;
+	}
+	yk__static_mutex_lock(timing_lock);
+	while (fscanf(f, "%u.%u.%u %x %c %lu %lu", &major, &minor, &build,
+		      &cmd, &kind, &expect_us, &samples) == 7) {
+		if ((kind != 'w' && kind != 'r') || cmd > 0xff)
+			continue;
+		e = _yk_timing_find(major << 16 | minor << 8 | build, cmd,
+				    kind == 'w' ? YK_TIMING_WRITE :
+				    YK_TIMING_RESPONSE, 1);
+		if (e) {
+			e->expect_us = expect_us;
+			e->samples = samples;
+		}
+	}
+	yk__static_mutex_unlock(timing_lock);
+	fclose(f);
+	return 1;
+}
+
+/* Write the profiles to a file, through a temporary file so that other
+   processes loading it never see half of it. */
+int yk_timing_save(const char *path)
+{
+	char tmp[1040];
+	FILE *f;
+	size_t i;
+
+	if (!path || strlen(path) + 8 > sizeof(tmp)) {
+		yk_errno = YK_EINVAL;
+		return 0;
+	}
+	if (!(f = _yk_temp_file(path, tmp, sizeof(tmp)))) {
+		yk_errno = YK_EWRITEERR;
+		return 0;
+	}
+	yk__static_mutex_lock(timing_lock);
+	for (i = 0; i < ntimings; i++)
+		fprintf(f, "%u.%u.%u %02x %c %lu %lu\n",
+			timings[i].version >> 16,
+			(timings[i].version >> 8) & 0xff,
+			timings[i].version & 0xff, timings[i].cmd,
+			timings[i].kind == YK_TIMING_WRITE ? 'w' : 'r',
+			timings[i].expect_us, timings[i].samples);
+	yk__static_mutex_unlock(timing_lock);
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		remove(tmp);
+		yk_errno = YK_EWRITEERR;
+		return 0;
+	}
+	return 1;
+}
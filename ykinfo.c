@@ -58,6 +58,8 @@ const char *usage =
 	"\t-I        Get product id of YubiKey\n"
 	"\t-a        Get all information above\n"
 	"\t-c        Get capabilities from YubiKey\n"
+	"\t-w        Watch for YubiKeys arriving and leaving\n"
+	"\t-S        Print transport statistics of the queries above\n"
 	"\n"
 	"\t-q        Only output information from YubiKey\n"
 	"\n"
@@ -66,7 +68,7 @@ const char *usage =
 	"\n"
 	"\n"
 	;
-const char *optstring = "asmn:HvtpqhV12iIc";
+const char *optstring = "asmn:HvtpqhV12iIcwS";
 
 static void report_yk_error(void)
 {
@@ -85,7 +87,7 @@ static int parse_args(int argc, char **argv,
 		bool *serial_dec, bool *serial_modhex, bool *serial_hex,
 		bool *version, bool *touch_level, bool *pgm_seq, bool *quiet,
 		bool *slot1, bool *slot2, bool *vid, bool *pid, bool *capa,
-		int *key_index, int *exit_code)
+		bool *watch, bool *stats, int *key_index, int *exit_code)
 {
 	int c;
 
@@ -142,6 +144,12 @@ static int parse_args(int argc, char **argv,
 		case 'c':
 			*capa = true;
 			break;
+		case 'w':
+			*watch = true;
+			break;
+		case 'S':
+			*stats = true;
+			break;
 		case 'V':
 			fputs(YKPERS_VERSION_STRING "\n", stderr);
 			*exit_code = 0;
@@ -156,7 +164,7 @@ static int parse_args(int argc, char **argv,
 
 	if (!*serial_dec && !*serial_modhex && !*serial_hex &&
 			!*version && !*touch_level && !*pgm_seq && !*slot1 && !*slot2 &&
-			!*vid && !*pid && !*capa) {
+			!*vid && !*pid && !*capa && !*watch && !*stats) {
 		/* no options at all */
 		fputs("You must give at least one option.\n", stderr);
 		fputs(usage, stderr);
@@ -166,6 +174,79 @@ static int parse_args(int argc, char **argv,
 	return 1;
 }
 
+static void watch_event(int event, const YK_DEVICE_INFO *info, void *userdata)
+{
+	bool quiet = *(bool *)userdata;
+	const char *what = event == YK_HOTPLUG_ARRIVED ? "arrived" : "left";
+
+	if (quiet) {
+		printf("%s %u\n", what, info->serial);
+	} else {
+		printf("%s: serial %u, %s %d.%d.%d at %s\n", what, info->serial,
+		       info->family ? info->family : "unknown",
+		       info->version_major, info->version_minor,
+		       info->version_build, info->path);
+	}
+	fflush(stdout);
+}
+
+/* Print keys arriving and leaving until something goes wrong */
+static int watch_keys(bool quiet)
+{
+	if (!yk_hotplug_register(watch_event, &quiet, YK_ENUM_DETAILS))
+		return 0;
+	while (yk_wait_events(-1))
+		;
+	yk_hotplug_deregister();
+	return 0;
+}
+
+static void print_histogram(const char *name, const YK_HISTOGRAM *h)
+{
+	int i;
+
+	printf("%s: %lu", name, h->count);
+	if (h->count)
+		printf(", avg %lu us, max %lu us", h->total_us / h->count,
+		       h->max_us);
+	printf("\n");
+	for (i = 0; i < YK_STATS_BUCKETS; i++) {
+		if (!h->buckets[i])
+			continue;
+		if (i < YK_STATS_BUCKETS - 1)
+			printf("  < %lu us: %lu\n", 1UL << i, h->buckets[i]);
+		else
+			printf("  >= %lu us: %lu\n", 1UL << (i - 1), h->buckets[i]);
+	}
+}
+
+static int print_stats(YK_KEY *yk)
+{
+	YK_STATS st;
+
+	if (!yk_get_stats(yk, &st))
+		return 0;
+	print_histogram("reads", &st.reads);
+	print_histogram("writes", &st.writes);
+	print_histogram("waits", &st.waits);
+	print_histogram("operations", &st.ops);
+	printf("polls: %lu\n", st.polls);
+	printf("slept: %lu us\n", st.slept_us);
+	printf("skipped_reports: %lu\n", st.skipped_reports);
+	printf("read_errors: %lu\n", st.read_errors);
+	printf("write_errors: %lu\n", st.write_errors);
+	printf("timeouts: %lu\n", st.timeouts);
+	printf("lock_acquired: %lu\n", st.lock_acquired);
+	printf("lock_contended: %lu\n", st.lock_contended);
+	print_histogram("lock_waits", &st.lock_waits);
+	print_histogram("touch_waits", &st.touch_waits);
+	print_histogram("touch_latency", &st.touch_latency);
+	printf("retries: %lu\n", st.retries);
+	printf("recovered: %lu\n", st.recovered);
+	printf("reopens: %lu\n", st.reopens);
+	printf("resyncs: %lu\n", st.resyncs);
+	return 1;
+}
 
 int main(int argc, char **argv)
 {
@@ -185,6 +266,8 @@ int main(int argc, char **argv)
 	bool vid = false;
 	bool pid = false;
 	bool capa = false;
+	bool watch = false;
+	bool stats = false;
 
 	bool quiet = false;
 	int key_index = 0;
@@ -195,7 +278,7 @@ int main(int argc, char **argv)
 				&serial_dec, &serial_modhex, &serial_hex,
 				&version, &touch_level, &pgm_seq, &quiet,
 				&slot1, &slot2, &vid, &pid, &capa,
-				&key_index, &exit_code))
+				&watch, &stats, &key_index, &exit_code))
 		exit(exit_code);
 
 	if (!yk_init()) {
@@ -203,6 +286,13 @@ int main(int argc, char **argv)
 		goto err;
 	}
 
+	if (watch) {
+		if (!watch_keys(quiet)) {
+			exit_code = 1;
+			goto err;
+		}
+	}
+
 	if (!(yk = yk_open_key(key_index))) {
 		exit_code = 1;
 		goto err;
@@ -314,6 +404,11 @@ int main(int argc, char **argv)
 		printf("\n");
 	}
 
+	if (stats && !print_stats(yk)) {
+		exit_code = 1;
+		goto err;
+	}
+
 	exit_code = 0;
 	error = false;
 
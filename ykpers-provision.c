@@ -0,0 +1,214 @@
+/* -*- mode:C; c-file-style: "bsd" -*- */
+/*
+ * Copyright (c) 2017 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Program several keys at once. Every key spends most of the time of a
+ * configuration write waiting for the device, so running the writes side
+ * by side on a few threads brings the total down to about the time of the
+ * slowest key.
+ */
+
+#include "ykpers_lcl.h"
+#include "ykthread.h"
+#include "yktime.h"
+
+#include <string.h>
+
+struct ykp_provision_st {
+	const int *indexes;
+	size_t count;
+	ykp_provision_cb generate;
+	void *userdata;
+	YKP_PROVISION_RESULT *results;
+
+	yk__MUTEX_T lock;
+	size_t next;		/* next entry in results to work on */
+	size_t last;		/* no keys from here on, when probing */
+};
+
+static int _ykp_provision_one(struct ykp_provision_st *p, int index,
+			      YKP_PROVISION_RESULT *res)
+{
+	unsigned char acc_code[ACC_CODE_SIZE];
+	YKP_CONFIG *cfg = NULL;
+	YK_STATUS st;
+	YK_KEY *yk;
+	int rc = 0;
+
+	if (!(yk = yk_open_key(index)))
+		goto out;
+
+	if (!yk_get_status(yk, &st))
+		goto out;
+
+	/* Not all keys let us read the serial, that's not fatal */
+	if (!yk_get_serial(yk, 0, 0, &res->serial))
+		res->serial = 0;
+
+	if (!(cfg = ykp_alloc())) {
+		yk_errno = YK_ENOMEM;
+		goto out;
+	}
+	ykp_configure_version(cfg, &st);
+	cfg->command = SLOT_CONFIG;
+
+	memset(acc_code, 0, sizeof(acc_code));
+	yk_errno = 0;
+	ykp_errno = 0;
+	if (!p->generate(index, res->serial, &st, cfg, acc_code, p->userdata))
+		goto out;
+
+	rc = yk_write_command(yk, ykp_core_config(cfg), ykp_command(cfg),
+			      acc_code);
+ out:
+	ykp_free_config(cfg);
+	if (!rc) {
+		res->core_error = yk_errno;
+		res->ykp_error = ykp_errno;
+	}
+	if (yk && !yk_close_key(yk) && rc) {
+		res->core_error = yk_errno;
+		rc = 0;
+	}
+	return rc;
+}
+
+static yk__THREAD_RETURN _ykp_provision_worker(void *arg)
+{
+	struct ykp_provision_st *p = arg;
+
+	for (;;) {
+		YKP_PROVISION_RESULT *res;
+		uint64_t start;
+		size_t n;
+
+		yk__mutex_lock(p->lock);
+		n = p->next++;
+		yk__mutex_unlock(p->lock);
+		if (n >= p->count || n >= p->last)
+			break;
+
+		res = &p->results[n];
+		memset(res, 0, sizeof(*res));
+		res->index = p->indexes ? p->indexes[n] : (int)n;
+
+		yk_errno = 0;
+		ykp_errno = 0;
+		start = yk__now_us();
+		res->rc = _ykp_provision_one(p, res->index, res);
+		res->elapsed_us = (unsigned long)(yk__now_us() - start);
+
+		/* Without a list of keys, the first index with no key
+		 * behind it ends the run. */
+		if (!p->indexes && !res->rc && res->core_error == YK_ENOKEY) {
+			yk__mutex_lock(p->lock);
+			if (n < p->last)
+				p->last = n;
+			yk__mutex_unlock(p->lock);
+		}
+	}
+	return 0;
+}
+
+/* Program the keys with the given indexes (see yk_open_key()) on up to
+ * 'threads' threads at once. If indexes is NULL, all attached keys are
+ * programmed, up to 'count' of them.
+ *
+ * For each key, 'generate' gets the key's status and serial (0 if it can't
+ * be read) and a YKP_CONFIG set up for its firmware version, to fill in with
+ * the configuration and the command to write (ykp_configure_command(),
+ * SLOT_CONFIG by default). It can also put the current access code of the
+ * key in acc_code. It is called from the worker threads, concurrently for
+ * different keys, and returns 0 to skip the key as failed.
+ *
+ * The outcome for each key is put in results, in the order of indexes, and
+ * the number of entries filled in is put in *nresults. Returns 1 if all keys
+ * were programmed, 0 otherwise, with yk_errno set to YK_ENOKEY if no key was
+ * found at all.
+ */
+int ykp_provision(const int *indexes, size_t count, unsigned int threads,
+		  ykp_provision_cb generate, void *userdata,
+		  YKP_PROVISION_RESULT *results, size_t *nresults)
+{
+	struct ykp_provision_st p;
+	yk__THREAD_T *workers;
+	unsigned int i, started;
+	size_t n, ok = 0;
+
+	if (!generate || !results || !nresults || count == 0) {
+		ykp_errno = YKP_EINVAL;
+		return 0;
+	}
+	if (threads == 0)
+		threads = 1;
+	if (threads > count)
+		threads = count;
+
+	workers = malloc(sizeof(yk__THREAD_T) * threads);
+	if (!workers) {
+		yk_errno = YK_ENOMEM;
+		return 0;
+	}
+
+	memset(&p, 0, sizeof(p));
+	p.indexes = indexes;
+	p.count = count;
+	p.generate = generate;
+	p.userdata = userdata;
+	p.results = results;
+	p.last = count;
+	yk__mutex_init(p.lock);
+
+	for (started = 0; started < threads; started++) {
+		if (yk__thread_create(workers[started], _ykp_provision_worker, &p))
+			break;
+	}
+	/* If no thread could be started, do the work here */
+	if (started == 0)
+		_ykp_provision_worker(&p);
+	for (i = 0; i < started; i++)
+		yk__thread_join(workers[i]);
+
+	yk__mutex_destroy(p.lock);
+	free(workers);
+
+	n = indexes ? count : p.last;
+	for (i = 0; i < n; i++) {
+		if (results[i].rc)
+			ok++;
+	}
+	*nresults = n;
+	if (n == 0) {
+		/* not even the first key was there */
+		yk_errno = YK_ENOKEY;
+		return 0;
+	}
+	return ok == n;
+}
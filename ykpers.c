@@ -31,6 +31,7 @@
 #include "ykpers_lcl.h"
 #include "ykpbkdf2.h"
 #include "yktsd.h"
+#include "ykthread.h"
 #include "ykpers-json.h"
 
 #include <ykpers.h>
@@ -1143,34 +1144,43 @@ unsigned int ykp_get_acccode_type(const YKP_CONFIG *cfg)
 	return cfg->ykp_acccode_type;
 }
 
+/* ykp_errno of each thread, see _yk_errno_location() in ykcore.c */
+#ifdef HAVE_TLS
+static __thread int ykp_errno_tls;
+
 int * _ykp_errno_location(void)
 {
-	static int tsd_init = 0;
-	static int nothread_errno = 0;
-	YK_DEFINE_TSD_METADATA(errno_key);
-	int rc = 0;
-
-	if (tsd_init == 0) {
-		if ((rc = YK_TSD_INIT(errno_key, free)) == 0) {
-			tsd_init = 1;
-		} else {
-			tsd_init = -1;
-		}
-	}
+	return &ykp_errno_tls;
+}
+#else
+static int ykp_nothread_errno;
+static yk__ONCE_T ykp_errno_once = yk__ONCE_INITIALIZER;
+static int ykp_errno_tsd;
+YK_DEFINE_TSD_METADATA(ykp_errno_key);
 
-	if(YK_TSD_GET(int *, errno_key) == NULL) {
-		void *p = calloc(1, sizeof(int));
-		if (!p) {
-			tsd_init = -1;
-		} else {
-			YK_TSD_SET(errno_key, p);
+static void _ykp_errno_init(void)
+{
+	ykp_errno_tsd = YK_TSD_INIT(ykp_errno_key, free) == 0;
+}
+
+int * _ykp_errno_location(void)
+{
+	int *p;
+
+	yk__once(ykp_errno_once, _ykp_errno_init);
+	if (!ykp_errno_tsd)
+		return &ykp_nothread_errno;
+	p = YK_TSD_GET(int *, ykp_errno_key);
+	if (p == NULL) {
+		p = calloc(1, sizeof(int));
+		if (!p || YK_TSD_SET(ykp_errno_key, p)) {
+			free(p);
+			return &ykp_nothread_errno;
 		}
 	}
-	if (tsd_init == 1) {
-		return YK_TSD_GET(int *, errno_key);
-	}
-	return &nothread_errno;
+	return p;
 }
+#endif
 
 static const char *errtext[] = {
 	"",
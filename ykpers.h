@@ -194,6 +194,24 @@ unsigned int ykp_get_acccode_type(const YKP_CONFIG *cfg);
 
 int ykp_get_supported_key_length(const YKP_CONFIG *cfg);
 
+/* Parallel provisioning of several keys, see ykpers-provision.c */
+typedef struct ykp_provision_result_st {
+	int index;		/* as given to yk_open_key() */
+	unsigned int serial;	/* 0 if it couldn't be read */
+	int rc;			/* 1 if the key was programmed */
+	int core_error;		/* yk_errno on failure */
+	int ykp_error;		/* ykp_errno on failure */
+	unsigned long elapsed_us;
+} YKP_PROVISION_RESULT;
+
+typedef int (*ykp_provision_cb)(int index, unsigned int serial,
+				YK_STATUS *st, YKP_CONFIG *cfg,
+				unsigned char *acc_code, void *userdata);
+
+int ykp_provision(const int *indexes, size_t count, unsigned int threads,
+		  ykp_provision_cb generate, void *userdata,
+		  YKP_PROVISION_RESULT *results, size_t *nresults);
+
 extern int * _ykp_errno_location(void);
 #define ykp_errno (*_ykp_errno_location())
 const char *ykp_strerror(int errnum);